@@ -224,24 +224,118 @@
 */
 
 
-static inline int mandel(float c_re, float c_im, int count)
+//
+// Escape-time iterations --
+//
+// Each iteration policy describes one fractal: start() maps a pixel's
+// coordinates to the initial z and the constant c, and step() advances
+// z by one iteration.  mandel and mandelbrotSerial are templates over
+// the policy, so every fractal gets its own fully inlined loop.
+
+enum {
+    FRACTAL_MANDELBROT,
+    FRACTAL_JULIA,
+    FRACTAL_BURNING_SHIP,
+    FRACTAL_MULTIBROT3,
+    FRACTAL_MULTIBROT4,
+    FRACTAL_MULTIBROT5,
+    FRACTAL_COUNT
+};
+
+typedef struct {
+    int kind;               // one of the FRACTAL_ constants
+    float c_re, c_im;       // constant for FRACTAL_JULIA
+} Fractal;
+
+const static Fractal mandelbrotFractal = { FRACTAL_MANDELBROT, 0.f, 0.f };
+
+// z_0 = c = pixel, z_{n+1} = z_n^2 + c
+struct MandelbrotIteration {
+    MandelbrotIteration() {}
+    explicit MandelbrotIteration(const Fractal&) {}
+
+    inline void start(float x, float y, float& z_re, float& z_im, float& c_re, float& c_im) const {
+        z_re = c_re = x;
+        z_im = c_im = y;
+    }
+
+    inline void step(float& z_re, float& z_im, float c_re, float c_im) const {
+        float new_re = z_re*z_re - z_im*z_im;
+        float new_im = 2.f * z_re * z_im;
+        z_re = c_re + new_re;
+        z_im = c_im + new_im;
+    }
+};
+
+// z_0 = pixel, z_{n+1} = z_n^2 + k for a fixed constant k
+struct JuliaIteration : MandelbrotIteration {
+    float k_re, k_im;
+
+    explicit JuliaIteration(const Fractal& fractal)
+        : k_re(fractal.c_re), k_im(fractal.c_im) {}
+
+    inline void start(float x, float y, float& z_re, float& z_im, float& c_re, float& c_im) const {
+        z_re = x;
+        z_im = y;
+        c_re = k_re;
+        c_im = k_im;
+    }
+};
+
+// z_{n+1} = (|Re z_n| + i|Im z_n|)^2 + c
+struct BurningShipIteration : MandelbrotIteration {
+    BurningShipIteration() {}
+    explicit BurningShipIteration(const Fractal&) {}
+
+    inline void step(float& z_re, float& z_im, float c_re, float c_im) const {
+        float new_re = z_re*z_re - z_im*z_im;
+        float new_im = fabsf(2.f * z_re * z_im);
+        z_re = c_re + new_re;
+        z_im = c_im + new_im;
+    }
+};
+
+// z_{n+1} = z_n^Power + c
+template <int Power>
+struct MultibrotIteration : MandelbrotIteration {
+    MultibrotIteration() {}
+    explicit MultibrotIteration(const Fractal&) {}
+
+    inline void step(float& z_re, float& z_im, float c_re, float c_im) const {
+        float w_re = z_re, w_im = z_im;
+        for (int p = 1; p < Power; ++p) {
+            float new_re = w_re*z_re - w_im*z_im;
+            float new_im = w_re*z_im + w_im*z_re;
+            w_re = new_re;
+            w_im = new_im;
+        }
+        z_re = c_re + w_re;
+        z_im = c_im + w_im;
+    }
+};
+
+template <typename Iteration>
+static inline int mandel(const Iteration& iteration, float x, float y, int count)
 {
-    float z_re = c_re, z_im = c_im;
+    float z_re, z_im, c_re, c_im;
+    iteration.start(x, y, z_re, z_im, c_re, c_im);
     int i;
     for (i = 0; i < count; ++i) {
 
         if (z_re * z_re + z_im * z_im > 4.f)
             break;
 
-        float new_re = z_re*z_re - z_im*z_im;
-        float new_im = 2.f * z_re * z_im;
-        z_re = c_re + new_re;
-        z_im = c_im + new_im;
+        iteration.step(z_re, z_im, c_re, c_im);
     }
 
     return i;
 }
 
+static inline int mandel(float c_re, float c_im, int count)
+{
+    return mandel(MandelbrotIteration(), c_re, c_im, count);
+}
+
 //
 // MandelbrotSerial --
 //
@@ -253,7 +347,11 @@ static inline int mandel(float c_re, float c_im, int count)
 //   into the image viewport.
 // * width, height describe the size of the output image
 // * startRow, totalRows describe how much of the image to compute
+//
+// The template version renders the fractal described by iteration.
+template <typename Iteration>
 void mandelbrotSerial(
+    const Iteration& iteration,
     float x0, float y0, float x1, float y1,
     int width, int height,
     int startRow, int totalRows,
@@ -271,9 +369,88 @@ void mandelbrotSerial(
             float y = y0 + j * dy;
 
             int index = (j * width + i);
-            output[index] = mandel(x, y, maxIterations);
+            output[index] = mandel(iteration, x, y, maxIterations);
+        }
+    }
+}
+
+void mandelbrotSerial(
+    float x0, float y0, float x1, float y1,
+    int width, int height,
+    int startRow, int totalRows,
+    int maxIterations,
+    int output[])
+{
+    mandelbrotSerial(MandelbrotIteration(), x0, y0, x1, y1, width, height,
+                     startRow, totalRows, maxIterations, output);
+}
+
+//
+// Fractal dispatch table --
+//
+// One entry per FRACTAL_ constant, pointing at the instantiation of
+// mandelbrotSerial for that fractal.
+
+typedef void (*FractalSerialFn)(const Fractal& fractal,
+                                float x0, float y0, float x1, float y1,
+                                int width, int height,
+                                int startRow, int totalRows,
+                                int maxIterations, int output[]);
+
+typedef struct {
+    const char* name;
+    FractalSerialFn serial;
+} FractalKernel;
+
+template <typename Iteration>
+static void fractalSerialRows(const Fractal& fractal,
+                              float x0, float y0, float x1, float y1,
+                              int width, int height,
+                              int startRow, int totalRows,
+                              int maxIterations, int output[])
+{
+    mandelbrotSerial(Iteration(fractal), x0, y0, x1, y1, width, height,
+                     startRow, totalRows, maxIterations, output);
+}
+
+const static FractalKernel fractalKernels[FRACTAL_COUNT] = {
+    { "mandelbrot", fractalSerialRows<MandelbrotIteration> },
+    { "julia", fractalSerialRows<JuliaIteration> },
+    { "burningship", fractalSerialRows<BurningShipIteration> },
+    { "multibrot3", fractalSerialRows<MultibrotIteration<3> > },
+    { "multibrot4", fractalSerialRows<MultibrotIteration<4> > },
+    { "multibrot5", fractalSerialRows<MultibrotIteration<5> > },
+};
+
+void fractalSerial(const Fractal& fractal,
+                   float x0, float y0, float x1, float y1,
+                   int width, int height,
+                   int startRow, int totalRows,
+                   int maxIterations, int output[])
+{
+    fractalKernels[fractal.kind].serial(fractal, x0, y0, x1, y1, width, height,
+                                        startRow, totalRows, maxIterations, output);
+}
+
+//
+// parseFractal --
+//
+// Parse "name" or, for Julia sets, "julia:RE,IM".  Returns false if the
+// name is not in the dispatch table.
+bool parseFractal(const char* spec, Fractal* fractal) {
+    fractal->c_re = -.8f;
+    fractal->c_im = .156f;
+    size_t nameLength = strcspn(spec, ":");
+    for (int kind = 0; kind < FRACTAL_COUNT; kind++) {
+        if (strlen(fractalKernels[kind].name) == nameLength &&
+            strncmp(fractalKernels[kind].name, spec, nameLength) == 0) {
+            fractal->kind = kind;
+            if (spec[nameLength] == ':')
+                return sscanf(spec + nameLength + 1, "%f,%f", &fractal->c_re, &fractal->c_im) == 2;
+            return true;
         }
     }
+    return false;
 }
 
 void
@@ -327,6 +504,7 @@ void usage(const char* progname) {
     printf("Program Options:\n");
     printf("  -t  --threads <N>  Use N threads\n");
     printf("  -v  --view <INT>   Use specified view settings\n");
+    printf("  -k  --kernel <NAME> Render mandelbrot, julia[:RE,IM], burningship or multibrot3-5\n");
     printf("  -?  --help         This message\n");
 }
 
@@ -354,6 +532,7 @@ typedef struct {
     unsigned int height;
     int maxIterations;
     int* output;
+    const Fractal* fractal;
     int threadId;
     int numThreads;
 } WorkerArgs;
@@ -370,9 +549,9 @@ void* workerThreadStart(void* threadArgs) {
     // get the number of rows for each thread to calculte
     int rowsForEachThread = args -> height / args -> numThreads;
     // calculate the part of the image for current pthread
-    mandelbrotSerial(args -> x0, args -> y0, args -> x1, args -> y1, 
-                    args -> width, args -> height, args -> threadId * rowsForEachThread, 
-                    rowsForEachThread, args -> maxIterations, args -> output);
+    fractalSerial(*args -> fractal, args -> x0, args -> y0, args -> x1, args -> y1, 
+                  args -> width, args -> height, args -> threadId * rowsForEachThread, 
+                  rowsForEachThread, args -> maxIterations, args -> output);
 
     printf("Hello world from thread %d\n", args->threadId);
 	
@@ -383,12 +562,14 @@ void* workerThreadStart(void* threadArgs) {
 // MandelbrotThread --
 //
 // Multi-threaded implementation of mandelbrot set image generation.
-// Multi-threading performed via pthreads.
+// Multi-threading performed via pthreads.  Renders the Mandelbrot set
+// unless another fractal is given.
 void mandelbrotThread(
     int numThreads,
     float x0, float y0, float x1, float y1,
     int width, int height,
-    int maxIterations, int output[])
+    int maxIterations, int output[],
+    const Fractal* fractal = NULL)
 {
     const static int MAX_THREADS = 32;
 
@@ -411,6 +592,7 @@ void mandelbrotThread(
         args[i].height = height;
         args[i].maxIterations = maxIterations;
         args[i].output = output;
+        args[i].fractal = fractal ? fractal : &mandelbrotFractal;
         args[i].threadId = i;
         args[i].numThreads = numThreads;
     }
@@ -436,6 +618,7 @@ int main(int argc, char** argv) {
     const unsigned int height = 800;
     const int maxIterations = 256;
     int numThreads = 2;
+    Fractal fractal = mandelbrotFractal;
 
     float x0 = -2;
     float x1 = 1;
@@ -447,11 +630,12 @@ int main(int argc, char** argv) {
     static struct option long_options[] = {
         {"threads", 1, 0, 't'},
         {"view", 1, 0, 'v'},
+        {"kernel", 1, 0, 'k'},
         {"help", 0, 0, '?'},
         {0 ,0, 0, 0}
     };
 
-    while ((opt = getopt_long(argc, argv, "t:v:?", long_options, NULL)) != EOF) {
+    while ((opt = getopt_long(argc, argv, "t:v:k:?", long_options, NULL)) != EOF) {
 
         switch (opt) {
         case 't':
@@ -474,6 +658,14 @@ int main(int argc, char** argv) {
             }
             break;
         }
+        case 'k':
+        {
+            if (!parseFractal(optarg, &fractal)) {
+                fprintf(stderr, "Invalid kernel %s\n", optarg);
+                return 1;
+            }
+            break;
+        }
         case '?':
         default:
             usage(argv[0]);
@@ -494,7 +686,7 @@ int main(int argc, char** argv) {
     double minSerial = 1e30;
     for (int i = 0; i < 5; ++i) {
         double startTime = CycleTimer::currentSeconds();
-        mandelbrotSerial(x0, y0, x1, y1, width, height, 0, height, maxIterations, output_serial);
+        fractalSerial(fractal, x0, y0, x1, y1, width, height, 0, height, maxIterations, output_serial);
         double endTime = CycleTimer::currentSeconds();
         minSerial = std::min(minSerial, endTime - startTime);
     }
@@ -509,7 +701,7 @@ int main(int argc, char** argv) {
     double minThread = 1e30;
     for (int i = 0; i < 5; ++i) {
         double startTime = CycleTimer::currentSeconds();
-        mandelbrotThread(numThreads, x0, y0, x1, y1, width, height, maxIterations, output_thread);
+        mandelbrotThread(numThreads, x0, y0, x1, y1, width, height, maxIterations, output_thread, &fractal);
         double endTime = CycleTimer::currentSeconds();
         minThread = std::min(minThread, endTime - startTime);
     }
@@ -6,6 +6,32 @@
 #include <pthread.h>
 #include <immintrin.h>  
 #include <avx2intrin.h>
+#include <errno.h>
+#include <unistd.h>
+#include <signal.h>
+#include <poll.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <limits.h>
+#include <atomic>
+#include <deque>
+#include <list>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+#ifdef MANDELBROT_PARALLEL_STL
+#include <execution>
+#endif
+
+#include "mandelbrot_render.h"
 
 #ifndef _SYRAH_CYCLE_TIMER_H_
 #define _SYRAH_CYCLE_TIMER_H_
@@ -226,39 +252,180 @@
 */
 
 
-static inline __m256i mandel(__m256 c_re, __m256 c_im, int count)
-{
-    __m256 z_re = c_re, z_im = c_im;
-    int i;
-    float bounds[8] = { 4.f, 4.f, 4.f, 4.f, 4.f, 4.f, 4.f, 4.f };
-    float coffs[8] = { 2.f, 2.f, 2.f, 2.f, 2.f, 2.f, 2.f, 2.f };
-    __m256 bound = _mm256_loadu_ps(bounds);
-    __m256 coff = _mm256_loadu_ps(coffs);
-    int cntRsts[8] = { 0 };
+//
+// Escape-time iterations --
+//
+// Each iteration policy describes one fractal: start() maps a pixel's
+// coordinates to the initial z and the constant c, and step() advances
+// z by one iteration.  Both come in a scalar and an AVX2 form that do
+// the same floating point operations in the same order, so the two
+// kernels below give identical counts.  The kernels are templates over
+// the policy, so every fractal gets its own fully inlined loop.
 
-    for (i = 0; i < count; ++i) {
-        __m256 mul_z_re = _mm256_mul_ps(z_re, z_re);
-        __m256 mul_z_im = _mm256_mul_ps(z_im, z_im);
-        __m256 mul_z_re_im = _mm256_mul_ps(z_re, z_im);
-        __m256 add_rst = _mm256_add_ps(mul_z_re, mul_z_im);
-        __m256i storeMask = _mm256_cvttps_epi32(_mm256_cmp_ps(add_rst, bound, 1));
+enum {
+    FRACTAL_MANDELBROT,
+    FRACTAL_JULIA,
+    FRACTAL_BURNING_SHIP,
+    FRACTAL_MULTIBROT3,
+    FRACTAL_MULTIBROT4,
+    FRACTAL_MULTIBROT5,
+    FRACTAL_COUNT
+};
 
-        int isSet[8];
-        _mm256_storeu_si256((__m256i*)isSet, storeMask);
-        int left = 0;
-        for (int j = 0; j < 8; ++j) {
-            if (isSet[j]) { cntRsts[j] = i; left = 1; }
-        }
-        if (!left) { break; }
+typedef struct {
+    int kind;               // one of the FRACTAL_ constants
+    float c_re, c_im;       // constant for FRACTAL_JULIA
+} Fractal;
+
+const static Fractal mandelbrotFractal = { FRACTAL_MANDELBROT, 0.f, 0.f };
+
+// z_0 = c = pixel, z_{n+1} = z_n^2 + c
+struct MandelbrotIteration {
+    MandelbrotIteration() {}
+    explicit MandelbrotIteration(const Fractal&) {}
+
+    template <typename V>
+    inline void start(V x, V y, V& z_re, V& z_im, V& c_re, V& c_im) const {
+        z_re = c_re = x;
+        z_im = c_im = y;
+    }
+
+    inline void step(float& z_re, float& z_im, float c_re, float c_im) const {
+        float new_re = z_re*z_re - z_im*z_im;
+        float new_im = 2.f * z_re * z_im;
+        z_re = c_re + new_re;
+        z_im = c_im + new_im;
+    }
+
+    inline void step(__m256& z_re, __m256& z_im, __m256 c_re, __m256 c_im) const {
+        __m256 new_re = _mm256_sub_ps(_mm256_mul_ps(z_re, z_re), _mm256_mul_ps(z_im, z_im));
+        __m256 new_im = _mm256_mul_ps(_mm256_add_ps(z_re, z_re), z_im);
+        z_re = _mm256_add_ps(c_re, new_re);
+        z_im = _mm256_add_ps(c_im, new_im);
+    }
+};
+
+// z_0 = pixel, z_{n+1} = z_n^2 + k for a fixed constant k
+struct JuliaIteration : MandelbrotIteration {
+    float k_re, k_im;
+
+    explicit JuliaIteration(const Fractal& fractal)
+        : k_re(fractal.c_re), k_im(fractal.c_im) {}
+
+    inline void start(float x, float y, float& z_re, float& z_im, float& c_re, float& c_im) const {
+        z_re = x;
+        z_im = y;
+        c_re = k_re;
+        c_im = k_im;
+    }
+
+    inline void start(__m256 x, __m256 y, __m256& z_re, __m256& z_im, __m256& c_re, __m256& c_im) const {
+        z_re = x;
+        z_im = y;
+        c_re = _mm256_set1_ps(k_re);
+        c_im = _mm256_set1_ps(k_im);
+    }
+};
+
+// z_{n+1} = (|Re z_n| + i|Im z_n|)^2 + c
+struct BurningShipIteration : MandelbrotIteration {
+    BurningShipIteration() {}
+    explicit BurningShipIteration(const Fractal&) {}
 
-        __m256 new_re = _mm256_sub_ps(mul_z_re, mul_z_im);
-        __m256 new_im = _mm256_mul_ps(coff, mul_z_re_im);
+    inline void step(float& z_re, float& z_im, float c_re, float c_im) const {
+        float new_re = z_re*z_re - z_im*z_im;
+        float new_im = fabsf(2.f * z_re * z_im);
+        z_re = c_re + new_re;
+        z_im = c_im + new_im;
+    }
 
+    inline void step(__m256& z_re, __m256& z_im, __m256 c_re, __m256 c_im) const {
+        __m256 signBit = _mm256_set1_ps(-0.f);
+        __m256 new_re = _mm256_sub_ps(_mm256_mul_ps(z_re, z_re), _mm256_mul_ps(z_im, z_im));
+        __m256 new_im = _mm256_andnot_ps(signBit, _mm256_mul_ps(_mm256_add_ps(z_re, z_re), z_im));
         z_re = _mm256_add_ps(c_re, new_re);
         z_im = _mm256_add_ps(c_im, new_im);
     }
+};
+
+// z_{n+1} = z_n^Power + c
+template <int Power>
+struct MultibrotIteration : MandelbrotIteration {
+    MultibrotIteration() {}
+    explicit MultibrotIteration(const Fractal&) {}
+
+    inline void step(float& z_re, float& z_im, float c_re, float c_im) const {
+        float w_re = z_re, w_im = z_im;
+        for (int p = 1; p < Power; ++p) {
+            float new_re = w_re*z_re - w_im*z_im;
+            float new_im = w_re*z_im + w_im*z_re;
+            w_re = new_re;
+            w_im = new_im;
+        }
+        z_re = c_re + w_re;
+        z_im = c_im + w_im;
+    }
+
+    inline void step(__m256& z_re, __m256& z_im, __m256 c_re, __m256 c_im) const {
+        __m256 w_re = z_re, w_im = z_im;
+        for (int p = 1; p < Power; ++p) {
+            __m256 new_re = _mm256_sub_ps(_mm256_mul_ps(w_re, z_re), _mm256_mul_ps(w_im, z_im));
+            __m256 new_im = _mm256_add_ps(_mm256_mul_ps(w_re, z_im), _mm256_mul_ps(w_im, z_re));
+            w_re = new_re;
+            w_im = new_im;
+        }
+        z_re = _mm256_add_ps(c_re, w_re);
+        z_im = _mm256_add_ps(c_im, w_im);
+    }
+};
+
+template <typename Iteration>
+static inline int mandel(const Iteration& iteration, float x, float y, int count)
+{
+    float z_re, z_im, c_re, c_im;
+    iteration.start(x, y, z_re, z_im, c_re, c_im);
+    int i;
+    for (i = 0; i < count; ++i) {
+
+        if (z_re * z_re + z_im * z_im > 4.f)
+            break;
+
+        iteration.step(z_re, z_im, c_re, c_im);
+    }
+
+    return i;
+}
+
+//
+// The AVX2 kernel keeps iterating all 8 lanes until every lane has
+// escaped.  A lane's count stops growing, for good, the first time its
+// |z|^2 > 4, which gives the same count as the scalar kernel.
+template <typename Iteration>
+static inline __m256i mandel(const Iteration& iteration, __m256 x, __m256 y, int count)
+{
+    __m256 z_re, z_im, c_re, c_im;
+    iteration.start(x, y, z_re, z_im, c_re, c_im);
+    __m256 bound = _mm256_set1_ps(4.f);
+    __m256 active = _mm256_castsi256_ps(_mm256_set1_epi32(-1));
+    __m256i counts = _mm256_setzero_si256();
+
+    for (int i = 0; i < count; ++i) {
+        __m256 mag = _mm256_add_ps(_mm256_mul_ps(z_re, z_re), _mm256_mul_ps(z_im, z_im));
+        active = _mm256_and_ps(active, _mm256_cmp_ps(mag, bound, _CMP_NGT_UQ));
+        if (_mm256_movemask_ps(active) == 0)
+            break;
+
+        // active lanes are all ones, i.e. -1
+        counts = _mm256_sub_epi32(counts, _mm256_castps_si256(active));
+        iteration.step(z_re, z_im, c_re, c_im);
+    }
+
+    return counts;
+}
 
-    return _mm256_loadu_si256((__m256i*)cntRsts);
+static inline __m256i mandel(__m256 c_re, __m256 c_im, int count)
+{
+    return mandel(MandelbrotIteration(), c_re, c_im, count);
 }
 
 //
@@ -272,7 +439,12 @@ static inline __m256i mandel(__m256 c_re, __m256 c_im, int count)
 //   into the image viewport.
 // * width, height describe the size of the output image
 // * startRow, totalRows describe how much of the image to compute
+//
+// The template version renders the fractal described by iteration.
+// Columns past the last multiple of 8 go through the scalar kernel.
+template <typename Iteration>
 void mandelbrotSerial(
+    const Iteration& iteration,
     float x0, float y0, float x1, float y1,
     int width, int height,
     int startRow, int totalRows,
@@ -285,198 +457,6323 @@ void mandelbrotSerial(
     int endRow = startRow + totalRows;
 
     for (int j = startRow; j < endRow; j++) {
-        for (int i = 0; i < width; i += 8) {
-            float xs[8], ys[8];
-            for (int k = 0; k < 8; ++k) {
+        float y = y0 + j * dy;
+        int i = 0;
+        for (; i + 8 <= width; i += 8) {
+            float xs[8];
+            for (int k = 0; k < 8; ++k)
                 xs[k] = x0 + (i + k) * dx;
-                ys[k] = y0 + (j + k) * dy;
-            }
-            __m256 x = _mm256_loadu_ps(xs);
-            __m256 y = _mm256_loadu_ps(ys);
-            __m256i rst = mandel(x, y, maxIterations);
+            __m256i rst = mandel(iteration, _mm256_loadu_ps(xs), _mm256_set1_ps(y), maxIterations);
 
             int index = (j * width + i);
             _mm256_storeu_si256((__m256i*)(output + index), rst);
         }
+        for (; i < width; ++i)
+            output[j * width + i] = mandel(iteration, x0 + i * dx, y, maxIterations);
     }
 }
 
-void
-writePPMImage(int* data, int width, int height, const char *filename, int maxIterations)
+void mandelbrotSerial(
+    float x0, float y0, float x1, float y1,
+    int width, int height,
+    int startRow, int totalRows,
+    int maxIterations,
+    int output[])
 {
-    FILE *fp = fopen(filename, "wb");
+    mandelbrotSerial(MandelbrotIteration(), x0, y0, x1, y1, width, height,
+                     startRow, totalRows, maxIterations, output);
+}
 
-    // write ppm header
-    fprintf(fp, "P6\n");
-    fprintf(fp, "%d %d\n", width, height);
-    fprintf(fp, "255\n");
+//
+// Fixed-point kernel --
+//
+// For shallow views most of the float mantissa is wasted.  mandelFixed
+// iterates the Mandelbrot set on 16 pixels at once, in 16-bit lanes
+// holding z and c in Q12 (range [-8, 8), steps of 1/FIXED_ONE).
+// _mm256_mulhrs_epi16 gives round(a * b / 2^15), so the Q12 products
+// are taken from operands shifted up to Q13 and Q14 first; those fit
+// while |Re z| and |Im z| are below 2.  The squares are taken of |z|
+// shifted with saturation: a part of 2 or more saturates to just under
+// 2 in Q14, which still leaves its square at 4 or more, so the lane
+// escapes.  Every lane that stays active has both parts below 2.
+//
+// Rounding differs from the float kernel, so pixels near the boundary
+// of the set get different counts, and next to the set the difference
+// can be most of the iteration limit.  Nothing here bounds it:
+// fixedPointAllowed only keeps the kernel to coarse, shallow views,
+// whose pixels are at least FIXED_MIN_STEPS steps apart, where a few
+// percent of the pixels differ.  The renderer library therefore uses it
+// only when asked to (mandelbrotRendererSetExact(renderer, false)).
 
-    for (int i = 0; i < width*height; ++i) {
+const static int FIXED_FRACTION_BITS = 12;
+const static float FIXED_ONE = 1 << FIXED_FRACTION_BITS;
+const static float FIXED_MIN_STEPS = 16;
+const static int FIXED_MAX_ITERATIONS = 256;
 
-        // Clamp iteration count for this pixel, then scale the value
-        // to 0-1 range.  Raise resulting value to a power (<1) to
-        // increase brightness of low iteration count
-        // pixels. a.k.a. Make things look cooler.
+static inline __m256i mandelFixed(__m256i c_re, __m256i c_im, int count)
+{
+    __m256i z_re = c_re, z_im = c_im;
+    __m256i bound = _mm256_set1_epi16(4 << FIXED_FRACTION_BITS);
+    __m256i active = _mm256_set1_epi16(-1);
+    __m256i counts = _mm256_setzero_si256();
 
-        float mapped = pow( std::min(static_cast<float>(maxIterations),
-                                     static_cast<float>(data[i])) / 256.f, .5f);
+    for (int i = 0; i < count; ++i) {
+        // |Re z| in Q13 and, saturated at 2, in Q14
+        __m256i re13 = _mm256_abs_epi16(z_re);
+        re13 = _mm256_adds_epi16(re13, re13);
+        __m256i re_re = _mm256_mulhrs_epi16(re13, _mm256_adds_epi16(re13, re13));
+        __m256i im13 = _mm256_abs_epi16(z_im);
+        im13 = _mm256_adds_epi16(im13, im13);
+        __m256i im_im = _mm256_mulhrs_epi16(im13, _mm256_adds_epi16(im13, im13));
+        __m256i mag = _mm256_adds_epi16(re_re, im_im);
+        active = _mm256_andnot_si256(_mm256_cmpgt_epi16(mag, bound), active);
+        if (_mm256_testz_si256(active, active))
+            break;
 
-        // convert back into 0-255 range, 8-bit channels
-        unsigned char result = static_cast<unsigned char>(255.f * mapped);
-        for (int j = 0; j < 3; ++j)
-            fputc(result, fp);
+        // active lanes are all ones, i.e. -1
+        counts = _mm256_sub_epi16(counts, active);
+        // 2 * re * im in Q12 is re * im in Q13
+        __m256i re_im = _mm256_mulhrs_epi16(_mm256_slli_epi16(z_re, 2), _mm256_slli_epi16(z_im, 2));
+        z_re = _mm256_add_epi16(c_re, _mm256_sub_epi16(re_re, im_im));
+        z_im = _mm256_add_epi16(c_im, re_im);
     }
-    fclose(fp);
-    printf("Wrote image file %s\n", filename);
+
+    return counts;
 }
 
-void
-scaleAndShift(float& x0, float& x1, float& y0, float& y1,
-              float scale,
-              float shiftX, float shiftY)
+//
+// fixedPointAllowed --
+//
+// True if mandelbrotFixedSerial may stand in for the float kernel on
+// this view: the Mandelbrot set, coordinates inside the Q12 range,
+// pixels at least FIXED_MIN_STEPS apart and at most
+// FIXED_MAX_ITERATIONS iterations.
+bool fixedPointAllowed(const Fractal& fractal, float x0, float y0, float x1, float y1,
+                       int width, int height, int maxIterations)
 {
-
-    x0 *= scale;
-    x1 *= scale;
-    y0 *= scale;
-    y1 *= scale;
-    x0 += shiftX;
-    x1 += shiftX;
-    y0 += shiftY;
-    y1 += shiftY;
-
+    float limit = 8.f - 1.f / FIXED_ONE;
+    return fractal.kind == FRACTAL_MANDELBROT && maxIterations <= FIXED_MAX_ITERATIONS &&
+           fabsf(x0) < limit && fabsf(x1) < limit && fabsf(y0) < limit && fabsf(y1) < limit &&
+           fabsf(x1 - x0) / width * FIXED_ONE >= FIXED_MIN_STEPS &&
+           fabsf(y1 - y0) / height * FIXED_ONE >= FIXED_MIN_STEPS;
 }
 
-void usage(const char* progname) {
-    printf("Usage: %s [options]\n", progname);
-    printf("Program Options:\n");
-    printf("  -t  --threads <N>  Use N threads\n");
-    printf("  -v  --view <INT>   Use specified view settings\n");
-    printf("  -?  --help         This message\n");
+// Convert 16 floats to Q12, rounding to nearest.
+static inline __m256i fixedFromFloats(const float values[16])
+{
+    __m256 scale = _mm256_set1_ps(FIXED_ONE);
+    __m256i lo = _mm256_cvtps_epi32(_mm256_mul_ps(_mm256_loadu_ps(values), scale));
+    __m256i hi = _mm256_cvtps_epi32(_mm256_mul_ps(_mm256_loadu_ps(values + 8), scale));
+    // packs works within 128-bit halves; put the lanes back in order
+    return _mm256_permute4x64_epi64(_mm256_packs_epi32(lo, hi), 0xd8);
 }
 
-bool verifyResult (int *gold, int *result, int width, int height) {
+//
+// mandelbrotFixedSerial --
+//
+// mandelbrotSerial with mandelFixed, 16 columns at a time.  The last
+// vector of a row is padded by repeating the last column.
+void mandelbrotFixedSerial(
+    float x0, float y0, float x1, float y1,
+    int width, int height,
+    int startRow, int totalRows,
+    int maxIterations,
+    int output[])
+{
+    float dx = (x1 - x0) / width;
+    float dy = (y1 - y0) / height;
 
-    int i, j;
+    int endRow = startRow + totalRows;
+
+    for (int j = startRow; j < endRow; j++) {
+        __m256i c_im = _mm256_set1_epi16(static_cast<short>(lrintf((y0 + j * dy) * FIXED_ONE)));
+        for (int i = 0; i < width; i += 16) {
+            float xs[16];
+            for (int k = 0; k < 16; ++k)
+                xs[k] = x0 + std::min(i + k, width - 1) * dx;
 
-    for (i = 0; i < height; i++) {
-        for (j = 0; j < width; j++) {
-            if (gold[i * width + j] != result[i * width + j]) {
-                printf ("Mismatch : [%d][%d], Expected : %d, Actual : %d\n",
-                            i, j, gold[i * width + j], result[i * width + j]);
-                return 0;
+            __m256i counts = mandelFixed(fixedFromFloats(xs), c_im, maxIterations);
+            __m256i countsLo = _mm256_cvtepi16_epi32(_mm256_castsi256_si128(counts));
+            __m256i countsHi = _mm256_cvtepi16_epi32(_mm256_extracti128_si256(counts, 1));
+            int index = j * width + i;
+            if (i + 16 <= width) {
+                _mm256_storeu_si256((__m256i*)(output + index), countsLo);
+                _mm256_storeu_si256((__m256i*)(output + index + 8), countsHi);
+            } else {
+                int wide[16];
+                _mm256_storeu_si256((__m256i*)wide, countsLo);
+                _mm256_storeu_si256((__m256i*)(wide + 8), countsHi);
+                memcpy(output + index, wide, (width - i) * sizeof(int));
             }
         }
     }
-
-    return 1;
 }
 
-typedef struct {
-    float x0, x1;
-    float y0, y1;
-    unsigned int width;
-    unsigned int height;
-    int maxIterations;
-    int* output;
-    int threadId;
-    int numThreads;
-} WorkerArgs;
-
 //
-// workerThreadStart --
+// Batched bailout --
 //
-// Thread entrypoint.
-void* workerThreadStart(void* threadArgs) {
+// mandelBatched runs Batch iterations between escape branches.  Inside
+// a batch the |z|^2 > 4 test is still evaluated every iteration, but
+// only OR-ed into a flag, so the loop carries no branch.  If the flag
+// is set after the batch, z is rolled back to the snapshot taken at its
+// start and the batch is replayed one checked iteration at a time.  The
+// counts are therefore exactly those of mandel.
 
-    WorkerArgs* args = static_cast<WorkerArgs*>(threadArgs);
+template <int Batch, typename Iteration>
+static inline int mandelBatched(const Iteration& iteration, float x, float y, int count)
+{
+    float z_re, z_im, c_re, c_im;
+    iteration.start(x, y, z_re, z_im, c_re, c_im);
+    int i = 0;
 
-    // Implement worker thread here.
-    // get the number of rows for each thread to calculte
-    int rowsForEachThread = args -> height / args -> numThreads;
-    // calculate the part of the image for current pthread
-    mandelbrotSerial(args -> x0, args -> y0, args -> x1, args -> y1, 
-                    args -> width, args -> height, args -> threadId * rowsForEachThread, 
-                    rowsForEachThread, args -> maxIterations, args -> output);
+    for (; i + Batch <= count; i += Batch) {
+        float s_re = z_re, s_im = z_im;
+        bool escaped = false;
+        for (int k = 0; k < Batch; ++k) {
+            escaped |= z_re * z_re + z_im * z_im > 4.f;
+            iteration.step(z_re, z_im, c_re, c_im);
+        }
+        if (escaped) {
+            z_re = s_re;
+            z_im = s_im;
+            break;
+        }
+    }
 
-    printf("Hello world from thread %d\n", args->threadId);
-	
-    return NULL;
+    // the replayed batch, or whatever is left over
+    for (; i < count; ++i) {
+
+        if (z_re * z_re + z_im * z_im > 4.f)
+            break;
+
+        iteration.step(z_re, z_im, c_re, c_im);
+    }
+
+    return i;
+}
+
+template <int Batch, typename Iteration>
+static inline __m256i mandelBatched(const Iteration& iteration, __m256 x, __m256 y, int count)
+{
+    __m256 z_re, z_im, c_re, c_im;
+    iteration.start(x, y, z_re, z_im, c_re, c_im);
+    __m256 bound = _mm256_set1_ps(4.f);
+    __m256 active = _mm256_castsi256_ps(_mm256_set1_epi32(-1));
+    __m256i counts = _mm256_setzero_si256();
+    __m256i batch = _mm256_set1_epi32(Batch);
+    int i = 0;
+
+    for (; i + Batch <= count; i += Batch) {
+        __m256 s_re = z_re, s_im = z_im;
+        __m256 escaped = _mm256_setzero_ps();
+        for (int k = 0; k < Batch; ++k) {
+            __m256 mag = _mm256_add_ps(_mm256_mul_ps(z_re, z_re), _mm256_mul_ps(z_im, z_im));
+            escaped = _mm256_or_ps(escaped, _mm256_cmp_ps(mag, bound, _CMP_GT_OQ));
+            iteration.step(z_re, z_im, c_re, c_im);
+        }
+
+        if (_mm256_movemask_ps(_mm256_and_ps(escaped, active)) == 0) {
+            counts = _mm256_add_epi32(counts, _mm256_and_si256(batch, _mm256_castps_si256(active)));
+            continue;
+        }
+
+        // some lane escaped during the batch: replay it with the checks
+        // of the per-iteration kernel
+        z_re = s_re;
+        z_im = s_im;
+        for (int k = 0; k < Batch; ++k) {
+            __m256 mag = _mm256_add_ps(_mm256_mul_ps(z_re, z_re), _mm256_mul_ps(z_im, z_im));
+            active = _mm256_and_ps(active, _mm256_cmp_ps(mag, bound, _CMP_NGT_UQ));
+            if (_mm256_movemask_ps(active) == 0)
+                return counts;
+            counts = _mm256_sub_epi32(counts, _mm256_castps_si256(active));
+            iteration.step(z_re, z_im, c_re, c_im);
+        }
+    }
+
+    for (; i < count; ++i) {
+        __m256 mag = _mm256_add_ps(_mm256_mul_ps(z_re, z_re), _mm256_mul_ps(z_im, z_im));
+        active = _mm256_and_ps(active, _mm256_cmp_ps(mag, bound, _CMP_NGT_UQ));
+        if (_mm256_movemask_ps(active) == 0)
+            break;
+        counts = _mm256_sub_epi32(counts, _mm256_castps_si256(active));
+        iteration.step(z_re, z_im, c_re, c_im);
+    }
+
+    return counts;
 }
 
 //
-// MandelbrotThread --
+// mandelbrotSerialBatched --
 //
-// Multi-threaded implementation of mandelbrot set image generation.
-// Multi-threading performed via pthreads.
-void mandelbrotThread(
-    int numThreads,
+// mandelbrotSerial using mandelBatched<Batch>.
+template <int Batch, typename Iteration>
+void mandelbrotSerialBatched(
+    const Iteration& iteration,
     float x0, float y0, float x1, float y1,
     int width, int height,
-    int maxIterations, int output[])
+    int startRow, int totalRows,
+    int maxIterations,
+    int output[])
 {
-    const static int MAX_THREADS = 32;
+    float dx = (x1 - x0) / width;
+    float dy = (y1 - y0) / height;
 
-    if (numThreads > MAX_THREADS)
-    {
-        fprintf(stderr, "Error: Max allowed threads is %d\n", MAX_THREADS);
-        exit(1);
-    }
+    int endRow = startRow + totalRows;
 
-    pthread_t workers[MAX_THREADS];
-    WorkerArgs args[MAX_THREADS];
+    for (int j = startRow; j < endRow; j++) {
+        float y = y0 + j * dy;
+        int i = 0;
+        for (; i + 8 <= width; i += 8) {
+            float xs[8];
+            for (int k = 0; k < 8; ++k)
+                xs[k] = x0 + (i + k) * dx;
+            __m256i rst = mandelBatched<Batch>(iteration, _mm256_loadu_ps(xs), _mm256_set1_ps(y), maxIterations);
 
-    for (int i=0; i<numThreads; i++) {
-        // Set thread arguments here.
-        args[i].x0 = x0;
-        args[i].x1 = x1;
-        args[i].y0 = y0;
-        args[i].y1 = y1;
-        args[i].width = width;
-        args[i].height = height;
-        args[i].maxIterations = maxIterations;
-        args[i].output = output;
-        args[i].threadId = i;
-        args[i].numThreads = numThreads;
+            int index = (j * width + i);
+            _mm256_storeu_si256((__m256i*)(output + index), rst);
+        }
+        for (; i < width; ++i)
+            output[j * width + i] = mandelBatched<Batch>(iteration, x0 + i * dx, y, maxIterations);
     }
+}
 
-    // Fire up the worker threads.  Note that numThreads-1 pthreads
-    // are created and the main app thread is used as a worker as
-    // well.
+//
+// Interleaved kernel --
+//
+// Each iteration of mandel is a chain of dependent multiplies and adds,
+// so a single vector leaves the core mostly waiting on latency.
+// mandelInterleaved iterates Vectors independent 8-pixel vectors in
+// lockstep, giving the scheduler Vectors chains to overlap.  The loop
+// runs until every lane of every vector has escaped, and each lane's
+// count is exactly the one mandel would give.
 
-    for (int i=1; i<numThreads; i++)
-        pthread_create(&workers[i], NULL, workerThreadStart, &args[i]);
+template <int Vectors, typename Iteration>
+static inline void mandelInterleaved(const Iteration& iteration,
+                                     const __m256* x, const __m256* y,
+                                     int count, __m256i* counts)
+{
+    __m256 z_re[Vectors], z_im[Vectors], c_re[Vectors], c_im[Vectors], active[Vectors];
+    __m256 bound = _mm256_set1_ps(4.f);
+    for (int v = 0; v < Vectors; ++v) {
+        iteration.start(x[v], y[v], z_re[v], z_im[v], c_re[v], c_im[v]);
+        active[v] = _mm256_castsi256_ps(_mm256_set1_epi32(-1));
+        counts[v] = _mm256_setzero_si256();
+    }
 
-    workerThreadStart(&args[0]);
+    for (int i = 0; i < count; ++i) {
+        __m256 any = _mm256_setzero_ps();
+        for (int v = 0; v < Vectors; ++v) {
+            __m256 mag = _mm256_add_ps(_mm256_mul_ps(z_re[v], z_re[v]), _mm256_mul_ps(z_im[v], z_im[v]));
+            active[v] = _mm256_and_ps(active[v], _mm256_cmp_ps(mag, bound, _CMP_NGT_UQ));
+            any = _mm256_or_ps(any, active[v]);
+        }
+        if (_mm256_movemask_ps(any) == 0)
+            break;
 
-    // wait for worker threads to complete
-    for (int i=1; i<numThreads; i++)
-        pthread_join(workers[i], NULL);
+        for (int v = 0; v < Vectors; ++v) {
+            counts[v] = _mm256_sub_epi32(counts[v], _mm256_castps_si256(active[v]));
+            iteration.step(z_re[v], z_im[v], c_re[v], c_im[v]);
+        }
+    }
 }
 
+//
+// mandelbrotSerialInterleaved --
+//
+// mandelbrotSerial computing 8 * Vectors pixels of a row at a time with
+// mandelInterleaved.  The rest of the row falls back to mandel.
+template <int Vectors, typename Iteration>
+void mandelbrotSerialInterleaved(
+    const Iteration& iteration,
+    float x0, float y0, float x1, float y1,
+    int width, int height,
+    int startRow, int totalRows,
+    int maxIterations,
+    int output[])
+{
+    float dx = (x1 - x0) / width;
+    float dy = (y1 - y0) / height;
 
-int main(int argc, char** argv) {
+    int endRow = startRow + totalRows;
 
-    const unsigned int width = 1200;
-    const unsigned int height = 800;
-    const int maxIterations = 256;
-    int numThreads = 2;
+    for (int j = startRow; j < endRow; j++) {
+        float y = y0 + j * dy;
+        int i = 0;
+        for (; i + 8 * Vectors <= width; i += 8 * Vectors) {
+            __m256 xv[Vectors], yv[Vectors];
+            __m256i rst[Vectors];
+            for (int v = 0; v < Vectors; ++v) {
+                float xs[8];
+                for (int k = 0; k < 8; ++k)
+                    xs[k] = x0 + (i + 8 * v + k) * dx;
+                xv[v] = _mm256_loadu_ps(xs);
+                yv[v] = _mm256_set1_ps(y);
+            }
+            mandelInterleaved<Vectors>(iteration, xv, yv, maxIterations, rst);
 
-    float x0 = -2;
-    float x1 = 1;
-    float y0 = -1;
-    float y1 = 1;
+            for (int v = 0; v < Vectors; ++v)
+                _mm256_storeu_si256((__m256i*)(output + j * width + i + 8 * v), rst[v]);
+        }
+        for (; i + 8 <= width; i += 8) {
+            float xs[8];
+            for (int k = 0; k < 8; ++k)
+                xs[k] = x0 + (i + k) * dx;
+            __m256i rst = mandel(iteration, _mm256_loadu_ps(xs), _mm256_set1_ps(y), maxIterations);
+            _mm256_storeu_si256((__m256i*)(output + j * width + i), rst);
+        }
+        for (; i < width; ++i)
+            output[j * width + i] = mandel(iteration, x0 + i * dx, y, maxIterations);
+    }
+}
 
-    // parse commandline options ////////////////////////////////////////////
-    int opt;
-    static struct option long_options[] = {
-        {"threads", 1, 0, 't'},
-        {"view", 1, 0, 'v'},
-        {"help", 0, 0, '?'},
-        {0 ,0, 0, 0}
-    };
+//
+// Streaming kernel --
+//
+// In mandel all 8 lanes run until the slowest pixel escapes, so a
+// single interior pixel keeps the other 7 lanes idle for up to
+// maxIterations.  mandelbrotSerialStreaming instead treats the rows as
+// a queue of pixels: whenever a lane's pixel escapes or reaches
+// maxIterations, its count is written out and the lane is refilled with
+// the next pixel from the queue.  Every pixel is iterated exactly as
+// mandel would, so the counts are identical.
+//
+// Refilling means a round trip of the lane state through memory, so
+// finished lanes are only refilled once refillLanes of them have
+// accumulated (or no lane is left running).  1 keeps utilization
+// highest; the default of 4 was fastest on our test machine.
+//
+// If stats is not NULL, it accumulates the number of lane-iterations
+// executed and how many of them were spent on an unfinished pixel.
+
+typedef struct {
+    unsigned long long laneIterations;
+    unsigned long long busyLaneIterations;
+} LaneStats;
+
+template <typename Iteration>
+void mandelbrotSerialStreaming(
+    const Iteration& iteration,
+    float x0, float y0, float x1, float y1,
+    int width, int height,
+    int startRow, int totalRows,
+    int maxIterations,
+    int output[],
+    LaneStats* stats = NULL,
+    int refillLanes = 4)
+{
+    float dx = (x1 - x0) / width;
+    float dy = (y1 - y0) / height;
+
+    int next = startRow * width;
+    int end = (startRow + totalRows) * width;
+    int nextI = 0, nextJ = startRow;
+
+    int pixel[8];
+    for (int k = 0; k < 8; ++k)
+        pixel[k] = -1;
+
+    __m256 z_re = _mm256_setzero_ps(), z_im = z_re, c_re = z_re, c_im = z_re;
+    __m256i counts = _mm256_setzero_si256();
+    __m256 bound = _mm256_set1_ps(4.f);
+    __m256i limit = _mm256_set1_epi32(maxIterations);
+    // lanes working on a pixel that has not finished yet
+    __m256 active = _mm256_setzero_ps();
+    int activeBits = 0;
+    int busyBits = 0;
+    unsigned long long trips = 0;
+    unsigned long long busyLanes = 0;
+
+    while (true) {
+        // a lane is finished when mandel would have returned: |z|^2 > 4
+        // before the step, or maxIterations steps taken.  Its count
+        // stops there.
+        __m256 mag = _mm256_add_ps(_mm256_mul_ps(z_re, z_re), _mm256_mul_ps(z_im, z_im));
+        __m256 inside = _mm256_andnot_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(counts, limit)),
+                                         _mm256_cmp_ps(mag, bound, _CMP_NGT_UQ));
+        active = _mm256_and_ps(active, inside);
+        activeBits = _mm256_movemask_ps(active);
+
+        int finishedBits = busyBits & ~activeBits;
+        if (__builtin_popcount(finishedBits) >= refillLanes || activeBits == 0) {
+            if (next >= end && activeBits == 0 && finishedBits == 0)
+                break;
+
+            // write out the finished lanes and start the next pixels in
+            // their place, leaving the other lanes' state in registers
+            int iters[8], refill[8];
+            float xs[8], ys[8];
+            _mm256_storeu_si256((__m256i*)iters, counts);
+            for (int k = 0; k < 8; ++k) {
+                refill[k] = 0;
+                xs[k] = ys[k] = 0.f;
+                if (activeBits & (1 << k))
+                    continue;
+                if (pixel[k] >= 0) {
+                    output[pixel[k]] = iters[k];
+                    busyLanes += iters[k];
+                }
+                pixel[k] = -1;
+                if (next < end) {
+                    pixel[k] = next++;
+                    xs[k] = x0 + nextI * dx;
+                    ys[k] = y0 + nextJ * dy;
+                    if (++nextI == width) {
+                        nextI = 0;
+                        nextJ++;
+                    }
+                    refill[k] = -1;
+                }
+            }
+
+            __m256 fresh = _mm256_castsi256_ps(_mm256_loadu_si256((__m256i*)refill));
+            __m256 n_re, n_im, nc_re, nc_im;
+            iteration.start(_mm256_loadu_ps(xs), _mm256_loadu_ps(ys), n_re, n_im, nc_re, nc_im);
+            z_re = _mm256_blendv_ps(z_re, n_re, fresh);
+            z_im = _mm256_blendv_ps(z_im, n_im, fresh);
+            c_re = _mm256_blendv_ps(c_re, nc_re, fresh);
+            c_im = _mm256_blendv_ps(c_im, nc_im, fresh);
+            counts = _mm256_andnot_si256(_mm256_castps_si256(fresh), counts);
+            active = _mm256_or_ps(active, fresh);
+            busyBits = activeBits | _mm256_movemask_ps(fresh);
+            if (busyBits == 0)
+                break;
+            // the new pixels need their check before the first step
+            continue;
+        }
+
+        counts = _mm256_sub_epi32(counts, _mm256_castps_si256(active));
+        iteration.step(z_re, z_im, c_re, c_im);
+        trips++;
+    }
+
+    if (stats) {
+        stats->laneIterations += 8 * trips;
+        stats->busyLaneIterations += busyLanes;
+    }
+}
+
+// Resumable kernels --
+//
+// mandelbrotSerialSave renders rows like mandelbrotSerial and also
+// saves each pixel's z: the z it reached for pixels that reached
+// maxIterations, and 4 (outside |z| <= 2) for pixels that escaped.
+//
+// mandelbrotSerialResume streams a list of pixels through the lanes
+// like mandelbrotSerialStreaming, but starts each pixel from its saved
+// state: a count of 0 starts it afresh, any other count continues from
+// z_re, z_im.  When the pixel escapes or reaches maxIterations, its
+// count and z are saved back.  Continuing a pixel from a lower limit
+// with a higher one gives the count mandel gives with the higher limit
+// alone, since the steps taken are the same.
+template <typename Iteration>
+void mandelbrotSerialSave(
+    const Iteration& iteration,
+    float x0, float y0, float x1, float y1,
+    int width, int height,
+    int startRow, int totalRows,
+    int maxIterations,
+    int output[], float savedRe[], float savedIm[])
+{
+    float dx = (x1 - x0) / width;
+    float dy = (y1 - y0) / height;
+    __m256 bound = _mm256_set1_ps(4.f);
+    __m256i limit = _mm256_set1_epi32(maxIterations);
+
+    for (int j = startRow; j < startRow + totalRows; j++) {
+        float y = y0 + j * dy;
+        int i = 0;
+        for (; i + 8 <= width; i += 8) {
+            float xs[8];
+            for (int k = 0; k < 8; ++k)
+                xs[k] = x0 + (i + k) * dx;
+
+            // mandel, keeping z
+            __m256 z_re, z_im, c_re, c_im;
+            iteration.start(_mm256_loadu_ps(xs), _mm256_set1_ps(y), z_re, z_im, c_re, c_im);
+            __m256 active = _mm256_castsi256_ps(_mm256_set1_epi32(-1));
+            __m256i counts = _mm256_setzero_si256();
+            for (int n = 0; n < maxIterations; ++n) {
+                __m256 mag = _mm256_add_ps(_mm256_mul_ps(z_re, z_re), _mm256_mul_ps(z_im, z_im));
+                active = _mm256_and_ps(active, _mm256_cmp_ps(mag, bound, _CMP_NGT_UQ));
+                if (_mm256_movemask_ps(active) == 0)
+                    break;
+                counts = _mm256_sub_epi32(counts, _mm256_castps_si256(active));
+                iteration.step(z_re, z_im, c_re, c_im);
+            }
+
+            // lanes that escaped have stepped on past their z
+            __m256 capped = _mm256_castsi256_ps(_mm256_cmpeq_epi32(counts, limit));
+            int index = j * width + i;
+            _mm256_storeu_si256((__m256i*)(output + index), counts);
+            _mm256_storeu_ps(savedRe + index, _mm256_blendv_ps(bound, z_re, capped));
+            _mm256_storeu_ps(savedIm + index, _mm256_and_ps(z_im, capped));
+        }
+        for (; i < width; ++i) {
+            float z_re, z_im, c_re, c_im;
+            iteration.start(x0 + i * dx, y, z_re, z_im, c_re, c_im);
+            int n;
+            for (n = 0; n < maxIterations; ++n) {
+                if (z_re * z_re + z_im * z_im > 4.f)
+                    break;
+                iteration.step(z_re, z_im, c_re, c_im);
+            }
+            output[j * width + i] = n;
+            savedRe[j * width + i] = n < maxIterations ? 4.f : z_re;
+            savedIm[j * width + i] = n < maxIterations ? 0.f : z_im;
+        }
+    }
+}
+
+template <typename Iteration>
+void mandelbrotSerialResume(
+    const Iteration& iteration,
+    float x0, float y0, float x1, float y1,
+    int width, int height,
+    const int* pixels, int numPixels,
+    int maxIterations,
+    int output[], float savedRe[], float savedIm[])
+{
+    float dx = (x1 - x0) / width;
+    float dy = (y1 - y0) / height;
+
+    int next = 0;
+    int pixel[8];
+    for (int k = 0; k < 8; ++k)
+        pixel[k] = -1;
+
+    __m256 z_re = _mm256_setzero_ps(), z_im = z_re, c_re = z_re, c_im = z_re;
+    __m256i counts = _mm256_setzero_si256();
+    __m256 bound = _mm256_set1_ps(4.f);
+    __m256i limit = _mm256_set1_epi32(maxIterations);
+    __m256 active = _mm256_setzero_ps();
+    int busyBits = 0;
+
+    while (true) {
+        __m256 mag = _mm256_add_ps(_mm256_mul_ps(z_re, z_re), _mm256_mul_ps(z_im, z_im));
+        __m256 inside = _mm256_andnot_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(counts, limit)),
+                                         _mm256_cmp_ps(mag, bound, _CMP_NGT_UQ));
+        active = _mm256_and_ps(active, inside);
+        int activeBits = _mm256_movemask_ps(active);
+
+        // unlike the streaming kernel, a lane is saved as soon as it
+        // finishes, before a step moves its z past the saved state
+        int finishedBits = busyBits & ~activeBits;
+        if (finishedBits != 0 || activeBits == 0) {
+            if (next >= numPixels && activeBits == 0 && finishedBits == 0)
+                break;
+
+            // save the finished lanes and load the next pixels in their place
+            int iters[8], refill[8], savedCounts[8];
+            float zs_re[8], zs_im[8], xs[8], ys[8], loadRe[8], loadIm[8];
+            _mm256_storeu_si256((__m256i*)iters, counts);
+            _mm256_storeu_ps(zs_re, z_re);
+            _mm256_storeu_ps(zs_im, z_im);
+            for (int k = 0; k < 8; ++k) {
+                refill[k] = savedCounts[k] = 0;
+                xs[k] = ys[k] = loadRe[k] = loadIm[k] = 0.f;
+                if (activeBits & (1 << k))
+                    continue;
+                if (pixel[k] >= 0) {
+                    output[pixel[k]] = iters[k];
+                    savedRe[pixel[k]] = zs_re[k];
+                    savedIm[pixel[k]] = zs_im[k];
+                }
+                pixel[k] = -1;
+                if (next < numPixels) {
+                    int p = pixels[next++];
+                    pixel[k] = p;
+                    xs[k] = x0 + (p % width) * dx;
+                    ys[k] = y0 + (p / width) * dy;
+                    savedCounts[k] = output[p];
+                    loadRe[k] = savedRe[p];
+                    loadIm[k] = savedIm[p];
+                    refill[k] = -1;
+                }
+            }
+
+            __m256 fresh = _mm256_castsi256_ps(_mm256_loadu_si256((__m256i*)refill));
+            __m256i loadCounts = _mm256_loadu_si256((__m256i*)savedCounts);
+            __m256 resumed = _mm256_andnot_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(loadCounts, _mm256_setzero_si256())),
+                                              fresh);
+            __m256 n_re, n_im, nc_re, nc_im;
+            iteration.start(_mm256_loadu_ps(xs), _mm256_loadu_ps(ys), n_re, n_im, nc_re, nc_im);
+            n_re = _mm256_blendv_ps(n_re, _mm256_loadu_ps(loadRe), resumed);
+            n_im = _mm256_blendv_ps(n_im, _mm256_loadu_ps(loadIm), resumed);
+            z_re = _mm256_blendv_ps(z_re, n_re, fresh);
+            z_im = _mm256_blendv_ps(z_im, n_im, fresh);
+            c_re = _mm256_blendv_ps(c_re, nc_re, fresh);
+            c_im = _mm256_blendv_ps(c_im, nc_im, fresh);
+            counts = _mm256_castps_si256(_mm256_blendv_ps(_mm256_castsi256_ps(counts),
+                                                          _mm256_castsi256_ps(loadCounts), fresh));
+            active = _mm256_or_ps(active, fresh);
+            busyBits = activeBits | _mm256_movemask_ps(fresh);
+            if (busyBits == 0)
+                break;
+            continue;
+        }
+
+        counts = _mm256_sub_epi32(counts, _mm256_castps_si256(active));
+        iteration.step(z_re, z_im, c_re, c_im);
+    }
+}
+
+//
+// laneUtilization --
+//
+// Lane utilization mandel achieves on an image it computed: each group
+// of 8 pixels keeps all 8 lanes for as many iterations as its slowest
+// pixel, but only the sum of the counts is useful work.
+double laneUtilization(const int* output, int width, int height)
+{
+    unsigned long long lanes = 0, busy = 0;
+    for (int j = 0; j < height; ++j) {
+        for (int i = 0; i + 8 <= width; i += 8) {
+            int slowest = 0;
+            for (int k = 0; k < 8; ++k) {
+                slowest = std::max(slowest, output[j * width + i + k]);
+                busy += output[j * width + i + k];
+            }
+            lanes += 8 * slowest;
+        }
+    }
+    return lanes ? static_cast<double>(busy) / lanes : 1.;
+}
+
+//
+// Distance estimation --
+//
+// Alongside z, mandelDistance tracks its derivative with respect to c,
+// dz_{n+1} = 2 z_n dz_n + 1, and returns for an escaping pixel the
+// lower bound .5 |z| ln|z| / |dz| on its distance to the Mandelbrot set,
+// or 0 if it does not escape within count iterations.  Pixels closer to
+// the set than a fraction of a pixel are on its boundary.  Thin
+// filaments show up at far lower iteration limits than with escape
+// counts, since their neighbours do not need to be iterated until they
+// get close enough to the set.
+//
+// The escape radius is raised to DISTANCE_BAILOUT for a more accurate
+// estimate.  dz may overflow to inf (distance 0) or NaN very near the
+// set, so callers must treat anything not > 0 as on the boundary.
+
+const static float DISTANCE_BAILOUT = 1e4f;   // |z|^2
+
+static inline float distanceFromOrbit(float z_re, float z_im, float dz_re, float dz_im)
+{
+    float mag = z_re * z_re + z_im * z_im;
+    return .25f * sqrtf(mag) * logf(mag) / sqrtf(dz_re * dz_re + dz_im * dz_im);
+}
+
+static inline float mandelDistance(float c_re, float c_im, int count)
+{
+    float z_re = c_re, z_im = c_im;
+    float dz_re = 1.f, dz_im = 0.f;
+    for (int i = 0; i < count; ++i) {
+        if (z_re * z_re + z_im * z_im > DISTANCE_BAILOUT)
+            return distanceFromOrbit(z_re, z_im, dz_re, dz_im);
+
+        float new_dz_re = 2.f * (z_re * dz_re - z_im * dz_im) + 1.f;
+        float new_dz_im = 2.f * (z_re * dz_im + z_im * dz_re);
+        float new_re = z_re*z_re - z_im*z_im;
+        float new_im = 2.f * z_re * z_im;
+        z_re = c_re + new_re;
+        z_im = c_im + new_im;
+        dz_re = new_dz_re;
+        dz_im = new_dz_im;
+    }
+    return 0.f;
+}
+
+//
+// The AVX2 kernel freezes z and dz of each lane when it escapes, and
+// works out the distances from the frozen values once every lane is
+// done.
+static inline __m256 mandelDistance(__m256 c_re, __m256 c_im, int count)
+{
+    __m256 z_re = c_re, z_im = c_im;
+    __m256 dz_re = _mm256_set1_ps(1.f), dz_im = _mm256_setzero_ps();
+    __m256 one = _mm256_set1_ps(1.f);
+    __m256 bound = _mm256_set1_ps(DISTANCE_BAILOUT);
+    __m256 active = _mm256_castsi256_ps(_mm256_set1_epi32(-1));
+
+    for (int i = 0; i < count; ++i) {
+        __m256 mag = _mm256_add_ps(_mm256_mul_ps(z_re, z_re), _mm256_mul_ps(z_im, z_im));
+        active = _mm256_and_ps(active, _mm256_cmp_ps(mag, bound, _CMP_NGT_UQ));
+        if (_mm256_movemask_ps(active) == 0)
+            break;
+
+        __m256 new_dz_re = _mm256_sub_ps(_mm256_mul_ps(z_re, dz_re), _mm256_mul_ps(z_im, dz_im));
+        __m256 new_dz_im = _mm256_add_ps(_mm256_mul_ps(z_re, dz_im), _mm256_mul_ps(z_im, dz_re));
+        new_dz_re = _mm256_add_ps(_mm256_add_ps(new_dz_re, new_dz_re), one);
+        new_dz_im = _mm256_add_ps(new_dz_im, new_dz_im);
+        __m256 new_re = _mm256_add_ps(c_re, _mm256_sub_ps(_mm256_mul_ps(z_re, z_re), _mm256_mul_ps(z_im, z_im)));
+        __m256 new_im = _mm256_add_ps(c_im, _mm256_mul_ps(_mm256_add_ps(z_re, z_re), z_im));
+        z_re = _mm256_blendv_ps(z_re, new_re, active);
+        z_im = _mm256_blendv_ps(z_im, new_im, active);
+        dz_re = _mm256_blendv_ps(dz_re, new_dz_re, active);
+        dz_im = _mm256_blendv_ps(dz_im, new_dz_im, active);
+    }
+
+    float zr[8], zi[8], dzr[8], dzi[8], distance[8];
+    _mm256_storeu_ps(zr, z_re);
+    _mm256_storeu_ps(zi, z_im);
+    _mm256_storeu_ps(dzr, dz_re);
+    _mm256_storeu_ps(dzi, dz_im);
+    int inside = _mm256_movemask_ps(active);
+    for (int k = 0; k < 8; ++k)
+        distance[k] = (inside >> k) & 1 ? 0.f : distanceFromOrbit(zr[k], zi[k], dzr[k], dzi[k]);
+    return _mm256_loadu_ps(distance);
+}
+
+//
+// mandelbrotDistanceSerial --
+//
+// Like mandelbrotSerial, but writes the estimated distance of each
+// pixel to the Mandelbrot set.
+void mandelbrotDistanceSerial(
+    float x0, float y0, float x1, float y1,
+    int width, int height,
+    int startRow, int totalRows,
+    int maxIterations,
+    float output[])
+{
+    float dx = (x1 - x0) / width;
+    float dy = (y1 - y0) / height;
+
+    int endRow = startRow + totalRows;
+
+    for (int j = startRow; j < endRow; j++) {
+        float y = y0 + j * dy;
+        int i = 0;
+        for (; i + 8 <= width; i += 8) {
+            float xs[8];
+            for (int k = 0; k < 8; ++k)
+                xs[k] = x0 + (i + k) * dx;
+            _mm256_storeu_ps(output + j * width + i,
+                             mandelDistance(_mm256_loadu_ps(xs), _mm256_set1_ps(y), maxIterations));
+        }
+        for (; i < width; ++i)
+            output[j * width + i] = mandelDistance(x0 + i * dx, y, maxIterations);
+    }
+}
+
+//
+// Fractal dispatch table --
+//
+// One entry per FRACTAL_ constant, pointing at the instantiations of the
+// image and 8-lane kernels for that fractal.  interleaved[v - 1] renders
+// with v vectors in flight; interleaved[0] is the plain serial kernel.
+
+typedef void (*FractalSerialFn)(const Fractal& fractal,
+                                float x0, float y0, float x1, float y1,
+                                int width, int height,
+                                int startRow, int totalRows,
+                                int maxIterations, int output[]);
+typedef __m256i (*FractalMandel8Fn)(const Fractal& fractal, __m256 x, __m256 y, int count);
+
+const static int MAX_INTERLEAVE = 4;
+
+typedef struct {
+    const char* name;
+    FractalSerialFn serial;
+    FractalMandel8Fn mandel8;
+    FractalSerialFn interleaved[MAX_INTERLEAVE];
+} FractalKernel;
+
+template <typename Iteration>
+static void fractalSerialRows(const Fractal& fractal,
+                              float x0, float y0, float x1, float y1,
+                              int width, int height,
+                              int startRow, int totalRows,
+                              int maxIterations, int output[])
+{
+    mandelbrotSerial(Iteration(fractal), x0, y0, x1, y1, width, height,
+                     startRow, totalRows, maxIterations, output);
+}
+
+template <int Vectors, typename Iteration>
+static void fractalSerialInterleavedRows(const Fractal& fractal,
+                                         float x0, float y0, float x1, float y1,
+                                         int width, int height,
+                                         int startRow, int totalRows,
+                                         int maxIterations, int output[])
+{
+    mandelbrotSerialInterleaved<Vectors>(Iteration(fractal), x0, y0, x1, y1, width, height,
+                                         startRow, totalRows, maxIterations, output);
+}
+
+template <typename Iteration>
+static __m256i fractalMandel8(const Fractal& fractal, __m256 x, __m256 y, int count)
+{
+    return mandel(Iteration(fractal), x, y, count);
+}
+
+#define FRACTAL_KERNEL(name, Iteration) \
+    { name, fractalSerialRows<Iteration >, fractalMandel8<Iteration >, \
+      { fractalSerialRows<Iteration >, \
+        fractalSerialInterleavedRows<2, Iteration >, \
+        fractalSerialInterleavedRows<3, Iteration >, \
+        fractalSerialInterleavedRows<4, Iteration > } }
+
+const static FractalKernel fractalKernels[FRACTAL_COUNT] = {
+    FRACTAL_KERNEL("mandelbrot", MandelbrotIteration),
+    FRACTAL_KERNEL("julia", JuliaIteration),
+    FRACTAL_KERNEL("burningship", BurningShipIteration),
+    FRACTAL_KERNEL("multibrot3", MultibrotIteration<3>),
+    FRACTAL_KERNEL("multibrot4", MultibrotIteration<4>),
+    FRACTAL_KERNEL("multibrot5", MultibrotIteration<5>),
+};
+
+#undef FRACTAL_KERNEL
+
+void fractalSerial(const Fractal& fractal,
+                   float x0, float y0, float x1, float y1,
+                   int width, int height,
+                   int startRow, int totalRows,
+                   int maxIterations, int output[])
+{
+    fractalKernels[fractal.kind].serial(fractal, x0, y0, x1, y1, width, height,
+                                        startRow, totalRows, maxIterations, output);
+}
+
+//
+// parseFractal --
+//
+// Parse "name" or, for Julia sets, "julia:RE,IM".  Returns false if the
+// name is not in the dispatch table.
+bool parseFractal(const char* spec, Fractal* fractal) {
+    fractal->c_re = -.8f;
+    fractal->c_im = .156f;
+    size_t nameLength = strcspn(spec, ":");
+    for (int kind = 0; kind < FRACTAL_COUNT; kind++) {
+        if (strlen(fractalKernels[kind].name) == nameLength &&
+            strncmp(fractalKernels[kind].name, spec, nameLength) == 0) {
+            fractal->kind = kind;
+            if (spec[nameLength] == ':')
+                return sscanf(spec + nameLength + 1, "%f,%f", &fractal->c_re, &fractal->c_im) == 2;
+            return true;
+        }
+    }
+    return false;
+}
+
+static inline unsigned char
+iterationsToGray(int iterations, int maxIterations)
+{
+    // Clamp iteration count for this pixel, then scale the value
+    // to 0-1 range.  Raise resulting value to a power (<1) to
+    // increase brightness of low iteration count
+    // pixels. a.k.a. Make things look cooler.
+
+    float mapped = pow( std::min(static_cast<float>(maxIterations),
+                                 static_cast<float>(iterations)) / 256.f, .5f);
+
+    // convert back into 0-255 range, 8-bit channels
+    return static_cast<unsigned char>(255.f * mapped);
+}
+
+void
+writePPMImage(int* data, int width, int height, const char *filename, int maxIterations)
+{
+    FILE *fp = fopen(filename, "wb");
+
+    // write ppm header
+    fprintf(fp, "P6\n");
+    fprintf(fp, "%d %d\n", width, height);
+    fprintf(fp, "255\n");
+
+    for (int i = 0; i < width*height; ++i) {
+        unsigned char result = iterationsToGray(data[i], maxIterations);
+        for (int j = 0; j < 3; ++j)
+            fputc(result, fp);
+    }
+    fclose(fp);
+    printf("Wrote image file %s\n", filename);
+}
+
+void
+writePPMImageRGB(const unsigned char* rgb, int width, int height, const char *filename)
+{
+    FILE *fp = fopen(filename, "wb");
+
+    // write ppm header
+    fprintf(fp, "P6\n");
+    fprintf(fp, "%d %d\n", width, height);
+    fprintf(fp, "255\n");
+    fwrite(rgb, 3, width * height, fp);
+    fclose(fp);
+    printf("Wrote image file %s\n", filename);
+}
+
+//
+// encodePPMImage --
+//
+// Same as writePPMImage, but appends the image to a memory buffer.
+void
+encodePPMImage(const int* data, int width, int height, int maxIterations,
+               std::vector<unsigned char>& out)
+{
+    char header[64];
+    int headerLength = snprintf(header, sizeof(header), "P6\n%d %d\n255\n", width, height);
+    out.insert(out.end(), header, header + headerLength);
+
+    size_t offset = out.size();
+    out.resize(offset + 3 * width * height);
+    for (int i = 0; i < width*height; ++i) {
+        unsigned char result = iterationsToGray(data[i], maxIterations);
+        for (int j = 0; j < 3; ++j)
+            out[offset + 3 * i + j] = result;
+    }
+}
+
+void
+scaleAndShift(float& x0, float& x1, float& y0, float& y1,
+              float scale,
+              float shiftX, float shiftY)
+{
+
+    x0 *= scale;
+    x1 *= scale;
+    y0 *= scale;
+    y1 *= scale;
+    x0 += shiftX;
+    x1 += shiftX;
+    y0 += shiftY;
+    y1 += shiftY;
+
+}
+
+void usage(const char* progname) {
+    printf("Usage: %s [options]\n", progname);
+    printf("Program Options:\n");
+    printf("  -t  --threads <N>  Use N threads\n");
+    printf("  -v  --view <INT>   Use specified view settings\n");
+    printf("  -m  --iterations <N> Use at most N iterations per pixel (default 256)\n");
+    printf("  -f  --farm <N>     Also render on a tile farm of N local worker processes\n");
+    printf("  -l  --listen <ADDR> Farm coordinator address (unix:PATH or tcp:HOST:PORT)\n");
+    printf("  -w  --worker <ADDR> Run as a farm worker for the coordinator at ADDR\n");
+    printf("  -s  --serve <PORT> Serve tiles over HTTP on 127.0.0.1:PORT instead\n");
+    printf("  -c  --cache <N>    Keep at most N tiles in the server cache\n");
+    printf("  -p  --progressive[=X,Y] Also render coarse-to-fine, sharpening pixel X,Y (-pX,Y) first\n");
+    printf("  -d  --deadline <MS> Also render with a deadline of MS milliseconds\n");
+    printf("  -k  --kernel <NAME> Render mandelbrot, julia[:RE,IM], burningship or multibrot3-5\n");
+    printf("  -b  --bailout      Benchmark batched bailout checks and exit\n");
+    printf("  -i  --interleave   Benchmark interleaving 1-4 vectors per kernel call and exit\n");
+    printf("  -r  --refill       Benchmark the lane-refilling kernel and exit\n");
+    printf("  -e  --equalize     Also write a histogram-equalized image\n");
+    printf("  -n  --batch <N>    Benchmark a batch of N thumbnail views and exit\n");
+    printf("  -o  --buddhabrot <N>  Render a Buddhabrot from N million samples and exit\n");
+    printf("  -x  --distance     Benchmark distance estimation of the Mandelbrot set and exit\n");
+    printf("  -a  --backend <NAME> Also render with pthreads, openmp, pool, par or all\n");
+    printf("  -y  --symmetry     Also render computing mirrored rows only once\n");
+    printf("  -z  --incremental  Also pan and zoom in 2x, reusing the previous frame\n");
+    printf("  -u  --frames <N>   Benchmark N frames in new and pooled buffers and exit\n");
+    printf("  -g  --gold-cache <DIR> Reuse the serial result and time cached in DIR\n");
+    printf("  -j  --diagnostics  Also write cost and thread-ownership maps and timing JSON\n");
+    printf("  -q  --pyramid <DIR>[,DEPTH] Write a Deep Zoom tile pyramid of the view to DIR and exit;\n");
+    printf("                      its deepest level is 2^DEPTH 256-pixel tiles across (default 3)\n");
+    printf("  -h  --fixed        Compare the fixed-point kernel with the float one and exit\n");
+    printf("  -T  --tune <FILE>  Render threads with the tuned configuration kept in FILE\n");
+    printf("  -C  --checkpoint <FILE> Render the view, checkpointing to and resuming from FILE, and exit\n");
+    printf("  -V  --verify-checkpoint Check the -C image against a serial render\n");
+    printf("  -A  --adaptive <MAX[,B]> Raise the -m limit up to MAX where needed, within B iterations per pixel, and exit\n");
+    printf("  -?  --help         This message\n");
+}
+
+//
+// compareResults --
+//
+// Count the pixels where result differs from gold and the bounding box
+// around them.  The rows are split over one thread per processor, each
+// comparing 8 pixels at a time.
+typedef struct {
+    long long mismatches;
+    int first;                  // index of the first mismatch, or -1
+    int minX, minY, maxX, maxY;
+} ResultDiff;
+
+typedef struct {
+    const int* gold;
+    const int* result;
+    int width;
+    int startRow, endRow;
+    ResultDiff diff;
+} CompareArgs;
+
+static void diffPixel(ResultDiff& diff, int index, int width) {
+    int x = index % width, y = index / width;
+    if (diff.first < 0)
+        diff.first = index;
+    diff.minX = std::min(diff.minX, x);
+    diff.maxX = std::max(diff.maxX, x);
+    diff.minY = std::min(diff.minY, y);
+    diff.maxY = std::max(diff.maxY, y);
+    diff.mismatches++;
+}
+
+static void* compareThreadStart(void* threadArgs) {
+    CompareArgs* args = static_cast<CompareArgs*>(threadArgs);
+    ResultDiff& diff = args->diff;
+    int begin = args->startRow * args->width, end = args->endRow * args->width;
+
+    int i = begin;
+    for (; i + 8 <= end; i += 8) {
+        __m256i equal = _mm256_cmpeq_epi32(_mm256_loadu_si256((const __m256i*)(args->gold + i)),
+                                           _mm256_loadu_si256((const __m256i*)(args->result + i)));
+        int differ = ~_mm256_movemask_ps(_mm256_castsi256_ps(equal)) & 0xff;
+        for (; differ; differ &= differ - 1)
+            diffPixel(diff, i + __builtin_ctz(differ), args->width);
+    }
+    for (; i < end; i++)
+        if (args->gold[i] != args->result[i])
+            diffPixel(diff, i, args->width);
+    return NULL;
+}
+
+void compareResults(const int* gold, const int* result, int width, int height, ResultDiff* diff)
+{
+    const static int MAX_THREADS = 32;
+    int numThreads = std::max(1, std::min((int)sysconf(_SC_NPROCESSORS_ONLN), MAX_THREADS));
+    numThreads = std::min(numThreads, std::max(1, height));
+
+    pthread_t workers[MAX_THREADS];
+    CompareArgs args[MAX_THREADS];
+    for (int t = 0; t < numThreads; t++) {
+        args[t].gold = gold;
+        args[t].result = result;
+        args[t].width = width;
+        args[t].startRow = t * height / numThreads;
+        args[t].endRow = (t + 1) * height / numThreads;
+        args[t].diff.mismatches = 0;
+        args[t].diff.first = -1;
+        args[t].diff.minX = args[t].diff.minY = INT_MAX;
+        args[t].diff.maxX = args[t].diff.maxY = -1;
+    }
+    for (int t = 1; t < numThreads; t++)
+        pthread_create(&workers[t], NULL, compareThreadStart, &args[t]);
+    compareThreadStart(&args[0]);
+    for (int t = 1; t < numThreads; t++)
+        pthread_join(workers[t], NULL);
+
+    // threads cover the rows in order, so the first thread with a
+    // mismatch has the first one
+    *diff = args[0].diff;
+    for (int t = 1; t < numThreads; t++) {
+        const ResultDiff& d = args[t].diff;
+        if (diff->first < 0)
+            diff->first = d.first;
+        diff->mismatches += d.mismatches;
+        diff->minX = std::min(diff->minX, d.minX);
+        diff->minY = std::min(diff->minY, d.minY);
+        diff->maxX = std::max(diff->maxX, d.maxX);
+        diff->maxY = std::max(diff->maxY, d.maxY);
+    }
+}
+
+bool verifyResult (int *gold, int *result, int width, int height) {
+
+    ResultDiff diff;
+    compareResults(gold, result, width, height, &diff);
+    if (diff.mismatches == 0)
+        return 1;
+
+    printf ("Mismatch : [%d][%d], Expected : %d, Actual : %d\n",
+                diff.first / width, diff.first % width, gold[diff.first], result[diff.first]);
+    printf ("Mismatches : %lld, in rows [%d, %d], columns [%d, %d]\n",
+                diff.mismatches, diff.minY, diff.maxY, diff.minX, diff.maxX);
+    return 0;
+}
+
+//
+// Golden-reference cache --
+//
+// The serial render that every run of main verifies against, and its
+// time, can be kept in a directory and reused by later runs of the same
+// view.  Files are named after a hash of the view, the image size, the
+// iteration limit, the fractal and a fingerprint of the serial kernel:
+// the hash of two small serial renders of the view, which changes
+// whenever a change to the kernel changes its output there.  The second
+// probe is GOLD_ODD_PROBE_WIDTH wide, which is not a multiple of 8, so
+// a change to the kernel's tail path changes the key too.  Each file is
+// checked against its key and a checksum of its pixels before use, and
+// written under a temporary name that is renamed into place, so
+// concurrent runs never read half a file.
+
+const static int GOLD_PROBE_SIZE = 64;
+const static int GOLD_ODD_PROBE_WIDTH = 67;
+const static int GOLD_ODD_PROBE_HEIGHT = 61;
+const static char GOLD_MAGIC[8] = { 'M', 'B', 'G', 'O', 'L', 'D', '1', 0 };
+
+typedef struct {
+    char magic[8];
+    unsigned long long key;
+    int width, height;
+    double serialTime;
+    unsigned long long checksum;
+} GoldHeader;
+
+static unsigned long long fnv1a(const void* data, size_t length,
+                                unsigned long long hash = 14695981039346656037ull)
+{
+    const unsigned char* bytes = static_cast<const unsigned char*>(data);
+    for (size_t i = 0; i < length; i++)
+        hash = (hash ^ bytes[i]) * 1099511628211ull;
+    return hash;
+}
+
+static unsigned long long goldKey(const Fractal& fractal,
+                                  float x0, float y0, float x1, float y1,
+                                  int width, int height, int maxIterations)
+{
+    float view[4] = { x0, y0, x1, y1 };
+    int sizes[3] = { width, height, maxIterations };
+    unsigned long long key = fnv1a(view, sizeof(view));
+    key = fnv1a(sizes, sizeof(sizes), key);
+    key = fnv1a(&fractal.kind, sizeof(fractal.kind), key);
+    key = fnv1a(&fractal.c_re, sizeof(fractal.c_re), key);
+    key = fnv1a(&fractal.c_im, sizeof(fractal.c_im), key);
+
+    std::vector<int> probe(GOLD_PROBE_SIZE * GOLD_PROBE_SIZE);
+    fractalSerial(fractal, x0, y0, x1, y1, GOLD_PROBE_SIZE, GOLD_PROBE_SIZE,
+                  0, GOLD_PROBE_SIZE, maxIterations, &probe[0]);
+    key = fnv1a(&probe[0], probe.size() * sizeof(int), key);
+
+    probe.resize(GOLD_ODD_PROBE_WIDTH * GOLD_ODD_PROBE_HEIGHT);
+    fractalSerial(fractal, x0, y0, x1, y1, GOLD_ODD_PROBE_WIDTH, GOLD_ODD_PROBE_HEIGHT,
+                  0, GOLD_ODD_PROBE_HEIGHT, maxIterations, &probe[0]);
+    return fnv1a(&probe[0], probe.size() * sizeof(int), key);
+}
+
+static void goldPath(const char* dir, unsigned long long key, char* path, size_t length) {
+    snprintf(path, length, "%s/gold-%016llx.bin", dir, key);
+}
+
+//
+// loadGoldResult --
+//
+// Fill output and *serialTime from the cache.  Returns false if there
+// is no valid entry for key.
+bool loadGoldResult(const char* dir, unsigned long long key, int width, int height,
+                    int* output, double* serialTime)
+{
+    char path[1024];
+    goldPath(dir, key, path, sizeof(path));
+    FILE* fp = fopen(path, "rb");
+    if (!fp)
+        return false;
+
+    GoldHeader header;
+    size_t pixels = (size_t)width * height;
+    bool ok = fread(&header, sizeof(header), 1, fp) == 1 &&
+              memcmp(header.magic, GOLD_MAGIC, sizeof(GOLD_MAGIC)) == 0 &&
+              header.key == key && header.width == width && header.height == height &&
+              fread(output, sizeof(int), pixels, fp) == pixels &&
+              fnv1a(output, pixels * sizeof(int)) == header.checksum;
+    fclose(fp);
+    if (ok)
+        *serialTime = header.serialTime;
+    return ok;
+}
+
+void saveGoldResult(const char* dir, unsigned long long key, int width, int height,
+                    const int* output, double serialTime)
+{
+    char path[1024], tmpPath[1100];
+    goldPath(dir, key, path, sizeof(path));
+    snprintf(tmpPath, sizeof(tmpPath), "%s.%d.tmp", path, (int)getpid());
+
+    GoldHeader header;
+    size_t pixels = (size_t)width * height;
+    memcpy(header.magic, GOLD_MAGIC, sizeof(GOLD_MAGIC));
+    header.key = key;
+    header.width = width;
+    header.height = height;
+    header.serialTime = serialTime;
+    header.checksum = fnv1a(output, pixels * sizeof(int));
+
+    FILE* fp = fopen(tmpPath, "wb");
+    if (!fp) {
+        fprintf(stderr, "Cannot write %s: %s\n", tmpPath, strerror(errno));
+        return;
+    }
+    bool ok = fwrite(&header, sizeof(header), 1, fp) == 1 &&
+              fwrite(output, sizeof(int), pixels, fp) == pixels;
+    ok = fclose(fp) == 0 && ok;
+    if (!ok || rename(tmpPath, path) != 0) {
+        fprintf(stderr, "Cannot write %s: %s\n", path, strerror(errno));
+        unlink(tmpPath);
+    }
+}
+
+//
+// benchmarkBailout --
+//
+// Time mandelbrotSerial against mandelbrotSerialBatched with batches of
+// 4, 8 and 16 iterations at several iteration limits, checking that the
+// batched kernels give exactly the same image.
+template <int Batch, typename Iteration>
+static double timeBatched(const Iteration& iteration,
+                          float x0, float y0, float x1, float y1,
+                          int width, int height, int maxIterations,
+                          int runs, int output[])
+{
+    double minTime = 1e30;
+    for (int r = 0; r < runs; ++r) {
+        double startTime = CycleTimer::currentSeconds();
+        mandelbrotSerialBatched<Batch>(iteration, x0, y0, x1, y1, width, height,
+                                       0, height, maxIterations, output);
+        minTime = std::min(minTime, CycleTimer::currentSeconds() - startTime);
+    }
+    return minTime;
+}
+
+template <int Batch>
+static double timeBatched(const Fractal& fractal,
+                          float x0, float y0, float x1, float y1,
+                          int width, int height, int maxIterations,
+                          int runs, int output[])
+{
+    switch (fractal.kind) {
+    case FRACTAL_JULIA:
+        return timeBatched<Batch>(JuliaIteration(fractal), x0, y0, x1, y1, width, height, maxIterations, runs, output);
+    case FRACTAL_BURNING_SHIP:
+        return timeBatched<Batch>(BurningShipIteration(), x0, y0, x1, y1, width, height, maxIterations, runs, output);
+    case FRACTAL_MULTIBROT3:
+        return timeBatched<Batch>(MultibrotIteration<3>(), x0, y0, x1, y1, width, height, maxIterations, runs, output);
+    case FRACTAL_MULTIBROT4:
+        return timeBatched<Batch>(MultibrotIteration<4>(), x0, y0, x1, y1, width, height, maxIterations, runs, output);
+    case FRACTAL_MULTIBROT5:
+        return timeBatched<Batch>(MultibrotIteration<5>(), x0, y0, x1, y1, width, height, maxIterations, runs, output);
+    default:
+        return timeBatched<Batch>(MandelbrotIteration(), x0, y0, x1, y1, width, height, maxIterations, runs, output);
+    }
+}
+
+bool benchmarkBailout(const Fractal& fractal,
+                      float x0, float y0, float x1, float y1, int width, int height)
+{
+    const int iterationLimits[] = { 256, 1024, 10000 };
+    int* gold = new int[width*height];
+    int* output = new int[width*height];
+    bool ok = true;
+
+    for (int l = 0; l < 3 && ok; ++l) {
+        int maxIterations = iterationLimits[l];
+        // deep limits take seconds per image, so time them once
+        int runs = maxIterations > 1024 ? 1 : 3;
+
+        double minSerial = 1e30;
+        for (int r = 0; r < runs; ++r) {
+            double startTime = CycleTimer::currentSeconds();
+            fractalSerial(fractal, x0, y0, x1, y1, width, height, 0, height, maxIterations, gold);
+            minSerial = std::min(minSerial, CycleTimer::currentSeconds() - startTime);
+        }
+        printf("[bailout %5d]:\t\tper-iteration [%.3f] ms\n", maxIterations, minSerial * 1000);
+
+        const int batches[] = { 4, 8, 16 };
+        for (int b = 0; b < 3 && ok; ++b) {
+            double t;
+            if (batches[b] == 4)
+                t = timeBatched<4>(fractal, x0, y0, x1, y1, width, height, maxIterations, runs, output);
+            else if (batches[b] == 8)
+                t = timeBatched<8>(fractal, x0, y0, x1, y1, width, height, maxIterations, runs, output);
+            else
+                t = timeBatched<16>(fractal, x0, y0, x1, y1, width, height, maxIterations, runs, output);
+            ok = verifyResult(gold, output, width, height);
+            printf("\t\t\t\tbatch %2d      [%.3f] ms (%.2fx)\n", batches[b], t * 1000, minSerial / t);
+        }
+    }
+
+    delete[] gold;
+    delete[] output;
+    return ok;
+}
+
+//
+// cpuModelName --
+//
+// The "model name" line of /proc/cpuinfo, or "unknown".
+void cpuModelName(char* name, size_t length) {
+    snprintf(name, length, "unknown");
+    FILE* fp = fopen("/proc/cpuinfo", "r");
+    if (!fp)
+        return;
+    char input[1024];
+    while (fgets(input, sizeof(input), fp)) {
+        if (strncmp(input, "model name", 10) == 0) {
+            const char* colon = strchr(input, ':');
+            if (colon) {
+                colon++;
+                while (*colon == ' ' || *colon == '\t')
+                    colon++;
+                snprintf(name, length, "%s", colon);
+                name[strcspn(name, "\n")] = '\0';
+            }
+            break;
+        }
+    }
+    fclose(fp);
+}
+
+//
+// benchmarkInterleave --
+//
+// Time mandelbrotSerialInterleaved with 1 to 4 vectors in flight,
+// checking each against mandelbrotSerial, and report the fastest.
+static double timeInterleaved(int vectors, const Fractal& fractal,
+                              float x0, float y0, float x1, float y1,
+                              int width, int height, int maxIterations, int output[])
+{
+    FractalSerialFn render = fractalKernels[fractal.kind].interleaved[vectors - 1];
+    double minTime = 1e30;
+    for (int r = 0; r < 3; ++r) {
+        double startTime = CycleTimer::currentSeconds();
+        render(fractal, x0, y0, x1, y1, width, height, 0, height, maxIterations, output);
+        minTime = std::min(minTime, CycleTimer::currentSeconds() - startTime);
+    }
+    return minTime;
+}
+
+bool benchmarkInterleave(const Fractal& fractal,
+                         float x0, float y0, float x1, float y1,
+                         int width, int height, int maxIterations)
+{
+    int* gold = new int[width*height];
+    int* output = new int[width*height];
+    bool ok = true;
+
+    double minSerial = timeInterleaved(1, fractal, x0, y0, x1, y1, width, height, maxIterations, gold);
+    printf("[interleave 1]:\t\t\t[%.3f] ms\n", minSerial * 1000);
+
+    int best = 1;
+    double bestTime = minSerial;
+    for (int vectors = 2; vectors <= MAX_INTERLEAVE && ok; ++vectors) {
+        double t = timeInterleaved(vectors, fractal, x0, y0, x1, y1, width, height, maxIterations, output);
+        ok = verifyResult(gold, output, width, height);
+        printf("[interleave %d]:\t\t\t[%.3f] ms (%.2fx)\n", vectors, t * 1000, minSerial / t);
+        if (t < bestTime) {
+            best = vectors;
+            bestTime = t;
+        }
+    }
+
+    char model[256];
+    cpuModelName(model, sizeof(model));
+    printf("Best interleave factor on %s: %d\n", model, best);
+
+    delete[] gold;
+    delete[] output;
+    return ok;
+}
+
+//
+// benchmarkStreaming --
+//
+// Time mandelbrotSerialStreaming against mandelbrotSerial, check it
+// gives the same image, and report the lane utilization of both.
+template <typename Iteration>
+static double timeStreaming(const Iteration& iteration,
+                            float x0, float y0, float x1, float y1,
+                            int width, int height, int maxIterations,
+                            int output[], LaneStats* stats)
+{
+    double minTime = 1e30;
+    for (int r = 0; r < 3; ++r) {
+        LaneStats runStats = { 0, 0 };
+        double startTime = CycleTimer::currentSeconds();
+        mandelbrotSerialStreaming(iteration, x0, y0, x1, y1, width, height,
+                                  0, height, maxIterations, output, &runStats);
+        minTime = std::min(minTime, CycleTimer::currentSeconds() - startTime);
+        *stats = runStats;
+    }
+    return minTime;
+}
+
+bool benchmarkStreaming(const Fractal& fractal,
+                        float x0, float y0, float x1, float y1,
+                        int width, int height, int maxIterations)
+{
+    int* gold = new int[width*height];
+    int* output = new int[width*height];
+
+    double minSerial = 1e30;
+    for (int r = 0; r < 3; ++r) {
+        double startTime = CycleTimer::currentSeconds();
+        fractalSerial(fractal, x0, y0, x1, y1, width, height, 0, height, maxIterations, gold);
+        minSerial = std::min(minSerial, CycleTimer::currentSeconds() - startTime);
+    }
+
+    LaneStats stats;
+    double minStreaming;
+    switch (fractal.kind) {
+    case FRACTAL_JULIA:
+        minStreaming = timeStreaming(JuliaIteration(fractal), x0, y0, x1, y1, width, height, maxIterations, output, &stats);
+        break;
+    case FRACTAL_BURNING_SHIP:
+        minStreaming = timeStreaming(BurningShipIteration(), x0, y0, x1, y1, width, height, maxIterations, output, &stats);
+        break;
+    case FRACTAL_MULTIBROT3:
+        minStreaming = timeStreaming(MultibrotIteration<3>(), x0, y0, x1, y1, width, height, maxIterations, output, &stats);
+        break;
+    case FRACTAL_MULTIBROT4:
+        minStreaming = timeStreaming(MultibrotIteration<4>(), x0, y0, x1, y1, width, height, maxIterations, output, &stats);
+        break;
+    case FRACTAL_MULTIBROT5:
+        minStreaming = timeStreaming(MultibrotIteration<5>(), x0, y0, x1, y1, width, height, maxIterations, output, &stats);
+        break;
+    default:
+        minStreaming = timeStreaming(MandelbrotIteration(), x0, y0, x1, y1, width, height, maxIterations, output, &stats);
+        break;
+    }
+
+    printf("[mandelbrot serial]:\t\t[%.3f] ms, %.1f%% lane utilization\n",
+           minSerial * 1000, 100. * laneUtilization(gold, width, height));
+    printf("[mandelbrot streaming]:\t\t[%.3f] ms, %.1f%% lane utilization\n",
+           minStreaming * 1000, 100. * stats.busyLaneIterations / std::max(1ULL, stats.laneIterations));
+    printf("\t\t\t\t(%.2fx speedup from refilling lanes)\n", minSerial / minStreaming);
+
+    bool ok = verifyResult(gold, output, width, height);
+    delete[] gold;
+    delete[] output;
+    return ok;
+}
+
+//
+// writeDistanceImage --
+//
+// Draw the boundary: pixels within DISTANCE_THRESHOLD pixels of the set
+// (or in it) are black, fading to white at twice that distance.
+const static float DISTANCE_THRESHOLD = .5f;
+
+void writeDistanceImage(const float* distance, int width, int height, float pixelSize,
+                        const char* filename)
+{
+    std::vector<unsigned char> rgb(3 * width * height);
+    for (int i = 0; i < width * height; i++) {
+        float d = distance[i] / (DISTANCE_THRESHOLD * pixelSize);
+        unsigned char gray = d > 1.f ? static_cast<unsigned char>(255.f * std::min(1.f, d - 1.f)) : 0;
+        rgb[3 * i] = rgb[3 * i + 1] = rgb[3 * i + 2] = gray;
+    }
+    writePPMImageRGB(&rgb[0], width, height, filename);
+}
+
+//
+// benchmarkDistance --
+//
+// Time the distance estimator against the escape-count kernel at the
+// same iteration limit, check the AVX2 distances against the scalar
+// ones, and write the boundary image.
+bool benchmarkDistance(float x0, float y0, float x1, float y1,
+                       int width, int height, int maxIterations)
+{
+    int* counts = new int[width*height];
+    float* distance = new float[width*height];
+
+    double minSerial = 1e30, minDistance = 1e30;
+    for (int r = 0; r < 3; ++r) {
+        double startTime = CycleTimer::currentSeconds();
+        mandelbrotSerial(x0, y0, x1, y1, width, height, 0, height, maxIterations, counts);
+        double midTime = CycleTimer::currentSeconds();
+        mandelbrotDistanceSerial(x0, y0, x1, y1, width, height, 0, height, maxIterations, distance);
+        double endTime = CycleTimer::currentSeconds();
+        minSerial = std::min(minSerial, midTime - startTime);
+        minDistance = std::min(minDistance, endTime - midTime);
+    }
+
+    float dx = (x1 - x0) / width;
+    float dy = (y1 - y0) / height;
+    int mismatches = 0;
+    for (int j = 0; j < height; j++) {
+        for (int i = 0; i < width; i++) {
+            float expected = mandelDistance(x0 + i * dx, y0 + j * dy, maxIterations);
+            float actual = distance[j * width + i];
+            if (expected != actual && !(expected != expected && actual != actual)) {
+                if (mismatches++ == 0)
+                    printf("Mismatch : [%d][%d], Expected : %g, Actual : %g\n",
+                           j, i, expected, actual);
+            }
+        }
+    }
+
+    printf("[mandelbrot serial]:\t\t[%.3f] ms\n", minSerial * 1000);
+    printf("[mandelbrot distance]:\t\t[%.3f] ms\n", minDistance * 1000);
+    printf("\t\t\t\t(%.2fx the cost of escape counts at %d iterations)\n",
+           minDistance / minSerial, maxIterations);
+    writeDistanceImage(distance, width, height, dx, "mandelbrot-distance.ppm");
+
+    delete[] counts;
+    delete[] distance;
+    if (mismatches)
+        printf("Error : %d distances differ from the scalar kernel\n", mismatches);
+    return mismatches == 0;
+}
+
+//
+// RenderDiagnostics --
+//
+// Where the time of one mandelbrotThreadRows call went, for tuning the
+// partitioning.  Each thread writes only the entries of its own rows
+// and its own slot of threadSeconds, so no locking is needed.
+typedef struct {
+    std::vector<unsigned long long> rowTicks;   // per row, the band's ticks split evenly
+    std::vector<int> rowThread;                 // per row, the thread that rendered it
+    std::vector<double> threadSeconds;          // per thread, wall time in workerThreadStart
+} RenderDiagnostics;
+
+void renderDiagnosticsInit(RenderDiagnostics* diagnostics, int height, int numThreads)
+{
+    diagnostics->rowTicks.assign(height, 0);
+    diagnostics->rowThread.assign(height, -1);
+    diagnostics->threadSeconds.assign(numThreads, 0.);
+}
+
+//
+// benchmarkFixedPoint --
+//
+// Render the view with the float and the fixed-point kernel on one
+// thread and report the speedup and every pixel where they disagree.
+// Images with pixels closer than fixedPointAllowed accepts are shrunk,
+// keeping their aspect ratio, until it accepts them.
+bool benchmarkFixedPoint(const Fractal& fractal, float x0, float y0, float x1, float y1,
+                         int width, int height, int maxIterations)
+{
+    if (fractal.kind != FRACTAL_MANDELBROT || maxIterations > SHRT_MAX) {
+        fprintf(stderr, "The fixed-point kernel renders the Mandelbrot set with -m up to %d only\n",
+                SHRT_MAX);
+        return false;
+    }
+
+    float scale = std::min(1.f, std::min(fabsf(x1 - x0) * FIXED_ONE / FIXED_MIN_STEPS / width,
+                                         fabsf(y1 - y0) * FIXED_ONE / FIXED_MIN_STEPS / height));
+    if (scale < 1.f) {
+        width = std::max(1, (int)(width * scale));
+        height = std::max(1, (int)(height * scale));
+        printf("Rendering at %dx%d, the largest size with pixels %g fixed-point steps apart\n",
+               width, height, FIXED_MIN_STEPS);
+    }
+
+    int* counts = new int[width * height];
+    int* fixed = new int[width * height];
+    double minFloat = 1e30, minFixed = 1e30;
+    for (int i = 0; i < 3; ++i) {
+        double startTime = CycleTimer::currentSeconds();
+        mandelbrotSerial(x0, y0, x1, y1, width, height, 0, height, maxIterations, counts);
+        double midTime = CycleTimer::currentSeconds();
+        mandelbrotFixedSerial(x0, y0, x1, y1, width, height, 0, height, maxIterations, fixed);
+        double endTime = CycleTimer::currentSeconds();
+        minFloat = std::min(minFloat, midTime - startTime);
+        minFixed = std::min(minFixed, endTime - midTime);
+    }
+    writePPMImage(fixed, width, height, "mandelbrot-fixed.ppm", maxIterations);
+
+    int mismatches = 0, maxDifference = 0;
+    for (int i = 0; i < width * height; i++) {
+        if (counts[i] != fixed[i]) {
+            mismatches++;
+            maxDifference = std::max(maxDifference, abs(counts[i] - fixed[i]));
+        }
+    }
+    delete[] counts;
+    delete[] fixed;
+
+    float dx = (x1 - x0) / width;
+    printf("Pixel spacing %.3g (%.1f fixed-point steps), %d iterations: fixed point %s\n",
+           dx, dx * FIXED_ONE, maxIterations,
+           fixedPointAllowed(fractal, x0, y0, x1, y1, width, height, maxIterations) ?
+           "allowed" : "not allowed");
+    printf("[mandelbrot float]:\t\t[%.3f] ms\n", minFloat * 1000);
+    printf("[mandelbrot fixed]:\t\t[%.3f] ms\n", minFixed * 1000);
+    printf("\t\t\t\t(%.2fx speedup from 16-bit lanes)\n", minFloat / minFixed);
+    printf("%d pixels (%.3f%%) differ from the float kernel, by at most %d iterations\n",
+           mismatches, 100. * mismatches / (width * height), maxDifference);
+    return true;
+}
+
+//
+// RenderConfig --
+//
+// How mandelbrotThreadRows splits and renders an image.  The defaults
+// give one contiguous block of rows per thread, rendered by
+// fractalSerial; the autotuner (see autotuneRenderConfig) picks others
+// per host, which callers pass in explicitly.
+typedef struct {
+    int numThreads;         // 0 for the number asked by the caller
+    int bandRows;           // 0 for one block per thread, else bands handed out in turn
+    int interleave;         // vectors in flight, 1 to MAX_INTERLEAVE
+} RenderConfig;
+
+typedef struct {
+    float x0, x1;
+    float y0, y1;
+    unsigned int width;
+    unsigned int height;
+    int startRow;
+    int totalRows;
+    int maxIterations;
+    int* output;
+    const Fractal* fractal;
+    int* histogram;         // maxIterations + 1 bins, or NULL
+    RenderDiagnostics* diagnostics;     // or NULL
+    int bandRows;           // see RenderConfig
+    int interleave;
+    std::atomic<int>* nextBand;
+    int threadId;
+    int numThreads;
+} WorkerArgs;
+
+const static int WORKER_BAND_ROWS = 4;
+
+//
+// workerThreadStart --
+//
+// Thread entrypoint.
+void* workerThreadStart(void* threadArgs) {
+
+    WorkerArgs* args = static_cast<WorkerArgs*>(threadArgs);
+    FractalSerialFn render = fractalKernels[args -> fractal -> kind].interleaved[args -> interleave - 1];
+
+    // Implement worker thread here.
+    // get the number of rows for each thread to calculte, the last
+    // thread also takes the rows left over by the division
+    int rowsForEachThread = args -> totalRows / args -> numThreads;
+    int startRow = args -> startRow + args -> threadId * rowsForEachThread;
+    int rows = rowsForEachThread;
+    if (args -> threadId == args -> numThreads - 1)
+        rows = args -> startRow + args -> totalRows - startRow;
+    // calculate the part of the image for current pthread
+    if (args -> bandRows > 0) {
+        // or take the next band of rows until there are none left
+        int numBands = (args -> totalRows + args -> bandRows - 1) / args -> bandRows;
+        for (int band; (band = args -> nextBand -> fetch_add(1)) < numBands; ) {
+            int bandStart = args -> startRow + band * args -> bandRows;
+            render(*args -> fractal, args -> x0, args -> y0, args -> x1, args -> y1,
+                   args -> width, args -> height, bandStart,
+                   std::min(args -> bandRows, args -> startRow + args -> totalRows - bandStart),
+                   args -> maxIterations, args -> output);
+        }
+    } else if (!args -> histogram && !args -> diagnostics) {
+        render(*args -> fractal, args -> x0, args -> y0, args -> x1, args -> y1, 
+               args -> width, args -> height, startRow, 
+               rows, args -> maxIterations, args -> output);
+    } else {
+        // time and count each band of rows while it is still in cache
+        RenderDiagnostics* diagnostics = args -> diagnostics;
+        double startTime = CycleTimer::currentSeconds();
+        for (int band = startRow; band < startRow + rows; band += WORKER_BAND_ROWS) {
+            int bandRows = std::min(WORKER_BAND_ROWS, startRow + rows - band);
+            CycleTimer::SysClock startTicks = CycleTimer::currentTicks();
+            fractalSerial(*args -> fractal, args -> x0, args -> y0, args -> x1, args -> y1, 
+                          args -> width, args -> height, band, 
+                          bandRows, args -> maxIterations, args -> output);
+            if (diagnostics) {
+                CycleTimer::SysClock ticks = CycleTimer::currentTicks() - startTicks;
+                for (int row = band; row < band + bandRows; row++) {
+                    diagnostics -> rowTicks[row] = ticks / bandRows;
+                    diagnostics -> rowThread[row] = args -> threadId;
+                }
+            }
+            if (args -> histogram) {
+                const int* counts = args -> output + band * args -> width;
+                for (int i = 0; i < bandRows * (int)args -> width; i++)
+                    args -> histogram[std::max(0, std::min(counts[i], args -> maxIterations))]++;
+            }
+        }
+        if (diagnostics)
+            diagnostics -> threadSeconds[args -> threadId] = CycleTimer::currentSeconds() - startTime;
+    }
+
+    printf("Hello world from thread %d\n", args->threadId);
+	
+    return NULL;
+}
+
+//
+// MandelbrotThreadRows --
+//
+// Multi-threaded implementation of mandelbrot set image generation
+// restricted to the rows [startRow, startRow + totalRows) of the image.
+// Multi-threading performed via pthreads.  Renders the Mandelbrot set
+// unless another fractal is given.  If histograms is not NULL, thread i
+// also counts the iterations of its rows into the (maxIterations + 1)
+// bins starting at histograms[i * histogramStride(maxIterations)], which
+// the caller must have zeroed.  If diagnostics is not NULL, each thread
+// also records how long its rows took; see renderDiagnosticsInit.  A
+// config other than the default applies only without histograms or
+// diagnostics.
+//
+// Each thread's histogram starts on its own cache line, so the bins
+// for high counts at the end of one don't share a line with the
+// busiest bins at the start of the next.
+const static int HISTOGRAM_ALIGNMENT = 64;
+
+static inline int histogramStride(int maxIterations) {
+    const int binsPerLine = HISTOGRAM_ALIGNMENT / sizeof(int);
+    return (maxIterations + 1 + binsPerLine - 1) / binsPerLine * binsPerLine;
+}
+
+void mandelbrotThreadRows(
+    int numThreads,
+    float x0, float y0, float x1, float y1,
+    int width, int height,
+    int startRow, int totalRows,
+    int maxIterations, int output[],
+    const Fractal* fractal = NULL,
+    int* histograms = NULL,
+    RenderDiagnostics* diagnostics = NULL,
+    const RenderConfig* config = NULL)
+{
+    const static int MAX_THREADS = 32;
+
+    bool configured = config && !histograms && !diagnostics;
+    if (configured && config->numThreads > 0)
+        numThreads = config->numThreads;
+    std::atomic<int> nextBand(0);
+
+    if (numThreads > MAX_THREADS)
+    {
+        fprintf(stderr, "Error: Max allowed threads is %d\n", MAX_THREADS);
+        exit(1);
+    }
+
+    pthread_t workers[MAX_THREADS];
+    WorkerArgs args[MAX_THREADS];
+
+    for (int i=0; i<numThreads; i++) {
+        // Set thread arguments here.
+        args[i].x0 = x0;
+        args[i].x1 = x1;
+        args[i].y0 = y0;
+        args[i].y1 = y1;
+        args[i].width = width;
+        args[i].height = height;
+        args[i].startRow = startRow;
+        args[i].totalRows = totalRows;
+        args[i].maxIterations = maxIterations;
+        args[i].output = output;
+        args[i].fractal = fractal ? fractal : &mandelbrotFractal;
+        args[i].histogram = histograms ? histograms + i * histogramStride(maxIterations) : NULL;
+        args[i].diagnostics = diagnostics;
+        args[i].bandRows = configured ? config->bandRows : 0;
+        args[i].interleave = configured ? config->interleave : 1;
+        args[i].nextBand = &nextBand;
+        args[i].threadId = i;
+        args[i].numThreads = numThreads;
+    }
+
+    // Fire up the worker threads.  Note that numThreads-1 pthreads
+    // are created and the main app thread is used as a worker as
+    // well.
+
+    for (int i=1; i<numThreads; i++)
+        pthread_create(&workers[i], NULL, workerThreadStart, &args[i]);
+
+    workerThreadStart(&args[0]);
+
+    // wait for worker threads to complete
+    for (int i=1; i<numThreads; i++)
+        pthread_join(workers[i], NULL);
+}
+
+//
+// MandelbrotThread --
+//
+// Multi-threaded implementation of mandelbrot set image generation.
+// Multi-threading performed via pthreads.
+void mandelbrotThread(
+    int numThreads,
+    float x0, float y0, float x1, float y1,
+    int width, int height,
+    int maxIterations, int output[],
+    const Fractal* fractal = NULL)
+{
+    mandelbrotThreadRows(numThreads, x0, y0, x1, y1, width, height,
+                         0, height, maxIterations, output, fractal);
+}
+
+//
+// Autotuning --
+//
+// The fastest RenderConfig depends on the host and on the view, so
+// autotuneRenderConfig times short probe renders of the view at half
+// size and keeps the fastest.  Winners are kept in a profile file, one
+// line per host and view:
+//
+//     v1 <view key> cores=N threads=T band=B interleave=V ms=X time=T model=<cpu>
+//
+// An entry is reused while it is younger than TUNE_MAX_AGE_DAYS and a
+// probe with it is no more than TUNE_SLOWDOWN times its recorded time
+// (a new kernel, another load on the host); otherwise the view is tuned
+// again and the entry replaced.
+//
+#define TUNE_PROFILE_VERSION 1
+#define TUNE_MAX_AGE_DAYS 30
+#define TUNE_SLOWDOWN 1.25
+#define TUNE_MIN_GAIN 0.97      // a candidate must be 3% faster to win
+
+static double timeRenderConfig(const RenderConfig& config, int numThreads, const Fractal& fractal,
+                               float x0, float y0, float x1, float y1,
+                               int width, int height, int maxIterations, int* output)
+{
+    double best = 1e30;
+    for (int i = 0; i < 3; i++) {
+        double startTime = CycleTimer::currentSeconds();
+        mandelbrotThreadRows(numThreads, x0, y0, x1, y1, width, height,
+                             0, height, maxIterations, output, &fractal, NULL, NULL, &config);
+        best = std::min(best, CycleTimer::currentSeconds() - startTime);
+    }
+    return best;
+}
+
+static void printRenderConfig(const char* what, const RenderConfig& config, double seconds) {
+    printf("[autotune]:\t\t\t%s threads=%d band=%d interleave=%d, [%.3f] ms\n",
+           what, config.numThreads, config.bandRows, config.interleave, seconds * 1000);
+}
+
+//
+// autotuneRenderConfig --
+//
+// Store in tuned the profile's configuration for this host and view,
+// tuning it first if the entry is missing or stale.  Returns false only
+// if the profile cannot be written.
+bool autotuneRenderConfig(const char* profilePath, int numThreads, const Fractal& fractal,
+                          float x0, float y0, float x1, float y1,
+                          int width, int height, int maxIterations, RenderConfig* tuned)
+{
+    // mandelbrotThreadRows' limit
+    const static int MAX_THREADS = 32;
+
+    char model[256];
+    cpuModelName(model, sizeof(model));
+    int cores = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    unsigned long long key = goldKey(fractal, x0, y0, x1, y1, width, height, maxIterations);
+    long long now = (long long)time(NULL);
+
+    int probeWidth = std::max(width / 2, 1), probeHeight = std::max(height / 2, 1);
+    std::vector<int> probe((size_t)probeWidth * probeHeight);
+
+    // keep every line but the one for this host and view
+    std::vector<std::string> lines;
+    const char* stale = "no entry for this host and view";
+    RenderConfig config = { numThreads, 0, 1 };
+    double recorded = 0;
+    FILE* fp = fopen(profilePath, "r");
+    if (fp) {
+        char line[1024];
+        while (fgets(line, sizeof(line), fp)) {
+            int version, entryCores, modelOffset = -1;
+            unsigned long long entryKey;
+            long long entryTime;
+            RenderConfig entry;
+            double ms;
+            sscanf(line, "v%d %llx cores=%d threads=%d band=%d interleave=%d ms=%lf time=%lld model=%n",
+                   &version, &entryKey, &entryCores, &entry.numThreads, &entry.bandRows,
+                   &entry.interleave, &ms, &entryTime, &modelOffset);
+            line[strcspn(line, "\n")] = '\0';
+            if (modelOffset < 0 || entryKey != key || entryCores != cores ||
+                strcmp(line + modelOffset, model) != 0) {
+                lines.push_back(line);
+                continue;
+            }
+            if (version != TUNE_PROFILE_VERSION)
+                stale = "entry from another profile version";
+            else if (now - entryTime > TUNE_MAX_AGE_DAYS * 24 * 3600LL)
+                stale = "entry too old";
+            else if (entry.numThreads < 1 || entry.numThreads > MAX_THREADS ||
+                     entry.bandRows < 0 || entry.bandRows > height ||
+                     entry.interleave < 1 || entry.interleave > MAX_INTERLEAVE)
+                stale = "invalid entry";
+            else {
+                stale = NULL;
+                config = entry;
+                recorded = ms / 1000;
+            }
+        }
+        fclose(fp);
+    }
+
+    if (!stale) {
+        double seconds = timeRenderConfig(config, numThreads, fractal, x0, y0, x1, y1,
+                                          probeWidth, probeHeight, maxIterations, &probe[0]);
+        if (seconds <= recorded * TUNE_SLOWDOWN) {
+            printRenderConfig("profile", config, seconds);
+            *tuned = config;
+            return true;
+        }
+        printf("[autotune]:\t\t\tprobe took [%.3f] ms, [%.3f] ms recorded; tuning again\n",
+               seconds * 1000, recorded * 1000);
+        config.numThreads = numThreads;
+        config.bandRows = 0;
+        config.interleave = 1;
+    } else {
+        printf("[autotune]:\t\t\t%s; tuning\n", stale);
+    }
+
+    // coordinate descent from the default: interleave, then threads,
+    // then bands, keeping each winner for the next step
+    double baseline = timeRenderConfig(config, numThreads, fractal, x0, y0, x1, y1,
+                                       probeWidth, probeHeight, maxIterations, &probe[0]);
+    double best = baseline;
+    std::vector<RenderConfig> candidates;
+    for (int step = 0; step < 3; step++) {
+        candidates.clear();
+        RenderConfig candidate = config;
+        if (step == 0) {
+            for (candidate.interleave = 2; candidate.interleave <= MAX_INTERLEAVE; candidate.interleave++)
+                candidates.push_back(candidate);
+        } else if (step == 1) {
+            for (int threads = 1; threads <= std::min(2 * cores, MAX_THREADS); threads *= 2) {
+                candidate.numThreads = threads;
+                if (threads != config.numThreads)
+                    candidates.push_back(candidate);
+            }
+        } else {
+            static const int bands[] = { 1, 4, 16 };
+            for (size_t i = 0; i < sizeof(bands) / sizeof(bands[0]); i++) {
+                candidate.bandRows = bands[i];
+                candidates.push_back(candidate);
+            }
+        }
+        RenderConfig winner = config;
+        for (size_t i = 0; i < candidates.size(); i++) {
+            double seconds = timeRenderConfig(candidates[i], numThreads, fractal, x0, y0, x1, y1,
+                                              probeWidth, probeHeight, maxIterations, &probe[0]);
+            if (seconds < best * TUNE_MIN_GAIN) {
+                best = seconds;
+                winner = candidates[i];
+            }
+        }
+        config = winner;
+    }
+    printRenderConfig("tuned", config, best);
+    printf("\t\t\t\t(%.2fx over threads=%d band=0 interleave=1)\n", baseline / best, numThreads);
+    *tuned = config;
+
+    char line[1024];
+    snprintf(line, sizeof(line), "v%d %016llx cores=%d threads=%d band=%d interleave=%d ms=%.3f time=%lld model=%s",
+             TUNE_PROFILE_VERSION, key, cores, config.numThreads, config.bandRows,
+             config.interleave, best * 1000, now, model);
+    lines.push_back(line);
+
+    char tmpPath[1100];
+    snprintf(tmpPath, sizeof(tmpPath), "%s.%d.tmp", profilePath, (int)getpid());
+    fp = fopen(tmpPath, "w");
+    if (!fp) {
+        fprintf(stderr, "Cannot write %s: %s\n", tmpPath, strerror(errno));
+        return false;
+    }
+    bool ok = true;
+    for (size_t i = 0; i < lines.size(); i++)
+        ok = fprintf(fp, "%s\n", lines[i].c_str()) > 0 && ok;
+    ok = fclose(fp) == 0 && ok;
+    if (!ok || rename(tmpPath, profilePath) != 0) {
+        fprintf(stderr, "Cannot write %s: %s\n", profilePath, strerror(errno));
+        unlink(tmpPath);
+        return false;
+    }
+    return true;
+}
+
+//
+// Mirrored rendering --
+//
+// Mandelbrot and multibrot sets, and Julia sets with a real constant,
+// are symmetric about the real axis: conj(c) takes exactly the same
+// number of iterations as c, since every step just flips the sign of
+// the imaginary parts.  When row k of the view samples y = -y_j for a
+// row j that is also on screen, row k is a copy of row j.
+//
+// The rows are sampled at y0 + j * dy, which is rounded, so a pair of
+// rows is only mirrored when those rounded values are exact negatives
+// of each other; any other row is computed.  Each thread computes its
+// share of the rows in bands of SYMMETRY_BAND_ROWS and copies the
+// mirror of each band right after, while the band is in cache.
+
+const static int SYMMETRY_BAND_ROWS = 4;
+
+bool fractalMirrorsRealAxis(const Fractal& fractal) {
+    switch (fractal.kind) {
+    case FRACTAL_MANDELBROT:
+    case FRACTAL_MULTIBROT3:
+    case FRACTAL_MULTIBROT4:
+    case FRACTAL_MULTIBROT5:
+        return true;
+    case FRACTAL_JULIA:
+        return fractal.c_im == 0.f;
+    default:
+        return false;
+    }
+}
+
+//
+// mirrorRows --
+//
+// Fill mirror[k] with the row that row k can be copied from, or -1 if
+// row k has to be computed.  Returns the number of rows to compute.
+int mirrorRows(float y0, float y1, int height, int mirror[])
+{
+    float dy = (y1 - y0) / height;
+    for (int k = 0; k < height; k++)
+        mirror[k] = -1;
+
+    // rows j and k mirror each other about j + k = sum
+    double sum = -2. * y0 / dy;
+    int computed = height;
+    for (int k = 0; k < height; k++) {
+        int j = static_cast<int>(floor(sum - k + .5));
+        if (j < 0 || j >= k)
+            continue;
+        if (y0 + k * dy == -(y0 + j * dy)) {
+            mirror[k] = j;
+            computed--;
+        }
+    }
+    return computed;
+}
+
+typedef struct {
+    const Fractal* fractal;
+    float x0, y0, x1, y1;
+    int width, height;
+    int maxIterations;
+    int* output;
+    const int* rows;            // rows to compute, in order
+    int numRows;
+    const std::vector<int>* mirrors;    // mirrors[j]: rows copied from row j
+    int threadId;
+    int numThreads;
+} SymmetricArgs;
+
+static void* symmetricThreadStart(void* threadArgs) {
+    SymmetricArgs* args = static_cast<SymmetricArgs*>(threadArgs);
+    size_t rowBytes = args->width * sizeof(int);
+
+    for (int band = args->threadId * SYMMETRY_BAND_ROWS; band < args->numRows;
+         band += args->numThreads * SYMMETRY_BAND_ROWS) {
+        int end = std::min(band + SYMMETRY_BAND_ROWS, args->numRows);
+        for (int r = band; r < end; r++)
+            fractalSerial(*args->fractal, args->x0, args->y0, args->x1, args->y1,
+                          args->width, args->height, args->rows[r], 1,
+                          args->maxIterations, args->output);
+        // glibc's memcpy copies with vector loads and stores
+        for (int r = band; r < end; r++) {
+            int j = args->rows[r];
+            const std::vector<int>& targets = args->mirrors[j];
+            for (size_t t = 0; t < targets.size(); t++)
+                memcpy(args->output + targets[t] * args->width, args->output + j * args->width, rowBytes);
+        }
+    }
+    return NULL;
+}
+
+//
+// mandelbrotThreadSymmetric --
+//
+// Same result as mandelbrotThread, computing each pair of mirrored rows
+// only once when the fractal allows it.  Returns the number of rows
+// that were copied instead of computed.
+int mandelbrotThreadSymmetric(
+    int numThreads,
+    float x0, float y0, float x1, float y1,
+    int width, int height,
+    int maxIterations, int output[],
+    const Fractal* fractal = NULL)
+{
+    const static int MAX_THREADS = 32;
+    numThreads = std::max(1, std::min(numThreads, MAX_THREADS));
+    if (!fractal)
+        fractal = &mandelbrotFractal;
+
+    std::vector<int> mirror(height, -1);
+    if (fractalMirrorsRealAxis(*fractal))
+        mirrorRows(y0, y1, height, &mirror[0]);
+
+    std::vector<int> rows;
+    std::vector<std::vector<int> > mirrors(height);
+    for (int k = 0; k < height; k++) {
+        if (mirror[k] < 0)
+            rows.push_back(k);
+        else
+            mirrors[mirror[k]].push_back(k);
+    }
+
+    pthread_t workers[MAX_THREADS];
+    SymmetricArgs args[MAX_THREADS];
+    for (int i = 0; i < numThreads; i++) {
+        args[i].fractal = fractal;
+        args[i].x0 = x0;
+        args[i].y0 = y0;
+        args[i].x1 = x1;
+        args[i].y1 = y1;
+        args[i].width = width;
+        args[i].height = height;
+        args[i].maxIterations = maxIterations;
+        args[i].output = output;
+        args[i].rows = rows.empty() ? NULL : &rows[0];
+        args[i].numRows = rows.size();
+        args[i].mirrors = &mirrors[0];
+        args[i].threadId = i;
+        args[i].numThreads = numThreads;
+    }
+
+    for (int i = 1; i < numThreads; i++)
+        pthread_create(&workers[i], NULL, symmetricThreadStart, &args[i]);
+    symmetricThreadStart(&args[0]);
+    for (int i = 1; i < numThreads; i++)
+        pthread_join(workers[i], NULL);
+
+    return height - (int)rows.size();
+}
+
+//
+// Incremental rendering --
+//
+// Pixel (i, j) of a view is sampled at x0 + i * dx, y0 + j * dy, so a
+// column's samples depend only on i and a row's only on j.  After a pan
+// or a zoom, a column of the new view can be copied from a column of
+// the previous frame if both compute exactly the same x, and the same
+// goes for rows.  mapSamples matches the two grids up; the pixels at a
+// matched row and matched column are moved over from the previous frame
+// and only the others are computed.
+//
+// A pan by whole pixels matches most columns and rows, and an exact 2x
+// zoom-in matches every other one, i.e. a quarter of the pixels.  When
+// rounding puts a sample off the previous grid, that column or row is
+// simply computed; when nothing matches this is a full render.  For
+// most views rounding differs between the two grids; snapViewToGrid
+// moves a view onto a grid where both are exact.
+//
+// previous may be the same buffer as output.  The move is done in place
+// when every sample is taken from the same or a later index up to some
+// point and from an earlier one after it, which holds for pans and
+// zoom-ins; otherwise the previous frame is copied first.
+
+const static int INCREMENTAL_BAND_ROWS = 4;
+const static int SNAP_STEP_BITS = 4;
+
+//
+// snapViewToGrid --
+//
+// Move the view by less than a pixel, and change its size by at most
+// 1/(2 * 2^SNAP_STEP_BITS), so that the pixel steps have SNAP_STEP_BITS
+// significant bits and x0, y0 are multiples of them.  Every sample
+// x0 + i * dx is then exact, as are those of views made from it by
+// scaleAndShift with a scale of 1/2 (zooming about a pixel at an even
+// offset) or 1 (panning by whole pixels), for as long as the samples
+// fit in a float's 24 bits.  Exact samples are what let
+// mandelbrotIncremental reuse every other one after a 2x zoom.
+static float snapStep(float step) {
+    int exponent;
+    frexpf(step, &exponent);
+    float unit = ldexpf(1.f, exponent - SNAP_STEP_BITS);
+    return roundf(step / unit) * unit;
+}
+
+void snapViewToGrid(float& x0, float& x1, float& y0, float& y1, int width, int height) {
+    float dx = snapStep((x1 - x0) / width);
+    float dy = snapStep((y1 - y0) / height);
+    x0 = roundf(x0 / dx) * dx;
+    y0 = roundf(y0 / dy) * dy;
+    x1 = x0 + width * dx;
+    y1 = y0 + height * dy;
+}
+
+//
+// mapSamples --
+//
+// For each of the count samples start + i * step, set map[i] to the
+// index of the previous sample prevStart + k * prevStep with exactly
+// the same value, or -1.  Both steps must be positive.  Returns the
+// number of samples matched.
+static int mapSamples(float start, float step, int count,
+                      float prevStart, float prevStep, int prevCount, int map[])
+{
+    int matched = 0;
+    int k = 0;
+    for (int i = 0; i < count; i++) {
+        float value = start + i * step;
+        while (k < prevCount && prevStart + k * prevStep < value)
+            k++;
+        map[i] = (k < prevCount && prevStart + k * prevStep == value) ? k : -1;
+        matched += map[i] >= 0;
+    }
+    return matched;
+}
+
+// True if map[i] - i never increases, so that moving entries first
+// from the back for those taken from earlier indices, then from the
+// front, never reads an entry that was already overwritten.
+static bool mapIsInPlace(const int* map, int count) {
+    int last = 0;
+    bool seen = false;
+    for (int i = 0; i < count; i++) {
+        if (map[i] < 0)
+            continue;
+        if (seen && map[i] - i > last)
+            return false;
+        last = map[i] - i;
+        seen = true;
+    }
+    return true;
+}
+
+// Visit the matched entries of map in an order that is safe in place.
+template <typename Visit>
+static void visitInPlaceOrder(const int* map, int count, Visit visit) {
+    for (int i = count - 1; i >= 0; i--)
+        if (map[i] >= 0 && map[i] < i)
+            visit(i);
+    for (int i = 0; i < count; i++)
+        if (map[i] >= i)
+            visit(i);
+}
+
+typedef struct {
+    const Fractal* fractal;
+    float x0, y0, x1, y1;
+    int width, height;
+    int maxIterations;
+    int* output;
+    const int* colMap;
+    const int* rowMap;
+    int threadId;
+    int numThreads;
+} IncrementalArgs;
+
+static void* incrementalThreadStart(void* threadArgs) {
+    IncrementalArgs* args = static_cast<IncrementalArgs*>(threadArgs);
+    const FractalKernel& kernel = fractalKernels[args->fractal->kind];
+    float dx = (args->x1 - args->x0) / args->width;
+    float dy = (args->y1 - args->y0) / args->height;
+    std::vector<int> missing(args->width);
+
+    for (int band = args->threadId * INCREMENTAL_BAND_ROWS; band < args->height;
+         band += args->numThreads * INCREMENTAL_BAND_ROWS) {
+        int end = std::min(band + INCREMENTAL_BAND_ROWS, args->height);
+        for (int j = band; j < end; j++) {
+            // the columns of this row that were not moved over, 8 at a time
+            int numMissing = 0;
+            for (int i = 0; i < args->width; i++)
+                if (args->rowMap[j] < 0 || args->colMap[i] < 0)
+                    missing[numMissing++] = i;
+
+            __m256 y = _mm256_set1_ps(args->y0 + j * dy);
+            int* row = args->output + j * args->width;
+            for (int m = 0; m < numMissing; m += 8) {
+                int lanes = std::min(8, numMissing - m);
+                float xs[8];
+                for (int k = 0; k < 8; ++k)
+                    xs[k] = args->x0 + missing[m + std::min(k, lanes - 1)] * dx;
+                int counts[8];
+                _mm256_storeu_si256((__m256i*)counts,
+                                    kernel.mandel8(*args->fractal, _mm256_loadu_ps(xs), y, args->maxIterations));
+                for (int k = 0; k < lanes; ++k)
+                    row[missing[m + k]] = counts[k];
+            }
+        }
+    }
+    return NULL;
+}
+
+//
+// mandelbrotIncremental --
+//
+// Render the view x0, y0, x1, y1 into output, reusing the pixels of
+// previous, a frame of the same size and iteration limit rendered for
+// the view px0, py0, px1, py1.  Returns the number of pixels reused.
+int mandelbrotIncremental(
+    int numThreads,
+    float px0, float py0, float px1, float py1, const int* previous,
+    float x0, float y0, float x1, float y1,
+    int width, int height,
+    int maxIterations, int output[],
+    const Fractal* fractal = NULL)
+{
+    const static int MAX_THREADS = 32;
+    numThreads = std::max(1, std::min(numThreads, MAX_THREADS));
+    if (!fractal)
+        fractal = &mandelbrotFractal;
+
+    std::vector<int> colMap(width), rowMap(height);
+    int cols = mapSamples(x0, (x1 - x0) / width, width, px0, (px1 - px0) / width, width, &colMap[0]);
+    int rows = mapSamples(y0, (y1 - y0) / height, height, py0, (py1 - py0) / height, height, &rowMap[0]);
+    if (cols == 0 || rows == 0) {
+        mandelbrotThread(numThreads, x0, y0, x1, y1, width, height, maxIterations, output, fractal);
+        return 0;
+    }
+
+    std::vector<int> scratch;
+    if (previous == output && !(mapIsInPlace(&colMap[0], width) && mapIsInPlace(&rowMap[0], height))) {
+        scratch.assign(previous, previous + width * height);
+        previous = &scratch[0];
+    }
+
+    // move the reused pixels over.  When every matched column moved by
+    // the same amount, as in a pan, each row is one memmove; columns in
+    // between that did not match get copied too but are computed after.
+    const int* colMapData = &colMap[0];
+    int first = 0, last = width - 1;
+    while (colMap[first] < 0)
+        first++;
+    while (colMap[last] < 0)
+        last--;
+    int shift = colMap[first] - first;
+    bool pan = true;
+    for (int i = first; i <= last; i++)
+        if (colMap[i] >= 0 && colMap[i] - i != shift)
+            pan = false;
+    visitInPlaceOrder(&rowMap[0], height, [&](int j) {
+        const int* from = previous + rowMap[j] * width;
+        int* to = output + j * width;
+        if (pan)
+            memmove(to + first, from + first + shift, (last - first + 1) * sizeof(int));
+        else
+            visitInPlaceOrder(colMapData, width, [&](int i) { to[i] = from[colMapData[i]]; });
+    });
+
+    pthread_t workers[MAX_THREADS];
+    IncrementalArgs args[MAX_THREADS];
+    for (int i = 0; i < numThreads; i++) {
+        args[i].fractal = fractal;
+        args[i].x0 = x0;
+        args[i].y0 = y0;
+        args[i].x1 = x1;
+        args[i].y1 = y1;
+        args[i].width = width;
+        args[i].height = height;
+        args[i].maxIterations = maxIterations;
+        args[i].output = output;
+        args[i].colMap = &colMap[0];
+        args[i].rowMap = &rowMap[0];
+        args[i].threadId = i;
+        args[i].numThreads = numThreads;
+    }
+
+    for (int i = 1; i < numThreads; i++)
+        pthread_create(&workers[i], NULL, incrementalThreadStart, &args[i]);
+    incrementalThreadStart(&args[0]);
+    for (int i = 1; i < numThreads; i++)
+        pthread_join(workers[i], NULL);
+
+    return cols * rows;
+}
+
+//
+// Histogram equalization --
+//
+// The pow(x / 256, .5) mapping of writePPMImage washes out views where
+// most pixels take hundreds of iterations.  Equalized coloring maps
+// each escaped pixel to the fraction of escaped pixels with a count no
+// higher than its own, which spreads the gray levels evenly over the
+// image whatever the iteration limit.  Pixels that reached
+// maxIterations stay white.
+//
+// mandelbrotThreadRows builds one histogram per thread as it renders
+// (see workerThreadStart), equalizationTable merges them, and
+// colorizeThread applies the table to the image in parallel.
+
+//
+// equalizationTable --
+//
+// Merge numHistograms histograms of maxIterations + 1 bins each, laid
+// out as for mandelbrotThreadRows, into a table mapping every count to
+// its gray level.
+void equalizationTable(const int* histograms, int numHistograms, int maxIterations, int table[])
+{
+    long long escaped = 0;
+    for (int t = 0; t < numHistograms; t++)
+        for (int c = 0; c < maxIterations; c++)
+            escaped += histograms[t * histogramStride(maxIterations) + c];
+
+    long long seen = 0;
+    for (int c = 0; c < maxIterations; c++) {
+        for (int t = 0; t < numHistograms; t++)
+            seen += histograms[t * histogramStride(maxIterations) + c];
+        table[c] = escaped ? static_cast<int>(255 * seen / escaped) : 0;
+    }
+    table[maxIterations] = 255;
+}
+
+typedef struct {
+    const int* data;
+    int width;
+    int startRow, totalRows;
+    int maxIterations;
+    const int* table;
+    unsigned char* rgb;
+} ColorizeArgs;
+
+static void* colorizeThreadStart(void* threadArgs) {
+    ColorizeArgs* args = static_cast<ColorizeArgs*>(threadArgs);
+    int begin = args->startRow * args->width;
+    int end = (args->startRow + args->totalRows) * args->width;
+
+    // spread 8 gray bytes over 24 RGB bytes
+    const __m128i spreadLo = _mm_setr_epi8(0, 0, 0, 1, 1, 1, 2, 2, 2, 3, 3, 3, 4, 4, 4, 5);
+    const __m128i spreadHi = _mm_setr_epi8(5, 5, 6, 6, 6, 7, 7, 7, -1, -1, -1, -1, -1, -1, -1, -1);
+    __m256i limit = _mm256_set1_epi32(args->maxIterations);
+    __m256i zero = _mm256_setzero_si256();
+
+    int i = begin;
+    for (; i + 8 <= end; i += 8) {
+        __m256i counts = _mm256_loadu_si256((const __m256i*)(args->data + i));
+        counts = _mm256_max_epi32(_mm256_min_epi32(counts, limit), zero);
+        __m256i gray = _mm256_i32gather_epi32(args->table, counts, 4);
+        __m128i words = _mm_packus_epi32(_mm256_castsi256_si128(gray), _mm256_extracti128_si256(gray, 1));
+        __m128i bytes = _mm_packus_epi16(words, words);
+        _mm_storeu_si128((__m128i*)(args->rgb + 3 * i), _mm_shuffle_epi8(bytes, spreadLo));
+        _mm_storel_epi64((__m128i*)(args->rgb + 3 * i + 16), _mm_shuffle_epi8(bytes, spreadHi));
+    }
+    for (; i < end; i++) {
+        int count = std::max(0, std::min(args->data[i], args->maxIterations));
+        unsigned char gray = static_cast<unsigned char>(args->table[count]);
+        args->rgb[3 * i] = args->rgb[3 * i + 1] = args->rgb[3 * i + 2] = gray;
+    }
+    return NULL;
+}
+
+//
+// colorizeThread --
+//
+// Map every pixel of data through table into rgb (3 bytes per pixel),
+// splitting the rows over numThreads pthreads.
+void colorizeThread(int numThreads, const int* data, int width, int height,
+                    int maxIterations, const int* table, unsigned char* rgb)
+{
+    const static int MAX_THREADS = 32;
+    numThreads = std::max(1, std::min(numThreads, MAX_THREADS));
+
+    pthread_t workers[MAX_THREADS];
+    ColorizeArgs args[MAX_THREADS];
+    int rowsForEachThread = height / numThreads;
+    for (int i = 0; i < numThreads; i++) {
+        args[i].data = data;
+        args[i].width = width;
+        args[i].startRow = i * rowsForEachThread;
+        args[i].totalRows = i == numThreads - 1 ? height - args[i].startRow : rowsForEachThread;
+        args[i].maxIterations = maxIterations;
+        args[i].table = table;
+        args[i].rgb = rgb;
+    }
+
+    for (int i = 1; i < numThreads; i++)
+        pthread_create(&workers[i], NULL, colorizeThreadStart, &args[i]);
+    colorizeThreadStart(&args[0]);
+    for (int i = 1; i < numThreads; i++)
+        pthread_join(workers[i], NULL);
+}
+
+//
+// Load-balance diagnostics --
+//
+// writeRenderDiagnostics turns a RenderDiagnostics filled in by
+// mandelbrotThreadRows into three files for tuning the partitioning:
+//
+//   PREFIX-cost.ppm         the iterations of every pixel on a
+//                           black-red-yellow-white log scale
+//   PREFIX-owners.ppm       every row in the color of the thread that
+//                           rendered it, brighter the more ticks it took
+//                           (full brightness at the 95th percentile)
+//   PREFIX-diagnostics.json per-thread rows, time, ticks and iterations,
+//                           the imbalance (slowest / mean thread time)
+//                           and the ticks and iterations of every row
+//
+// Rows are timed in bands of WORKER_BAND_ROWS, so the ticks of a row
+// are its band's share.
+
+static const unsigned char threadPalette[8][3] = {
+    { 230, 25, 75 }, { 60, 180, 75 }, { 255, 225, 25 }, { 0, 130, 200 },
+    { 245, 130, 48 }, { 145, 30, 180 }, { 70, 240, 240 }, { 240, 50, 230 },
+};
+
+void writeRenderDiagnostics(const RenderDiagnostics* diagnostics, const int* output,
+                            int width, int height, int maxIterations, const char* prefix)
+{
+    int numThreads = diagnostics->threadSeconds.size();
+    std::vector<unsigned char> rgb(3 * width * height);
+    char filename[256];
+
+    float logMax = logf(1.f + maxIterations);
+    for (int i = 0; i < width * height; i++) {
+        float t = logf(1.f + std::max(0, std::min(output[i], maxIterations))) / logMax;
+        rgb[3 * i] = static_cast<unsigned char>(255.f * std::min(1.f, 3.f * t));
+        rgb[3 * i + 1] = static_cast<unsigned char>(255.f * std::max(0.f, std::min(1.f, 3.f * t - 1.f)));
+        rgb[3 * i + 2] = static_cast<unsigned char>(255.f * std::max(0.f, 3.f * t - 2.f));
+    }
+    snprintf(filename, sizeof(filename), "%s-cost.ppm", prefix);
+    writePPMImageRGB(rgb.data(), width, height, filename);
+
+    // shade against the 95th percentile, so a few bands that lost their
+    // processor to another thread do not darken all the others
+    std::vector<unsigned long long> sorted(diagnostics->rowTicks);
+    std::nth_element(sorted.begin(), sorted.begin() + height * 95 / 100, sorted.end());
+    unsigned long long fullTicks = std::max(1ull, sorted[height * 95 / 100]);
+    for (int row = 0; row < height; row++) {
+        int thread = diagnostics->rowThread[row];
+        float shade = .25f + .75f * std::min(1.f, (float)diagnostics->rowTicks[row] / fullTicks);
+        for (int c = 0; c < 3; c++) {
+            unsigned char value = thread < 0 ? 0 :
+                static_cast<unsigned char>(shade * threadPalette[thread % 8][c]);
+            for (int x = 0; x < width; x++)
+                rgb[3 * (row * width + x) + c] = value;
+        }
+    }
+    snprintf(filename, sizeof(filename), "%s-owners.ppm", prefix);
+    writePPMImageRGB(rgb.data(), width, height, filename);
+
+    std::vector<long long> rowIterations(height, 0);
+    std::vector<long long> threadIterations(numThreads, 0);
+    std::vector<unsigned long long> threadTicks(numThreads, 0);
+    std::vector<int> threadRows(numThreads, 0), threadFirstRow(numThreads, -1);
+    for (int row = 0; row < height; row++) {
+        for (int x = 0; x < width; x++)
+            rowIterations[row] += output[row * width + x];
+        int thread = diagnostics->rowThread[row];
+        if (thread < 0)
+            continue;
+        if (threadFirstRow[thread] < 0)
+            threadFirstRow[thread] = row;
+        threadRows[thread]++;
+        threadTicks[thread] += diagnostics->rowTicks[row];
+        threadIterations[thread] += rowIterations[row];
+    }
+    double maxSeconds = 0, sumSeconds = 0;
+    for (int t = 0; t < numThreads; t++) {
+        maxSeconds = std::max(maxSeconds, diagnostics->threadSeconds[t]);
+        sumSeconds += diagnostics->threadSeconds[t];
+    }
+
+    snprintf(filename, sizeof(filename), "%s-diagnostics.json", prefix);
+    FILE* fp = fopen(filename, "w");
+    if (!fp) {
+        fprintf(stderr, "Error: cannot write %s\n", filename);
+        return;
+    }
+    fprintf(fp, "{\n  \"width\": %d, \"height\": %d, \"maxIterations\": %d,\n",
+            width, height, maxIterations);
+    fprintf(fp, "  \"tickUnits\": \"%s\", \"bandRows\": %d,\n", CycleTimer::tickUnits(), WORKER_BAND_ROWS);
+    fprintf(fp, "  \"imbalance\": %.3f,\n", sumSeconds > 0 ? maxSeconds * numThreads / sumSeconds : 1.);
+    fprintf(fp, "  \"threads\": [\n");
+    for (int t = 0; t < numThreads; t++)
+        fprintf(fp, "    {\"id\": %d, \"firstRow\": %d, \"rows\": %d, \"ms\": %.3f, "
+                "\"ticks\": %llu, \"iterations\": %lld}%s\n",
+                t, threadFirstRow[t], threadRows[t], diagnostics->threadSeconds[t] * 1000,
+                threadTicks[t], threadIterations[t], t + 1 < numThreads ? "," : "");
+    fprintf(fp, "  ],\n  \"rows\": [\n");
+    for (int row = 0; row < height; row++)
+        fprintf(fp, "    {\"thread\": %d, \"ticks\": %llu, \"iterations\": %lld}%s\n",
+                diagnostics->rowThread[row], diagnostics->rowTicks[row], rowIterations[row],
+                row + 1 < height ? "," : "");
+    fprintf(fp, "  ]\n}\n");
+    fclose(fp);
+    printf("Wrote diagnostics file %s\n", filename);
+}
+
+//
+// Buddhabrot --
+//
+// Instead of coloring each point c by its escape count, a Buddhabrot
+// picks random points c in BUDDHA_RE0..BUDDHA_RE1 x BUDDHA_IM0..BUDDHA_IM1
+// and, for those that escape within maxIterations, adds every point z_n
+// of their orbit to a density image of the view x0, y0, x1, y1.
+//
+// Samples are drawn 8 at a time and the AVX2 mandel finds which of them
+// escape; points in the main cardioid or the period-2 bulb never escape
+// and are dropped before that.  Only escaping orbits are traced again,
+// in scalar code.  Each thread draws from its own xorshift stream and
+// adds into its own density buffer, which it allocates (and so first
+// touches) itself; the buffers are summed by row bands at the end.
+//
+// With importance sampling, samples are drawn more often from the
+// cells of a BUDDHA_GRID x BUDDHA_GRID grid over the sample area that
+// straddle the boundary of the set, where the long orbits come from.
+// Each sample is weighted by how much less likely it was than under
+// uniform sampling, so the expected image is the same.
+
+const static float BUDDHA_RE0 = -2.f, BUDDHA_RE1 = 1.f;
+const static float BUDDHA_IM0 = -1.5f, BUDDHA_IM1 = 1.5f;
+const static int BUDDHA_GRID = 128;
+const static float BUDDHA_BOUNDARY_WEIGHT = 16.f;
+
+typedef struct {
+    float x0, x1, y0, y1;
+    int width, height;
+    int maxIterations;
+    long long samples;
+    unsigned long long seed;
+    const float* cellCdf;       // BUDDHA_GRID^2 cumulative weights, or NULL
+    float* density;             // allocated by the thread
+    long long escaped;
+    long long orbitPoints;
+} BuddhabrotArgs;
+
+static inline unsigned long long xorshift64(unsigned long long& state) {
+    state ^= state << 13;
+    state ^= state >> 7;
+    state ^= state << 17;
+    return state;
+}
+
+// uniform in [0, 1)
+static inline float xorshiftFloat(unsigned long long& state) {
+    return (xorshift64(state) >> 40) * (1.f / (1 << 24));
+}
+
+static inline bool inCardioidOrBulb(float x, float y) {
+    float q = (x - .25f) * (x - .25f) + y * y;
+    return q * (q + (x - .25f)) <= .25f * y * y ||
+           (x + 1.f) * (x + 1.f) + y * y <= 1.f / 16;
+}
+
+static void* buddhabrotThreadStart(void* threadArgs) {
+    BuddhabrotArgs* args = static_cast<BuddhabrotArgs*>(threadArgs);
+    int width = args->width, height = args->height;
+    args->density = new float[width * height]();
+    args->escaped = 0;
+    args->orbitPoints = 0;
+
+    const int cells = BUDDHA_GRID * BUDDHA_GRID;
+    float cellWidth = (BUDDHA_RE1 - BUDDHA_RE0) / BUDDHA_GRID;
+    float cellHeight = (BUDDHA_IM1 - BUDDHA_IM0) / BUDDHA_GRID;
+    float totalWeight = args->cellCdf ? args->cellCdf[cells - 1] : 0.f;
+    float scaleX = width / (args->x1 - args->x0);
+    float scaleY = height / (args->y1 - args->y0);
+    unsigned long long state = args->seed;
+
+    for (long long s = 0; s < args->samples; s += 8) {
+        float c_re[8], c_im[8], weight[8];
+        bool anyOutside = false;
+        // the last vector may hold fewer than 8 samples; the lanes past
+        // them get c = 0, inside the set, and are dropped like one
+        int lanes = static_cast<int>(std::min(8LL, args->samples - s));
+        for (int j = 0; j < 8; j++) {
+            if (j >= lanes) {
+                c_re[j] = c_im[j] = 0.f;
+                weight[j] = 0.f;
+                continue;
+            }
+            if (args->cellCdf) {
+                float pick = xorshiftFloat(state) * totalWeight;
+                int cell = std::upper_bound(args->cellCdf, args->cellCdf + cells, pick) - args->cellCdf;
+                cell = std::min(cell, cells - 1);
+                float cellWeight = args->cellCdf[cell] - (cell ? args->cellCdf[cell - 1] : 0.f);
+                c_re[j] = BUDDHA_RE0 + (cell % BUDDHA_GRID + xorshiftFloat(state)) * cellWidth;
+                c_im[j] = BUDDHA_IM0 + (cell / BUDDHA_GRID + xorshiftFloat(state)) * cellHeight;
+                weight[j] = totalWeight / (cells * cellWeight);
+            } else {
+                c_re[j] = BUDDHA_RE0 + xorshiftFloat(state) * (BUDDHA_RE1 - BUDDHA_RE0);
+                c_im[j] = BUDDHA_IM0 + xorshiftFloat(state) * (BUDDHA_IM1 - BUDDHA_IM0);
+                weight[j] = 1.f;
+            }
+            if (inCardioidOrBulb(c_re[j], c_im[j]))
+                weight[j] = 0.f;
+            else
+                anyOutside = true;
+        }
+        if (!anyOutside)
+            continue;
+
+        int counts[8];
+        _mm256_storeu_si256((__m256i*)counts,
+                            mandel(_mm256_loadu_ps(c_re), _mm256_loadu_ps(c_im), args->maxIterations));
+
+        for (int j = 0; j < 8; j++) {
+            if (weight[j] == 0.f || counts[j] >= args->maxIterations)
+                continue;
+            args->escaped++;
+            args->orbitPoints += counts[j];
+            float z_re = c_re[j], z_im = c_im[j];
+            for (int i = 0; i < counts[j]; i++) {
+                float new_re = z_re*z_re - z_im*z_im;
+                float new_im = 2.f * z_re * z_im;
+                z_re = c_re[j] + new_re;
+                z_im = c_im[j] + new_im;
+                int px = static_cast<int>((z_re - args->x0) * scaleX);
+                int py = static_cast<int>((z_im - args->y0) * scaleY);
+                if (px >= 0 && px < width && py >= 0 && py < height)
+                    args->density[py * width + px] += weight[j];
+            }
+        }
+    }
+    return NULL;
+}
+
+typedef struct {
+    BuddhabrotArgs* threads;
+    int numThreads;
+    int begin, end;
+    float* density;
+} BuddhabrotMergeArgs;
+
+static void* buddhabrotMergeStart(void* threadArgs) {
+    BuddhabrotMergeArgs* args = static_cast<BuddhabrotMergeArgs*>(threadArgs);
+    for (int i = args->begin; i < args->end; i += 8) {
+        __m256 sum = _mm256_setzero_ps();
+        for (int t = 0; t < args->numThreads; t++)
+            sum = _mm256_add_ps(sum, _mm256_loadu_ps(args->threads[t].density + i));
+        _mm256_storeu_ps(args->density + i, sum);
+    }
+    return NULL;
+}
+
+//
+// buddhabrotCellWeights --
+//
+// Weight each sampling cell by 1, or BUDDHA_BOUNDARY_WEIGHT if its
+// corners do not all agree on whether they escape, and return the
+// running sums.
+static void buddhabrotCellWeights(int maxIterations, std::vector<float>& cdf) {
+    const int corners = BUDDHA_GRID + 1;
+    std::vector<bool> inside(corners * corners);
+    for (int j = 0; j < corners; j++)
+        for (int i = 0; i < corners; i++) {
+            float x = BUDDHA_RE0 + i * (BUDDHA_RE1 - BUDDHA_RE0) / BUDDHA_GRID;
+            float y = BUDDHA_IM0 + j * (BUDDHA_IM1 - BUDDHA_IM0) / BUDDHA_GRID;
+            inside[j * corners + i] = mandel(MandelbrotIteration(), x, y, maxIterations) == maxIterations;
+        }
+
+    cdf.resize(BUDDHA_GRID * BUDDHA_GRID);
+    float total = 0.f;
+    for (int j = 0; j < BUDDHA_GRID; j++)
+        for (int i = 0; i < BUDDHA_GRID; i++) {
+            int c = j * corners + i;
+            int n = inside[c] + inside[c + 1] + inside[c + corners] + inside[c + corners + 1];
+            total += (n == 0 || n == 4) ? 1.f : BUDDHA_BOUNDARY_WEIGHT;
+            cdf[j * BUDDHA_GRID + i] = total;
+        }
+}
+
+//
+// buddhabrotThread --
+//
+// Accumulate the escaping orbits of samples random points, split over
+// numThreads pthreads, into density (width * height).  Returns the
+// number of samples that escaped and, in *orbitPoints, the number of
+// orbit points traced for them.
+long long buddhabrotThread(int numThreads,
+                           float x0, float y0, float x1, float y1,
+                           int width, int height, int maxIterations,
+                           long long samples, bool importance, float density[],
+                           long long* orbitPoints)
+{
+    const static int MAX_THREADS = 32;
+    numThreads = std::max(1, std::min(numThreads, MAX_THREADS));
+
+    std::vector<float> cdf;
+    if (importance)
+        buddhabrotCellWeights(maxIterations, cdf);
+
+    pthread_t workers[MAX_THREADS];
+    BuddhabrotArgs args[MAX_THREADS];
+    for (int i = 0; i < numThreads; i++) {
+        args[i].x0 = x0;
+        args[i].x1 = x1;
+        args[i].y0 = y0;
+        args[i].y1 = y1;
+        args[i].width = width;
+        args[i].height = height;
+        args[i].maxIterations = maxIterations;
+        args[i].samples = samples / numThreads + (i < samples % numThreads);
+        args[i].seed = 0x9E3779B97F4A7C15ull * (i + 1);
+        args[i].cellCdf = importance ? &cdf[0] : NULL;
+    }
+    for (int i = 1; i < numThreads; i++)
+        pthread_create(&workers[i], NULL, buddhabrotThreadStart, &args[i]);
+    buddhabrotThreadStart(&args[0]);
+    for (int i = 1; i < numThreads; i++)
+        pthread_join(workers[i], NULL);
+
+    // sum the buffers in bands of rows, 8 floats at a time; the last
+    // band takes the pixels left over
+    int pixels = width * height;
+    int vectorPixels = pixels & ~7;
+    int band = (vectorPixels / numThreads) & ~7;
+    BuddhabrotMergeArgs merge[MAX_THREADS];
+    for (int i = 0; i < numThreads; i++) {
+        merge[i].threads = args;
+        merge[i].numThreads = numThreads;
+        merge[i].begin = i * band;
+        merge[i].end = i == numThreads - 1 ? vectorPixels : (i + 1) * band;
+        merge[i].density = density;
+    }
+    for (int i = 1; i < numThreads; i++)
+        pthread_create(&workers[i], NULL, buddhabrotMergeStart, &merge[i]);
+    buddhabrotMergeStart(&merge[0]);
+    for (int i = 1; i < numThreads; i++)
+        pthread_join(workers[i], NULL);
+    for (int p = vectorPixels; p < pixels; p++) {
+        density[p] = 0.f;
+        for (int t = 0; t < numThreads; t++)
+            density[p] += args[t].density[p];
+    }
+
+    long long escaped = 0;
+    *orbitPoints = 0;
+    for (int i = 0; i < numThreads; i++) {
+        escaped += args[i].escaped;
+        *orbitPoints += args[i].orbitPoints;
+        delete[] args[i].density;
+    }
+    return escaped;
+}
+
+//
+// writeDensityImage --
+//
+// Write a density image as gray levels, scaled by the square root of
+// the density relative to the densest pixel.
+void writeDensityImage(const float* density, int width, int height, const char* filename)
+{
+    float maxDensity = 0.f;
+    for (int i = 0; i < width * height; i++)
+        maxDensity = std::max(maxDensity, density[i]);
+
+    std::vector<unsigned char> rgb(3 * width * height);
+    for (int i = 0; i < width * height; i++) {
+        float mapped = maxDensity > 0.f ? sqrtf(density[i] / maxDensity) : 0.f;
+        rgb[3 * i] = rgb[3 * i + 1] = rgb[3 * i + 2] = static_cast<unsigned char>(255.f * mapped);
+    }
+    writePPMImageRGB(&rgb[0], width, height, filename);
+}
+
+//
+// benchmarkBuddhabrot --
+//
+// Render the Buddhabrot of the view with uniform and with importance
+// sampling, and report the time, the share of samples that escaped and
+// the rate at which orbit points were added to the image.
+bool benchmarkBuddhabrot(int numThreads, long long samples,
+                         float x0, float y0, float x1, float y1,
+                         int width, int height, int maxIterations)
+{
+    float* density = new float[width * height];
+    for (int importance = 0; importance < 2; importance++) {
+        double startTime = CycleTimer::currentSeconds();
+        long long orbitPoints;
+        long long escaped = buddhabrotThread(numThreads, x0, y0, x1, y1, width, height,
+                                             maxIterations, samples, importance, density,
+                                             &orbitPoints);
+        double endTime = CycleTimer::currentSeconds();
+
+        printf("[buddhabrot %s]:\t[%.3f] ms\n", importance ? "importance" : "uniform",
+               (endTime - startTime) * 1000);
+        printf("\t\t\t\t(%.1f M samples/s, %.1f%% escaped, %.1f M orbit points/s)\n",
+               samples / (endTime - startTime) / 1e6, 100. * escaped / samples,
+               orbitPoints / (endTime - startTime) / 1e6);
+        writeDensityImage(density, width, height,
+                          importance ? "buddhabrot-importance.ppm" : "buddhabrot.ppm");
+    }
+    delete[] density;
+    return true;
+}
+
+//
+// Tile farm --
+//
+// The coordinator splits the frame into bands of FARM_TILE_ROWS rows
+// ("tiles") and hands them out to worker processes over a UNIX or TCP
+// socket.  Each worker renders its tile with mandelbrotThreadRows and
+// streams back the run-length encoded iteration counts, which the
+// coordinator decodes into the output image.
+//
+// While a worker is busy it sends a heartbeat every
+// FARM_HEARTBEAT_INTERVAL_MS.  A worker that disconnects or stays silent
+// for FARM_HEARTBEAT_TIMEOUT seconds is dropped and its tile goes back
+// on the queue for the remaining workers.  Heartbeats come from their
+// own thread, so they only show that the process is alive: a worker
+// stuck in a render keeps sending them.  Each tile therefore also has a
+// deadline of FARM_TILE_DEADLINE_FACTOR times the slowest tile finished
+// so far in the frame (and at least FARM_HEARTBEAT_TIMEOUT); a worker
+// that misses it is dropped the same way.
+//
+// Addresses are written as "unix:/path/to/socket", "tcp:host:port" or
+// just "host:port".
+
+const static int FARM_TILE_ROWS = 16;
+const static int FARM_HEARTBEAT_INTERVAL_MS = 100;
+const static double FARM_HEARTBEAT_TIMEOUT = 1.0;
+const static double FARM_TILE_DEADLINE_FACTOR = 8.0;
+const static int FARM_MAX_WORKERS = 64;
+const static int FARM_MAX_THREADS = 32;     // mandelbrotThreadRows' limit
+
+enum {
+    FARM_MSG_JOB = 1,       // coordinator -> worker, FarmJob
+    FARM_MSG_TILE,          // coordinator -> worker, FarmTile
+    FARM_MSG_RESULT,        // worker -> coordinator, FarmTile + encoded counts
+    FARM_MSG_HEARTBEAT,     // worker -> coordinator, no payload
+    FARM_MSG_DONE           // coordinator -> worker, no payload
+};
+
+typedef struct {
+    unsigned int type;
+    unsigned int length;
+} FarmHeader;
+
+typedef struct {
+    float x0, x1;
+    float y0, y1;
+    int width;
+    int height;
+    int maxIterations;
+    int numThreads;
+    Fractal fractal;
+} FarmJob;
+
+typedef struct {
+    int tileId;
+    int startRow;
+    int totalRows;
+} FarmTile;
+
+// Run-length encode iteration counts as (run length, value) pairs of
+// LEB128 varints.  Rows inside or far outside the set collapse to a few
+// bytes.
+static void farmPutVarint(std::vector<unsigned char>& out, unsigned int v) {
+    while (v >= 0x80) {
+        out.push_back(static_cast<unsigned char>(v | 0x80));
+        v >>= 7;
+    }
+    out.push_back(static_cast<unsigned char>(v));
+}
+
+static bool farmGetVarint(const unsigned char*& in, const unsigned char* end, unsigned int& v) {
+    v = 0;
+    for (int shift = 0; shift < 35 && in < end; shift += 7) {
+        unsigned char b = *in++;
+        v |= static_cast<unsigned int>(b & 0x7f) << shift;
+        if (!(b & 0x80))
+            return true;
+    }
+    return false;
+}
+
+void farmEncodeTile(const int* data, int count, std::vector<unsigned char>& out) {
+    int i = 0;
+    while (i < count) {
+        int run = 1;
+        while (i + run < count && data[i + run] == data[i])
+            run++;
+        farmPutVarint(out, run);
+        farmPutVarint(out, static_cast<unsigned int>(data[i]));
+        i += run;
+    }
+}
+
+// The longest encoding of count values: a run of 1 per value, with both
+// varints at their longest, 5 bytes.
+static size_t farmMaxEncodedSize(size_t count) {
+    return count * 2 * 5;
+}
+
+bool farmDecodeTile(const unsigned char* in, size_t length, int* data, int count) {
+    const unsigned char* end = in + length;
+    int i = 0;
+    while (in < end) {
+        unsigned int run, value;
+        if (!farmGetVarint(in, end, run) || !farmGetVarint(in, end, value))
+            return false;
+        if (run > static_cast<unsigned int>(count - i))
+            return false;
+        for (unsigned int k = 0; k < run; k++)
+            data[i++] = static_cast<int>(value);
+    }
+    return i == count;
+}
+
+static bool farmWriteFully(int fd, const void* buf, size_t length) {
+    const char* p = static_cast<const char*>(buf);
+    while (length > 0) {
+        ssize_t n = send(fd, p, length, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        p += n;
+        length -= n;
+    }
+    return true;
+}
+
+static bool farmReadFully(int fd, void* buf, size_t length) {
+    char* p = static_cast<char*>(buf);
+    while (length > 0) {
+        ssize_t n = recv(fd, p, length, 0);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        p += n;
+        length -= n;
+    }
+    return true;
+}
+
+static bool farmSendMessage(int fd, unsigned int type,
+                            const void* payload, unsigned int length,
+                            const void* extra = NULL, unsigned int extraLength = 0) {
+    FarmHeader header;
+    header.type = type;
+    header.length = length + extraLength;
+    return farmWriteFully(fd, &header, sizeof(header)) &&
+           (length == 0 || farmWriteFully(fd, payload, length)) &&
+           (extraLength == 0 || farmWriteFully(fd, extra, extraLength));
+}
+
+//
+// farmOpenSocket --
+//
+// Parse a farm address and either bind and listen on it (coordinator)
+// or connect to it (worker).  Returns the socket, or -1 on failure.
+int farmOpenSocket(const char* address, bool listening) {
+    const char* unixPath = NULL;
+    char host[256] = "127.0.0.1";
+    const char* port = NULL;
+
+    if (strncmp(address, "unix:", 5) == 0) {
+        unixPath = address + 5;
+    } else {
+        const char* spec = strncmp(address, "tcp:", 4) == 0 ? address + 4 : address;
+        const char* colon = strrchr(spec, ':');
+        if (!colon) {
+            port = spec;
+        } else {
+            size_t hostLength = std::min(static_cast<size_t>(colon - spec), sizeof(host) - 1);
+            if (hostLength > 0) {
+                memcpy(host, spec, hostLength);
+                host[hostLength] = '\0';
+            }
+            port = colon + 1;
+        }
+    }
+
+    int fd = -1;
+    if (unixPath) {
+        struct sockaddr_un addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        if (strlen(unixPath) >= sizeof(addr.sun_path)) {
+            fprintf(stderr, "Error: socket path too long: %s\n", unixPath);
+            return -1;
+        }
+        strcpy(addr.sun_path, unixPath);
+        fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd < 0)
+            return -1;
+        if (listening) {
+            unlink(unixPath);
+            if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0 || listen(fd, FARM_MAX_WORKERS) != 0) {
+                close(fd);
+                return -1;
+            }
+        } else if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+            close(fd);
+            return -1;
+        }
+        return fd;
+    }
+
+    struct addrinfo hints, *res;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if (listening)
+        hints.ai_flags = AI_PASSIVE;
+    if (getaddrinfo(host, port, &hints, &res) != 0)
+        return -1;
+
+    for (struct addrinfo* ai = res; ai; ai = ai->ai_next) {
+        fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if (fd < 0)
+            continue;
+        int one = 1;
+        if (listening) {
+            setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+            if (bind(fd, ai->ai_addr, ai->ai_addrlen) == 0 && listen(fd, FARM_MAX_WORKERS) == 0)
+                break;
+        } else if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0) {
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+            break;
+        }
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(res);
+    return fd;
+}
+
+typedef struct {
+    int fd;
+    bool busy;
+    pthread_mutex_t* sendLock;
+} HeartbeatArgs;
+
+static void* farmHeartbeatStart(void* threadArgs) {
+    HeartbeatArgs* args = static_cast<HeartbeatArgs*>(threadArgs);
+    while (true) {
+        usleep(FARM_HEARTBEAT_INTERVAL_MS * 1000);
+        pthread_mutex_lock(args->sendLock);
+        bool ok = farmSendMessage(args->fd, FARM_MSG_HEARTBEAT, NULL, 0);
+        pthread_mutex_unlock(args->sendLock);
+        if (!ok)
+            break;
+    }
+    return NULL;
+}
+
+//
+// farmWorker --
+//
+// Worker process entrypoint.  Connects to the coordinator at address
+// and renders tiles until told it is done or the connection drops.
+int farmWorker(const char* address) {
+    // keep output from several worker processes from interleaving
+    // mid-line
+    setvbuf(stdout, NULL, _IOLBF, 0);
+
+    int fd = -1;
+    // the coordinator may still be starting up
+    for (int attempt = 0; attempt < 50 && fd < 0; attempt++) {
+        fd = farmOpenSocket(address, false);
+        if (fd < 0)
+            usleep(100 * 1000);
+    }
+    if (fd < 0) {
+        fprintf(stderr, "Error: worker could not connect to %s\n", address);
+        return 1;
+    }
+
+    pthread_mutex_t sendLock = PTHREAD_MUTEX_INITIALIZER;
+    HeartbeatArgs heartbeat;
+    heartbeat.fd = fd;
+    heartbeat.sendLock = &sendLock;
+    pthread_t heartbeatThread;
+    pthread_create(&heartbeatThread, NULL, farmHeartbeatStart, &heartbeat);
+
+    FarmJob job;
+    bool haveJob = false;
+    int* output = NULL;
+    std::vector<unsigned char> encoded;
+
+    FarmHeader header;
+    while (farmReadFully(fd, &header, sizeof(header))) {
+        if (header.type == FARM_MSG_JOB && header.length == sizeof(FarmJob)) {
+            if (!farmReadFully(fd, &job, sizeof(job)))
+                break;
+            if (job.fractal.kind < 0 || job.fractal.kind >= FRACTAL_COUNT ||
+                job.width <= 0 || job.height <= 0 || job.maxIterations < 0 ||
+                job.numThreads < 1 || job.numThreads > FARM_MAX_THREADS ||
+                (long long)job.width * job.height > INT_MAX) {
+                fprintf(stderr, "Error: worker received an invalid job\n");
+                break;
+            }
+            delete[] output;
+            output = new int[job.width * job.height];
+            haveJob = true;
+        } else if (header.type == FARM_MSG_TILE && header.length == sizeof(FarmTile) && haveJob) {
+            FarmTile tile;
+            if (!farmReadFully(fd, &tile, sizeof(tile)))
+                break;
+            if (tile.startRow < 0 || tile.startRow >= job.height ||
+                tile.totalRows <= 0 || tile.totalRows > job.height - tile.startRow) {
+                fprintf(stderr, "Error: worker received a tile outside the image\n");
+                break;
+            }
+            mandelbrotThreadRows(job.numThreads, job.x0, job.y0, job.x1, job.y1,
+                                 job.width, job.height, tile.startRow, tile.totalRows,
+                                 job.maxIterations, output, &job.fractal);
+            encoded.clear();
+            farmEncodeTile(output + tile.startRow * job.width, tile.totalRows * job.width, encoded);
+
+            pthread_mutex_lock(&sendLock);
+            bool ok = farmSendMessage(fd, FARM_MSG_RESULT, &tile, sizeof(tile),
+                                      encoded.data(), encoded.size());
+            pthread_mutex_unlock(&sendLock);
+            if (!ok)
+                break;
+        } else {
+            // FARM_MSG_DONE or a message we don't understand
+            break;
+        }
+    }
+
+    // unblocks the heartbeat thread's next send
+    shutdown(fd, SHUT_RDWR);
+    pthread_join(heartbeatThread, NULL);
+    close(fd);
+    delete[] output;
+    return 0;
+}
+
+typedef struct {
+    int fd;
+    int tileId;                         // tile in flight, -1 when idle
+    double tileStart;                   // when tileId was sent
+    double lastSeen;
+    int tilesDone;
+    std::vector<unsigned char> inbox;   // bytes received but not yet parsed
+} FarmConnection;
+
+typedef struct {
+    int listenFd;
+    char address[256];
+    std::vector<FarmConnection> workers;
+    std::vector<pid_t> children;
+    int workersJoined;
+    int tilesRedispatched;
+} Farm;
+
+static void farmDropWorker(Farm* farm, size_t w, std::vector<int>& pending, const char* reason) {
+    FarmConnection& conn = farm->workers[w];
+    fprintf(stderr, "Farm: dropping worker %zu (%s)\n", w, reason);
+    if (conn.tileId >= 0) {
+        pending.push_back(conn.tileId);
+        farm->tilesRedispatched++;
+    }
+    close(conn.fd);
+    farm->workers.erase(farm->workers.begin() + w);
+}
+
+//
+// farmStart --
+//
+// Listen on address and fork numLocalWorkers worker processes that
+// connect to it.  Remote workers started with --worker may join at any
+// time.  Returns false if the coordinator socket cannot be opened.
+bool farmStart(Farm* farm, const char* address, int numLocalWorkers) {
+    signal(SIGPIPE, SIG_IGN);
+    strncpy(farm->address, address, sizeof(farm->address) - 1);
+    farm->address[sizeof(farm->address) - 1] = '\0';
+    farm->workersJoined = 0;
+    farm->tilesRedispatched = 0;
+    farm->listenFd = farmOpenSocket(address, true);
+    if (farm->listenFd < 0) {
+        fprintf(stderr, "Error: could not listen on %s\n", address);
+        return false;
+    }
+
+    fflush(stdout);
+    for (int i = 0; i < numLocalWorkers; i++) {
+        pid_t pid = fork();
+        if (pid == 0) {
+            close(farm->listenFd);
+            _exit(farmWorker(address));
+        }
+        if (pid > 0)
+            farm->children.push_back(pid);
+    }
+
+    // wait for the local workers to check in
+    while (farm->workers.size() < farm->children.size()) {
+        struct pollfd pfd = { farm->listenFd, POLLIN, 0 };
+        if (poll(&pfd, 1, 5000) <= 0)
+            break;
+        int fd = accept(farm->listenFd, NULL, NULL);
+        if (fd < 0)
+            continue;
+        FarmConnection conn;
+        conn.fd = fd;
+        conn.tileId = -1;
+        conn.tileStart = 0;
+        conn.lastSeen = CycleTimer::currentSeconds();
+        conn.tilesDone = 0;
+        farm->workers.push_back(conn);
+        farm->workersJoined++;
+    }
+    return !farm->workers.empty();
+}
+
+//
+// farmRender --
+//
+// Render the whole image on the farm.  Tiles are handed out one at a
+// time to whichever worker is idle, so faster workers take more of
+// them.  Returns false if every worker was lost before the frame
+// completed.
+bool farmRender(Farm* farm, int numThreads,
+                float x0, float y0, float x1, float y1,
+                int width, int height,
+                int maxIterations, int output[],
+                const Fractal* fractal = NULL)
+{
+    FarmJob job;
+    job.x0 = x0;
+    job.x1 = x1;
+    job.y0 = y0;
+    job.y1 = y1;
+    job.width = width;
+    job.height = height;
+    job.maxIterations = maxIterations;
+    job.numThreads = numThreads;
+    job.fractal = fractal ? *fractal : mandelbrotFractal;
+
+    int numTiles = (height + FARM_TILE_ROWS - 1) / FARM_TILE_ROWS;
+    // no legal message is longer than the result of a full tile
+    size_t maxMessage = sizeof(FarmTile) + farmMaxEncodedSize((size_t)FARM_TILE_ROWS * width);
+    double slowestTile = 0;
+    std::vector<int> pending;
+    std::vector<bool> done(numTiles, false);
+    for (int t = numTiles - 1; t >= 0; t--)
+        pending.push_back(t);
+    int remaining = numTiles;
+
+    for (size_t w = 0; w < farm->workers.size(); ) {
+        FarmConnection& conn = farm->workers[w];
+        conn.tileId = -1;
+        conn.lastSeen = CycleTimer::currentSeconds();
+        if (farmSendMessage(conn.fd, FARM_MSG_JOB, &job, sizeof(job)))
+            w++;
+        else
+            farmDropWorker(farm, w, pending, "send failed");
+    }
+
+    while (remaining > 0) {
+        // hand out tiles to idle workers
+        for (size_t w = 0; w < farm->workers.size() && !pending.empty(); ) {
+            FarmConnection& conn = farm->workers[w];
+            if (conn.tileId >= 0) {
+                w++;
+                continue;
+            }
+            FarmTile tile;
+            tile.tileId = pending.back();
+            tile.startRow = tile.tileId * FARM_TILE_ROWS;
+            tile.totalRows = std::min(FARM_TILE_ROWS, height - tile.startRow);
+            pending.pop_back();
+            conn.tileId = tile.tileId;
+            conn.tileStart = CycleTimer::currentSeconds();
+            if (farmSendMessage(conn.fd, FARM_MSG_TILE, &tile, sizeof(tile)))
+                w++;
+            else
+                farmDropWorker(farm, w, pending, "send failed");
+        }
+
+        if (farm->workers.empty()) {
+            fprintf(stderr, "Error: all farm workers lost with %d tiles remaining\n", remaining);
+            return false;
+        }
+
+        std::vector<struct pollfd> pfds(farm->workers.size() + 1);
+        for (size_t w = 0; w < farm->workers.size(); w++) {
+            pfds[w].fd = farm->workers[w].fd;
+            pfds[w].events = POLLIN;
+            pfds[w].revents = 0;
+        }
+        pfds.back().fd = farm->listenFd;
+        pfds.back().events = POLLIN;
+        pfds.back().revents = 0;
+        poll(pfds.data(), pfds.size(), FARM_HEARTBEAT_INTERVAL_MS);
+
+        double now = CycleTimer::currentSeconds();
+
+        // late joiners get the job and start on the next round
+        if (pfds.back().revents & POLLIN) {
+            int fd = accept(farm->listenFd, NULL, NULL);
+            if (fd >= 0) {
+                if (farmSendMessage(fd, FARM_MSG_JOB, &job, sizeof(job))) {
+                    FarmConnection conn;
+                    conn.fd = fd;
+                    conn.tileId = -1;
+                    conn.tileStart = 0;
+                    conn.lastSeen = now;
+                    conn.tilesDone = 0;
+                    farm->workers.push_back(conn);
+                    farm->workersJoined++;
+                } else {
+                    close(fd);
+                }
+            }
+        }
+
+        // walk backwards so dropping a worker doesn't disturb pfds
+        for (size_t w = pfds.size() - 1; w-- > 0; ) {
+            FarmConnection& conn = farm->workers[w];
+
+            if (pfds[w].revents & (POLLIN | POLLHUP | POLLERR)) {
+                char buf[65536];
+                ssize_t n = recv(conn.fd, buf, sizeof(buf), 0);
+                if (n <= 0) {
+                    farmDropWorker(farm, w, pending, "disconnected");
+                    continue;
+                }
+                conn.inbox.insert(conn.inbox.end(), buf, buf + n);
+                conn.lastSeen = now;
+            }
+
+            // parse every complete message in the inbox
+            size_t offset = 0;
+            bool broken = false;
+            while (conn.inbox.size() - offset >= sizeof(FarmHeader)) {
+                FarmHeader header;
+                memcpy(&header, conn.inbox.data() + offset, sizeof(header));
+                if (header.length > maxMessage) {
+                    broken = true;
+                    break;
+                }
+                if (conn.inbox.size() - offset - sizeof(header) < header.length)
+                    break;
+                const unsigned char* payload = conn.inbox.data() + offset + sizeof(header);
+                offset += sizeof(header) + header.length;
+
+                if (header.type == FARM_MSG_HEARTBEAT)
+                    continue;
+
+                FarmTile tile;
+                if (header.type != FARM_MSG_RESULT || header.length < sizeof(tile)) {
+                    broken = true;
+                    break;
+                }
+                memcpy(&tile, payload, sizeof(tile));
+                if (tile.tileId != conn.tileId || tile.tileId < 0 || tile.tileId >= numTiles) {
+                    broken = true;
+                    break;
+                }
+                // write where the dispatched tile goes, never where the
+                // worker says it does
+                int startRow = tile.tileId * FARM_TILE_ROWS;
+                int rows = std::min(FARM_TILE_ROWS, height - startRow);
+                if (tile.startRow != startRow || tile.totalRows != rows ||
+                    !farmDecodeTile(payload + sizeof(tile), header.length - sizeof(tile),
+                                    output + startRow * width, rows * width)) {
+                    broken = true;
+                    break;
+                }
+                conn.tileId = -1;
+                conn.tilesDone++;
+                slowestTile = std::max(slowestTile, now - conn.tileStart);
+                // a re-dispatched tile may come back twice
+                if (!done[tile.tileId]) {
+                    done[tile.tileId] = true;
+                    remaining--;
+                }
+            }
+            conn.inbox.erase(conn.inbox.begin(), conn.inbox.begin() + offset);
+
+            if (broken)
+                farmDropWorker(farm, w, pending, "bad message");
+            else if (now - conn.lastSeen > FARM_HEARTBEAT_TIMEOUT)
+                farmDropWorker(farm, w, pending, "missed heartbeats");
+            else if (conn.tileId >= 0 && slowestTile > 0 &&
+                     now - conn.tileStart > std::max(FARM_HEARTBEAT_TIMEOUT, FARM_TILE_DEADLINE_FACTOR * slowestTile))
+                farmDropWorker(farm, w, pending, "tile deadline passed");
+        }
+
+        // a dropped worker may have requeued a tile another worker has
+        // since finished
+        for (size_t p = 0; p < pending.size(); ) {
+            if (done[pending[p]])
+                pending.erase(pending.begin() + p);
+            else
+                p++;
+        }
+    }
+    return true;
+}
+
+void farmStop(Farm* farm) {
+    for (size_t w = 0; w < farm->workers.size(); w++) {
+        farmSendMessage(farm->workers[w].fd, FARM_MSG_DONE, NULL, 0);
+        close(farm->workers[w].fd);
+    }
+    farm->workers.clear();
+    // a worker dropped while stuck in a render won't see FARM_MSG_DONE
+    double giveUp = CycleTimer::currentSeconds() + FARM_HEARTBEAT_TIMEOUT;
+    for (size_t i = 0; i < farm->children.size(); i++) {
+        while (waitpid(farm->children[i], NULL, WNOHANG) == 0) {
+            if (CycleTimer::currentSeconds() > giveUp) {
+                kill(farm->children[i], SIGKILL);
+                waitpid(farm->children[i], NULL, 0);
+                break;
+            }
+            usleep(10 * 1000);
+        }
+    }
+    farm->children.clear();
+    close(farm->listenFd);
+    if (strncmp(farm->address, "unix:", 5) == 0)
+        unlink(farm->address + 5);
+}
+
+//
+// Thread pool --
+//
+// A fixed set of pthreads kept alive between renders, so long-running
+// callers don't pay for thread creation on every image.  threadPoolRun
+// queues a job of numTasks independent tasks and blocks until all of
+// them have run.  Several callers may have jobs queued at once; workers
+// drain them in FIFO order.  threadPoolSubmit queues a job without
+// waiting; the worker that runs its last task then calls job->finish,
+// after which the pool no longer touches the job.
+
+typedef struct PoolJob {
+    void (*run)(void* arg, int task);
+    void (*finish)(void* arg);  // NULL for threadPoolRun jobs
+    void* arg;
+    int numTasks;
+    int nextTask;
+    int tasksLeft;
+} PoolJob;
+
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t wake;        // signalled when a job is queued
+    pthread_cond_t finished;    // broadcast when a job's last task ends
+    std::deque<PoolJob*> jobs;
+    std::vector<pthread_t> threads;
+    bool stopping;
+} ThreadPool;
+
+static void* threadPoolWorkerStart(void* poolArg) {
+    ThreadPool* pool = static_cast<ThreadPool*>(poolArg);
+
+    pthread_mutex_lock(&pool->lock);
+    while (true) {
+        while (pool->jobs.empty() && !pool->stopping)
+            pthread_cond_wait(&pool->wake, &pool->lock);
+        if (pool->jobs.empty())
+            break;
+
+        PoolJob* job = pool->jobs.front();
+        int task = job->nextTask++;
+        if (job->nextTask == job->numTasks)
+            pool->jobs.pop_front();
+
+        pthread_mutex_unlock(&pool->lock);
+        job->run(job->arg, task);
+        pthread_mutex_lock(&pool->lock);
+
+        if (--job->tasksLeft == 0) {
+            if (job->finish) {
+                pthread_mutex_unlock(&pool->lock);
+                job->finish(job->arg);
+                pthread_mutex_lock(&pool->lock);
+            } else {
+                pthread_cond_broadcast(&pool->finished);
+            }
+        }
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+void threadPoolStart(ThreadPool* pool, int numThreads) {
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->wake, NULL);
+    pthread_cond_init(&pool->finished, NULL);
+    pool->stopping = false;
+    pool->threads.resize(numThreads);
+    for (int i = 0; i < numThreads; i++)
+        pthread_create(&pool->threads[i], NULL, threadPoolWorkerStart, pool);
+}
+
+void threadPoolRun(ThreadPool* pool, void (*run)(void* arg, int task), void* arg, int numTasks) {
+    if (numTasks <= 0)
+        return;
+
+    PoolJob job;
+    job.run = run;
+    job.finish = NULL;
+    job.arg = arg;
+    job.numTasks = numTasks;
+    job.nextTask = 0;
+    job.tasksLeft = numTasks;
+
+    pthread_mutex_lock(&pool->lock);
+    pool->jobs.push_back(&job);
+    pthread_cond_broadcast(&pool->wake);
+    while (job.tasksLeft > 0)
+        pthread_cond_wait(&pool->finished, &pool->lock);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+// job->run, finish, arg and numTasks (> 0) must be set by the caller.
+void threadPoolSubmit(ThreadPool* pool, PoolJob* job) {
+    job->nextTask = 0;
+    job->tasksLeft = job->numTasks;
+
+    pthread_mutex_lock(&pool->lock);
+    pool->jobs.push_back(job);
+    pthread_cond_broadcast(&pool->wake);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+void threadPoolStop(ThreadPool* pool) {
+    pthread_mutex_lock(&pool->lock);
+    pool->stopping = true;
+    pthread_cond_broadcast(&pool->wake);
+    pthread_mutex_unlock(&pool->lock);
+    for (size_t i = 0; i < pool->threads.size(); i++)
+        pthread_join(pool->threads[i], NULL);
+    pool->threads.clear();
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->wake);
+    pthread_cond_destroy(&pool->finished);
+}
+
+//
+// Frame-buffer pool --
+//
+// Every render writes all of its pixels, so output buffers don't need
+// zeroing, only mapping.  A FramePool hands out buffers of a fixed size
+// that are aligned to FRAME_ALIGNMENT and, where supported, backed by
+// transparent huge pages, which cuts the page faults and TLB misses of
+// a fresh 4 KB-page buffer 512-fold.  New buffers are prefaulted by
+// numThreads threads at once; released ones are kept for the next
+// acquire.  A pool created with poison set fills every buffer it hands
+// out with -1, so a render that skips pixels can't pass verification on
+// a recycled buffer that still holds an earlier image.  framePoolDestroy
+// frees every buffer, released or not.
+
+const static size_t FRAME_ALIGNMENT = 2 << 20;
+const static size_t FRAME_PAGE_SIZE = 4096;
+
+typedef struct {
+    pthread_mutex_t lock;
+    size_t bytes;               // rounded up to FRAME_ALIGNMENT
+    int numThreads;
+    std::vector<int*> buffers;  // every buffer allocated
+    std::vector<int*> free;
+    bool hugePages;             // madvise(MADV_HUGEPAGE) accepted
+    bool poison;                // fill acquired buffers with -1
+} FramePool;
+
+void framePoolInit(FramePool* pool, size_t pixels, int numThreads, bool poison) {
+    pthread_mutex_init(&pool->lock, NULL);
+    pool->bytes = (pixels * sizeof(int) + FRAME_ALIGNMENT - 1) / FRAME_ALIGNMENT * FRAME_ALIGNMENT;
+    pool->numThreads = std::max(1, numThreads);
+    pool->hugePages = false;
+    pool->poison = poison;
+}
+
+typedef struct {
+    char* begin;
+    char* end;
+} PrefaultArgs;
+
+static void* prefaultThreadStart(void* threadArgs) {
+    PrefaultArgs* args = static_cast<PrefaultArgs*>(threadArgs);
+    for (volatile char* p = args->begin; p < args->end; p += FRAME_PAGE_SIZE)
+        *p = 0;
+    return NULL;
+}
+
+int* framePoolAcquire(FramePool* pool) {
+    pthread_mutex_lock(&pool->lock);
+    if (!pool->free.empty()) {
+        int* buffer = pool->free.back();
+        pool->free.pop_back();
+        pthread_mutex_unlock(&pool->lock);
+        if (pool->poison)
+            memset(buffer, 0xff, pool->bytes);
+        return buffer;
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    void* memory;
+    if (posix_memalign(&memory, FRAME_ALIGNMENT, pool->bytes) != 0) {
+        fprintf(stderr, "Cannot allocate a %zu byte frame\n", pool->bytes);
+        exit(1);
+    }
+#ifdef MADV_HUGEPAGE
+    if (madvise(memory, pool->bytes, MADV_HUGEPAGE) == 0)
+        pool->hugePages = true;
+#endif
+
+    const static int MAX_THREADS = 32;
+    int numThreads = std::min(pool->numThreads, MAX_THREADS);
+    size_t chunk = pool->bytes / numThreads / FRAME_PAGE_SIZE * FRAME_PAGE_SIZE;
+    pthread_t workers[MAX_THREADS];
+    PrefaultArgs args[MAX_THREADS];
+    for (int i = 0; i < numThreads; i++) {
+        args[i].begin = static_cast<char*>(memory) + i * chunk;
+        args[i].end = i == numThreads - 1 ? static_cast<char*>(memory) + pool->bytes : args[i].begin + chunk;
+    }
+    for (int i = 1; i < numThreads; i++)
+        pthread_create(&workers[i], NULL, prefaultThreadStart, &args[i]);
+    prefaultThreadStart(&args[0]);
+    for (int i = 1; i < numThreads; i++)
+        pthread_join(workers[i], NULL);
+
+    if (pool->poison)
+        memset(memory, 0xff, pool->bytes);
+
+    pthread_mutex_lock(&pool->lock);
+    pool->buffers.push_back(static_cast<int*>(memory));
+    pthread_mutex_unlock(&pool->lock);
+    return static_cast<int*>(memory);
+}
+
+void framePoolRelease(FramePool* pool, int* buffer) {
+    pthread_mutex_lock(&pool->lock);
+    pool->free.push_back(buffer);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+void framePoolDestroy(FramePool* pool) {
+    for (size_t i = 0; i < pool->buffers.size(); i++)
+        free(pool->buffers[i]);
+    pool->buffers.clear();
+    pool->free.clear();
+    pthread_mutex_destroy(&pool->lock);
+}
+
+// Minor page faults of this process so far.
+long minorPageFaults() {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_minflt;
+}
+
+//
+// benchmarkFrames --
+//
+// Render numFrames frames with mandelbrotThread into buffers allocated
+// and zeroed for each frame, as main used to, then into buffers from a
+// FramePool, and compare the time and page faults per frame.
+bool benchmarkFrames(int numThreads, int numFrames, const Fractal& fractal,
+                     float x0, float y0, float x1, float y1,
+                     int width, int height, int maxIterations)
+{
+    int* gold = new int[width*height];
+    mandelbrotThread(numThreads, x0, y0, x1, y1, width, height, maxIterations, gold, &fractal);
+
+    bool ok = true;
+    long faults = minorPageFaults();
+    double startTime = CycleTimer::currentSeconds();
+    for (int f = 0; f < numFrames; f++) {
+        int* output = new int[width*height];
+        memset(output, 0, width * height * sizeof(int));
+        mandelbrotThread(numThreads, x0, y0, x1, y1, width, height, maxIterations, output, &fractal);
+        ok = ok && memcmp(gold, output, width * height * sizeof(int)) == 0;
+        delete[] output;
+    }
+    double newTime = CycleTimer::currentSeconds() - startTime;
+    long newFaults = minorPageFaults() - faults;
+
+    FramePool frames;
+    framePoolInit(&frames, width * height, numThreads, false);
+    faults = minorPageFaults();
+    startTime = CycleTimer::currentSeconds();
+    for (int f = 0; f < numFrames; f++) {
+        int* output = framePoolAcquire(&frames);
+        mandelbrotThread(numThreads, x0, y0, x1, y1, width, height, maxIterations, output, &fractal);
+        ok = ok && memcmp(gold, output, width * height * sizeof(int)) == 0;
+        framePoolRelease(&frames, output);
+    }
+    double poolTime = CycleTimer::currentSeconds() - startTime;
+    long poolFaults = minorPageFaults() - faults;
+    bool hugePages = frames.hugePages;
+    framePoolDestroy(&frames);
+    delete[] gold;
+
+    if (!ok) {
+        printf("Error : Output from pooled frames does not match\n");
+        return false;
+    }
+    printf("[frames new+memset]:\t\t[%.3f] ms/frame, %.1f page faults/frame\n",
+           newTime * 1000 / numFrames, (double)newFaults / numFrames);
+    printf("[frames pool]:\t\t\t[%.3f] ms/frame, %.1f page faults/frame%s\n",
+           poolTime * 1000 / numFrames, (double)poolFaults / numFrames,
+           hugePages ? ", huge pages" : "");
+    return true;
+}
+
+//
+// Parallel backends --
+//
+// The same kernel, fractalSerial over bands of rows, scheduled by
+// different runtimes so they can be compared on equal terms:
+//
+// * pthreads: mandelbrotThread, one contiguous block of rows per thread
+// * openmp:   parallel for schedule(dynamic) over BACKEND_TILE_ROWS bands
+//             (built with -fopenmp)
+// * pool:     the persistent ThreadPool, one task per band
+// * par:      std::for_each(std::execution::par) over the bands (built
+//             with -std=c++17 -DMANDELBROT_PARALLEL_STL -ltbb); the
+//             standard library picks the number of threads
+//
+// create returns the backend's state, started once before timing.
+// Backends that were not compiled in have render == NULL.
+
+const static int BACKEND_TILE_ROWS = 8;
+
+typedef struct {
+    const char* name;
+    const char* buildFlags;     // needed to compile it in
+    void* (*create)(int numThreads);
+    void (*render)(void* state, int numThreads, const Fractal& fractal,
+                   float x0, float y0, float x1, float y1,
+                   int width, int height, int maxIterations, int output[]);
+    void (*destroy)(void* state);
+} ParallelBackend;
+
+static void* backendNoState(int numThreads) {
+    return NULL;
+}
+
+static void backendNoDestroy(void* state) {
+}
+
+static void pthreadsBackendRender(void* state, int numThreads, const Fractal& fractal,
+                                  float x0, float y0, float x1, float y1,
+                                  int width, int height, int maxIterations, int output[])
+{
+    mandelbrotThread(numThreads, x0, y0, x1, y1, width, height, maxIterations, output, &fractal);
+}
+
+#ifdef _OPENMP
+static void openmpBackendRender(void* state, int numThreads, const Fractal& fractal,
+                                float x0, float y0, float x1, float y1,
+                                int width, int height, int maxIterations, int output[])
+{
+    #pragma omp parallel for schedule(dynamic) num_threads(numThreads)
+    for (int startRow = 0; startRow < height; startRow += BACKEND_TILE_ROWS)
+        fractalSerial(fractal, x0, y0, x1, y1, width, height, startRow,
+                      std::min(BACKEND_TILE_ROWS, height - startRow), maxIterations, output);
+}
+#endif
+
+static void* poolBackendCreate(int numThreads) {
+    ThreadPool* pool = new ThreadPool;
+    threadPoolStart(pool, numThreads);
+    return pool;
+}
+
+static void poolBackendDestroy(void* state) {
+    ThreadPool* pool = static_cast<ThreadPool*>(state);
+    threadPoolStop(pool);
+    delete pool;
+}
+
+typedef struct {
+    const Fractal* fractal;
+    float x0, y0, x1, y1;
+    int width, height;
+    int maxIterations;
+    int* output;
+} BackendJob;
+
+static void backendRenderBand(void* arg, int task) {
+    const BackendJob* job = static_cast<const BackendJob*>(arg);
+    int startRow = task * BACKEND_TILE_ROWS;
+    fractalSerial(*job->fractal, job->x0, job->y0, job->x1, job->y1, job->width, job->height,
+                  startRow, std::min(BACKEND_TILE_ROWS, job->height - startRow),
+                  job->maxIterations, job->output);
+}
+
+static void poolBackendRender(void* state, int numThreads, const Fractal& fractal,
+                              float x0, float y0, float x1, float y1,
+                              int width, int height, int maxIterations, int output[])
+{
+    BackendJob job = { &fractal, x0, y0, x1, y1, width, height, maxIterations, output };
+    threadPoolRun(static_cast<ThreadPool*>(state), backendRenderBand, &job,
+                  (height + BACKEND_TILE_ROWS - 1) / BACKEND_TILE_ROWS);
+}
+
+#ifdef MANDELBROT_PARALLEL_STL
+static void parBackendRender(void* state, int numThreads, const Fractal& fractal,
+                             float x0, float y0, float x1, float y1,
+                             int width, int height, int maxIterations, int output[])
+{
+    BackendJob job = { &fractal, x0, y0, x1, y1, width, height, maxIterations, output };
+    std::vector<int> bands((height + BACKEND_TILE_ROWS - 1) / BACKEND_TILE_ROWS);
+    for (size_t i = 0; i < bands.size(); i++)
+        bands[i] = i;
+    std::for_each(std::execution::par, bands.begin(), bands.end(),
+                  [&job](int band) { backendRenderBand(&job, band); });
+}
+#endif
+
+const static ParallelBackend parallelBackends[] = {
+    { "pthreads", "", backendNoState, pthreadsBackendRender, backendNoDestroy },
+#ifdef _OPENMP
+    { "openmp", "-fopenmp", backendNoState, openmpBackendRender, backendNoDestroy },
+#else
+    { "openmp", "-fopenmp", backendNoState, NULL, backendNoDestroy },
+#endif
+    { "pool", "", poolBackendCreate, poolBackendRender, poolBackendDestroy },
+#ifdef MANDELBROT_PARALLEL_STL
+    { "par", "-std=c++17 -DMANDELBROT_PARALLEL_STL -ltbb", backendNoState, parBackendRender, backendNoDestroy },
+#else
+    { "par", "-std=c++17 -DMANDELBROT_PARALLEL_STL -ltbb", backendNoState, NULL, backendNoDestroy },
+#endif
+};
+const static int NUM_PARALLEL_BACKENDS = sizeof(parallelBackends) / sizeof(parallelBackends[0]);
+
+//
+// findParallelBackend --
+//
+// Look up a backend by name.  Returns NULL, after saying why, if there
+// is none or it was not compiled in.
+const ParallelBackend* findParallelBackend(const char* name) {
+    for (int i = 0; i < NUM_PARALLEL_BACKENDS; i++) {
+        if (strcmp(parallelBackends[i].name, name) != 0)
+            continue;
+        if (!parallelBackends[i].render) {
+            fprintf(stderr, "Backend %s needs to be built with %s\n", name, parallelBackends[i].buildFlags);
+            return NULL;
+        }
+        return &parallelBackends[i];
+    }
+    fprintf(stderr, "Unknown backend %s\n", name);
+    return NULL;
+}
+
+//
+// timeBackend --
+//
+// Best of 5 renders with the given backend, not counting its setup.
+double timeBackend(const ParallelBackend* backend, int numThreads, const Fractal& fractal,
+                   float x0, float y0, float x1, float y1,
+                   int width, int height, int maxIterations, int output[])
+{
+    void* state = backend->create(numThreads);
+    double minTime = 1e30;
+    for (int i = 0; i < 5; ++i) {
+        double startTime = CycleTimer::currentSeconds();
+        backend->render(state, numThreads, fractal, x0, y0, x1, y1, width, height, maxIterations, output);
+        double endTime = CycleTimer::currentSeconds();
+        minTime = std::min(minTime, endTime - startTime);
+    }
+    backend->destroy(state);
+    return minTime;
+}
+
+//
+// Renderer library --
+//
+// Implementation of the API in mandelbrot_render.h.  Every request is
+// cut into bands of RENDER_TILE_ROWS rows; a batch queues the bands of
+// all its requests as a single thread pool job, so the workers take
+// them in order without waiting for one view to finish before starting
+// on the next.  An asynchronous render is a job of its own, submitted
+// with threadPoolSubmit; inFlight counts those not yet finished.
+// Once the renderer is set to inexact, requests that fixedPointAllowed
+// accepts go through the fixed-point kernel.
+
+const static int RENDER_TILE_ROWS = 8;
+
+struct MandelbrotRenderer {
+    ThreadPool pool;
+    pthread_mutex_t lock;
+    pthread_cond_t finished;    // broadcast when an async render finishes
+    int inFlight;
+    int queueDepth;
+    bool exact;                 // never use the fixed-point kernel (the default)
+};
+
+struct MandelbrotRender {
+    MandelbrotRenderer* renderer;
+    RenderRequest request;
+    Fractal fractal;
+    bool fixedPoint;
+    RenderTileCallback onTile;
+    void* user;
+    PoolJob job;
+    bool done;                  // guarded by renderer->lock
+};
+
+typedef struct {
+    const RenderRequest* request;
+    Fractal fractal;
+    bool fixedPoint;
+    int startRow;
+} RenderTile;
+
+// Check a request and find its fractal.
+static bool renderRequestFractal(const RenderRequest* request, Fractal* fractal) {
+    *fractal = mandelbrotFractal;
+    if (request->kernel && !parseFractal(request->kernel, fractal))
+        return false;
+    return request->output && request->width > 0 && request->height > 0 &&
+           request->maxIterations >= 0;
+}
+
+static bool renderUsesFixedPoint(const MandelbrotRenderer* renderer,
+                                 const RenderRequest* request, const Fractal& fractal) {
+    return !renderer->exact &&
+           fixedPointAllowed(fractal, request->x0, request->y0, request->x1, request->y1,
+                             request->width, request->height, request->maxIterations);
+}
+
+static void renderRows(const RenderRequest* request, const Fractal& fractal, bool fixedPoint,
+                       int startRow, int rows) {
+    if (fixedPoint)
+        mandelbrotFixedSerial(request->x0, request->y0, request->x1, request->y1,
+                              request->width, request->height, startRow, rows,
+                              request->maxIterations, request->output);
+    else
+        fractalSerial(fractal, request->x0, request->y0, request->x1, request->y1,
+                      request->width, request->height, startRow, rows,
+                      request->maxIterations, request->output);
+}
+
+static void renderTile(void* arg, int task) {
+    const RenderTile& tile = static_cast<const RenderTile*>(arg)[task];
+    const RenderRequest* request = tile.request;
+    int rows = std::min(RENDER_TILE_ROWS, request->height - tile.startRow);
+    renderRows(request, tile.fractal, tile.fixedPoint, tile.startRow, rows);
+}
+
+static void asyncRenderTile(void* arg, int task) {
+    MandelbrotRender* render = static_cast<MandelbrotRender*>(arg);
+    const RenderRequest* request = &render->request;
+    int startRow = task * RENDER_TILE_ROWS;
+    int rows = std::min(RENDER_TILE_ROWS, request->height - startRow);
+    renderRows(request, render->fractal, render->fixedPoint, startRow, rows);
+    if (render->onTile)
+        render->onTile(render->user, request, startRow, rows);
+}
+
+static void asyncRenderFinish(void* arg) {
+    MandelbrotRender* render = static_cast<MandelbrotRender*>(arg);
+    MandelbrotRenderer* renderer = render->renderer;
+    pthread_mutex_lock(&renderer->lock);
+    render->done = true;
+    renderer->inFlight--;
+    pthread_cond_broadcast(&renderer->finished);
+    pthread_mutex_unlock(&renderer->lock);
+}
+
+MandelbrotRenderer* mandelbrotRendererCreateQueued(int numThreads, int queueDepth) {
+    if (numThreads <= 0 || queueDepth <= 0)
+        return NULL;
+    MandelbrotRenderer* renderer = new MandelbrotRenderer;
+    pthread_mutex_init(&renderer->lock, NULL);
+    pthread_cond_init(&renderer->finished, NULL);
+    renderer->inFlight = 0;
+    renderer->queueDepth = queueDepth;
+    renderer->exact = true;
+    threadPoolStart(&renderer->pool, numThreads);
+    return renderer;
+}
+
+MandelbrotRenderer* mandelbrotRendererCreate(int numThreads) {
+    return mandelbrotRendererCreateQueued(numThreads, MANDELBROT_RENDER_QUEUE_DEPTH);
+}
+
+void mandelbrotRendererSetExact(MandelbrotRenderer* renderer, bool exact) {
+    renderer->exact = exact;
+}
+
+void mandelbrotRendererDestroy(MandelbrotRenderer* renderer) {
+    if (!renderer)
+        return;
+    threadPoolStop(&renderer->pool);
+    pthread_mutex_destroy(&renderer->lock);
+    pthread_cond_destroy(&renderer->finished);
+    delete renderer;
+}
+
+int mandelbrotRenderAsync(MandelbrotRenderer* renderer, const RenderRequest* request,
+                          RenderTileCallback onTile, void* user, bool wait,
+                          MandelbrotRender** render)
+{
+    Fractal fractal;
+    if (!renderRequestFractal(request, &fractal))
+        return RENDER_INVALID;
+
+    pthread_mutex_lock(&renderer->lock);
+    while (renderer->inFlight >= renderer->queueDepth) {
+        if (!wait) {
+            pthread_mutex_unlock(&renderer->lock);
+            return RENDER_QUEUE_FULL;
+        }
+        pthread_cond_wait(&renderer->finished, &renderer->lock);
+    }
+    renderer->inFlight++;
+    pthread_mutex_unlock(&renderer->lock);
+
+    MandelbrotRender* r = new MandelbrotRender;
+    r->renderer = renderer;
+    r->request = *request;
+    r->request.kernel = NULL;   // not needed past parsing, may not outlive the call
+    r->fractal = fractal;
+    r->fixedPoint = renderUsesFixedPoint(renderer, request, fractal);
+    r->onTile = onTile;
+    r->user = user;
+    r->done = false;
+    r->job.run = asyncRenderTile;
+    r->job.finish = asyncRenderFinish;
+    r->job.arg = r;
+    r->job.numTasks = (request->height + RENDER_TILE_ROWS - 1) / RENDER_TILE_ROWS;
+    *render = r;
+    threadPoolSubmit(&renderer->pool, &r->job);
+    return RENDER_SUBMITTED;
+}
+
+bool mandelbrotRenderPoll(MandelbrotRender* render) {
+    pthread_mutex_lock(&render->renderer->lock);
+    bool done = render->done;
+    pthread_mutex_unlock(&render->renderer->lock);
+    return done;
+}
+
+void mandelbrotRenderWait(MandelbrotRender* render) {
+    MandelbrotRenderer* renderer = render->renderer;
+    pthread_mutex_lock(&renderer->lock);
+    while (!render->done)
+        pthread_cond_wait(&renderer->finished, &renderer->lock);
+    pthread_mutex_unlock(&renderer->lock);
+    delete render;
+}
+
+bool mandelbrotRender(MandelbrotRenderer* renderer, const RenderRequest* request) {
+    return mandelbrotRenderBatch(renderer, request, 1) == 1;
+}
+
+int mandelbrotRenderBatch(MandelbrotRenderer* renderer,
+                          const RenderRequest* requests, int numRequests)
+{
+    std::vector<RenderTile> tiles;
+    int accepted = 0;
+    for (int i = 0; i < numRequests; i++) {
+        const RenderRequest* request = &requests[i];
+        RenderTile tile;
+        tile.request = request;
+        if (!renderRequestFractal(request, &tile.fractal))
+            continue;
+        tile.fixedPoint = renderUsesFixedPoint(renderer, request, tile.fractal);
+        for (tile.startRow = 0; tile.startRow < request->height; tile.startRow += RENDER_TILE_ROWS)
+            tiles.push_back(tile);
+        accepted++;
+    }
+
+    if (!tiles.empty())
+        threadPoolRun(&renderer->pool, renderTile, &tiles[0], (int)tiles.size());
+    return accepted;
+}
+
+//
+// Packed rendering --
+//
+// mandelbrotRenderPacked puts the pixels of all requests that share a
+// fractal, iteration limit and kernel precision into one stream, in
+// request and then row order, and cuts it into PACKED_TILE_PIXELS
+// pixel tiles for the pool.  Each vector is filled from consecutive
+// pixels of the stream, whatever row or view they come from, and its
+// counts are scattered back to their requests.  No lane is left empty
+// or sent through the scalar kernel at the end of a row, and a
+// thumbnail costs no more than its pixels.
+
+const static int PACKED_TILE_PIXELS = 2048;
+
+typedef struct {
+    const RenderRequest* request;
+    long long start;            // index of its first pixel in the stream
+} PackedView;
+
+typedef struct {
+    Fractal fractal;
+    bool fixedPoint;
+    int maxIterations;
+    std::vector<PackedView> views;
+    long long pixels;
+} PackedGroup;
+
+typedef struct {
+    const PackedGroup* group;
+    long long start, end;       // pixels [start, end) of the group's stream
+} PackedTile;
+
+// Render lanes (8, or 16 in fixed point) pixels and store their counts.
+static inline void renderPackedVector(const PackedGroup& group, float xs[16], float ys[16],
+                                      int counts[16])
+{
+    if (group.fixedPoint) {
+        __m256i fixed = mandelFixed(fixedFromFloats(xs), fixedFromFloats(ys), group.maxIterations);
+        _mm256_storeu_si256((__m256i*)counts, _mm256_cvtepi16_epi32(_mm256_castsi256_si128(fixed)));
+        _mm256_storeu_si256((__m256i*)(counts + 8), _mm256_cvtepi16_epi32(_mm256_extracti128_si256(fixed, 1)));
+    } else {
+        _mm256_storeu_si256((__m256i*)counts, fractalKernels[group.fractal.kind].mandel8(
+            group.fractal, _mm256_loadu_ps(xs), _mm256_loadu_ps(ys), group.maxIterations));
+    }
+}
+
+static void renderPackedTile(void* arg, int task) {
+    const PackedTile& tile = static_cast<const PackedTile*>(arg)[task];
+    const PackedGroup& group = *tile.group;
+    int lanes = group.fixedPoint ? 16 : 8;
+    float xs[16], ys[16];
+    int* outputs[16];
+    int filled = 0;
+
+    // the last view starting at or before the tile
+    size_t v = 0;
+    while (v + 1 < group.views.size() && group.views[v + 1].start <= tile.start)
+        v++;
+
+    for (long long p = tile.start; p < tile.end; v++) {
+        const RenderRequest* request = group.views[v].request;
+        long long viewEnd = group.views[v].start + (long long)request->width * request->height;
+        float dx = (request->x1 - request->x0) / request->width;
+        float dy = (request->y1 - request->y0) / request->height;
+        int local = p - group.views[v].start;
+        int i = local % request->width, j = local / request->width;
+
+        long long end = std::min(viewEnd, tile.end);
+        for (; p < end; p++) {
+            // a vector that lies within one row goes straight to the output
+            while (filled == 0 && i + lanes <= request->width && p + lanes <= end) {
+                for (int k = 0; k < lanes; ++k) {
+                    xs[k] = request->x0 + (i + k) * dx;
+                    ys[k] = request->y0 + j * dy;
+                }
+                renderPackedVector(group, xs, ys, request->output + j * request->width + i);
+                p += lanes;
+                i += lanes;
+                if (i == request->width) {
+                    i = 0;
+                    j++;
+                }
+            }
+            if (p == end)
+                break;
+
+            xs[filled] = request->x0 + i * dx;
+            ys[filled] = request->y0 + j * dy;
+            outputs[filled] = request->output + j * request->width + i;
+            if (++i == request->width) {
+                i = 0;
+                j++;
+            }
+            if (++filled < lanes && p + 1 < tile.end)
+                continue;
+
+            // pad a short last vector with copies of its last pixel
+            for (int k = filled; k < lanes; k++) {
+                xs[k] = xs[filled - 1];
+                ys[k] = ys[filled - 1];
+            }
+            int counts[16];
+            renderPackedVector(group, xs, ys, counts);
+            for (int k = 0; k < filled; k++)
+                *outputs[k] = counts[k];
+            filled = 0;
+        }
+    }
+}
+
+int mandelbrotRenderPacked(MandelbrotRenderer* renderer,
+                           const RenderRequest* requests, int numRequests)
+{
+    std::vector<PackedGroup> groups;
+    int accepted = 0;
+    for (int i = 0; i < numRequests; i++) {
+        const RenderRequest* request = &requests[i];
+        Fractal fractal;
+        if (!renderRequestFractal(request, &fractal))
+            continue;
+        bool fixedPoint = renderUsesFixedPoint(renderer, request, fractal);
+
+        size_t g = 0;
+        while (g < groups.size() &&
+               (groups[g].fixedPoint != fixedPoint || groups[g].maxIterations != request->maxIterations ||
+                groups[g].fractal.kind != fractal.kind || groups[g].fractal.c_re != fractal.c_re ||
+                groups[g].fractal.c_im != fractal.c_im))
+            g++;
+        if (g == groups.size()) {
+            PackedGroup group;
+            group.fractal = fractal;
+            group.fixedPoint = fixedPoint;
+            group.maxIterations = request->maxIterations;
+            group.pixels = 0;
+            groups.push_back(group);
+        }
+        PackedView view = { request, groups[g].pixels };
+        groups[g].views.push_back(view);
+        groups[g].pixels += (long long)request->width * request->height;
+        accepted++;
+    }
+
+    std::vector<PackedTile> tiles;
+    for (size_t g = 0; g < groups.size(); g++) {
+        for (long long start = 0; start < groups[g].pixels; start += PACKED_TILE_PIXELS) {
+            PackedTile tile = { &groups[g], start, std::min(start + PACKED_TILE_PIXELS, groups[g].pixels) };
+            tiles.push_back(tile);
+        }
+    }
+
+    if (!tiles.empty())
+        threadPoolRun(&renderer->pool, renderPackedTile, &tiles[0], (int)tiles.size());
+    return accepted;
+}
+
+//
+// benchmarkBatch --
+//
+// Render numViews thumbnails zooming from the full set into the view
+// given on the command line, once with a mandelbrotThread call per view
+// and once with a single mandelbrotRenderBatch call, and compare.  Then
+// submit the views one by one with mandelbrotRenderAsync, BATCH_QUEUE_DEPTH
+// at a time, waiting for the oldest render whenever the queue is full.
+const static int BATCH_VIEW_WIDTH = 160;
+const static int BATCH_VIEW_HEIGHT = 120;
+const static int BATCH_QUEUE_DEPTH = 4;
+
+static void countTile(void* user, const RenderRequest* request, int startRow, int rows) {
+    static_cast<std::atomic<int>*>(user)->fetch_add(1);
+}
+
+bool benchmarkBatch(int numThreads, int numViews, const Fractal& fractal,
+                    float x0, float y0, float x1, float y1, int maxIterations)
+{
+    const int pixels = BATCH_VIEW_WIDTH * BATCH_VIEW_HEIGHT;
+    std::vector<int> single(numViews * pixels), batched(numViews * pixels), streamed(numViews * pixels);
+    std::vector<int> fixed(numViews * pixels);
+    std::vector<RenderRequest> requests(numViews);
+
+    // the kernel travels as a string, as it would through the API
+    char kernel[64];
+    snprintf(kernel, sizeof(kernel), "%s:%.9g,%.9g",
+             fractalKernels[fractal.kind].name, fractal.c_re, fractal.c_im);
+
+    for (int v = 0; v < numViews; v++) {
+        float t = numViews > 1 ? (float)v / (numViews - 1) : 1.f;
+        RenderRequest& request = requests[v];
+        request.x0 = -2.f + t * (x0 + 2.f);
+        request.x1 = 1.f + t * (x1 - 1.f);
+        request.y0 = -1.f + t * (y0 + 1.f);
+        request.y1 = 1.f + t * (y1 - 1.f);
+        request.width = BATCH_VIEW_WIDTH;
+        request.height = BATCH_VIEW_HEIGHT;
+        request.maxIterations = maxIterations;
+        request.kernel = kernel;
+        request.output = &batched[v * pixels];
+    }
+
+    double minSingle = 1e30;
+    for (int i = 0; i < 3; ++i) {
+        double startTime = CycleTimer::currentSeconds();
+        for (int v = 0; v < numViews; v++) {
+            const RenderRequest& request = requests[v];
+            mandelbrotThread(numThreads, request.x0, request.y0, request.x1, request.y1,
+                             request.width, request.height, maxIterations,
+                             &single[v * pixels], &fractal);
+        }
+        double endTime = CycleTimer::currentSeconds();
+        minSingle = std::min(minSingle, endTime - startTime);
+    }
+
+    // the float kernel throughout, to compare like with like
+    MandelbrotRenderer* renderer = mandelbrotRendererCreate(numThreads);
+    double minBatch = 1e30;
+    int rendered = 0;
+    for (int i = 0; i < 3; ++i) {
+        double startTime = CycleTimer::currentSeconds();
+        rendered = mandelbrotRenderBatch(renderer, &requests[0], numViews);
+        double endTime = CycleTimer::currentSeconds();
+        minBatch = std::min(minBatch, endTime - startTime);
+    }
+
+    // then letting the renderer pick the fixed-point kernel where it may
+    std::vector<RenderRequest> fixedRequests(requests);
+    int fixedViews = 0;
+    for (int v = 0; v < numViews; v++) {
+        fixedRequests[v].output = &fixed[v * pixels];
+        const RenderRequest& request = requests[v];
+        fixedViews += fixedPointAllowed(fractal, request.x0, request.y0, request.x1, request.y1,
+                                        request.width, request.height, request.maxIterations);
+    }
+    mandelbrotRendererSetExact(renderer, false);
+    double minFixed = 1e30;
+    for (int i = 0; i < 3; ++i) {
+        double startTime = CycleTimer::currentSeconds();
+        mandelbrotRenderBatch(renderer, &fixedRequests[0], numViews);
+        double endTime = CycleTimer::currentSeconds();
+        minFixed = std::min(minFixed, endTime - startTime);
+    }
+    mandelbrotRendererDestroy(renderer);
+    int fixedMismatches = 0;
+    for (int i = 0; i < numViews * pixels; i++)
+        fixedMismatches += fixed[i] != single[i];
+
+    renderer = mandelbrotRendererCreateQueued(numThreads, BATCH_QUEUE_DEPTH);
+    std::vector<RenderRequest> asyncRequests(requests);
+    for (int v = 0; v < numViews; v++)
+        asyncRequests[v].output = &streamed[v * pixels];
+    std::atomic<int> tiles(0);
+    int queueFull = 0;
+    double minAsync = 1e30;
+    for (int i = 0; i < 3; ++i) {
+        double startTime = CycleTimer::currentSeconds();
+        std::deque<MandelbrotRender*> pending;
+        for (int v = 0; v < numViews; v++) {
+            MandelbrotRender* render;
+            while (mandelbrotRenderAsync(renderer, &asyncRequests[v], countTile, &tiles,
+                                         false, &render) == RENDER_QUEUE_FULL) {
+                queueFull++;
+                mandelbrotRenderWait(pending.front());
+                pending.pop_front();
+            }
+            pending.push_back(render);
+        }
+        while (!pending.empty()) {
+            mandelbrotRenderWait(pending.front());
+            pending.pop_front();
+        }
+        double endTime = CycleTimer::currentSeconds();
+        minAsync = std::min(minAsync, endTime - startTime);
+    }
+    mandelbrotRendererDestroy(renderer);
+
+    if (rendered != numViews || !verifyResult(&single[0], &batched[0], BATCH_VIEW_WIDTH, BATCH_VIEW_HEIGHT * numViews)) {
+        printf("Error : Output from batch render does not match per-view output\n");
+        return false;
+    }
+    int tilesPerView = (BATCH_VIEW_HEIGHT + RENDER_TILE_ROWS - 1) / RENDER_TILE_ROWS;
+    if (tiles != 3 * numViews * tilesPerView ||
+        !verifyResult(&single[0], &streamed[0], BATCH_VIEW_WIDTH, BATCH_VIEW_HEIGHT * numViews)) {
+        printf("Error : Output from async render does not match per-view output\n");
+        return false;
+    }
+
+    printf("%d views of %dx%d, %d threads\n", numViews, BATCH_VIEW_WIDTH, BATCH_VIEW_HEIGHT, numThreads);
+    printf("[mandelbrot per view]:\t\t[%.3f] ms\n", minSingle * 1000);
+    printf("[mandelbrot batch]:\t\t[%.3f] ms\n", minBatch * 1000);
+    printf("\t\t\t\t(%.2fx speedup from batching)\n", minSingle / minBatch);
+    printf("[mandelbrot batch auto]:\t[%.3f] ms\n", minFixed * 1000);
+    printf("\t\t\t\t(%.2fx speedup, %d of %d views in fixed point, %.2f%% of pixels differ)\n",
+           minBatch / minFixed, fixedViews, numViews, 100. * fixedMismatches / (numViews * pixels));
+    printf("[mandelbrot async]:\t\t[%.3f] ms\n", minAsync * 1000);
+    printf("\t\t\t\t(%.2fx speedup, queue depth %d, full %d times)\n",
+           minSingle / minAsync, BATCH_QUEUE_DEPTH, queueFull);
+    return true;
+}
+
+//
+// benchmarkGallery --
+//
+// Render numViews square thumbnails of GALLERY_SIZES pixels along the
+// same zoom as benchmarkBatch: one mandelbrotRender call per thumbnail,
+// one mandelbrotRenderBatch call, and one mandelbrotRenderPacked call,
+// all with the float kernel, then packed again with the fixed-point
+// kernel where allowed.  Reports the throughput of each.  Every packed
+// render must match the batch render of the same precision exactly.
+const static int GALLERY_SIZES[] = { 64, 61, 13 };
+
+bool benchmarkGallery(int numThreads, int numViews, const Fractal& fractal,
+                      float x0, float y0, float x1, float y1, int maxIterations)
+{
+    char kernel[64];
+    snprintf(kernel, sizeof(kernel), "%s:%.9g,%.9g",
+             fractalKernels[fractal.kind].name, fractal.c_re, fractal.c_im);
+    MandelbrotRenderer* renderer = mandelbrotRendererCreate(numThreads);
+    bool ok = true;
+
+    for (size_t s = 0; s < sizeof(GALLERY_SIZES) / sizeof(GALLERY_SIZES[0]); s++) {
+        int size = GALLERY_SIZES[s];
+        int pixels = size * size;
+        std::vector<int> single(numViews * pixels), batched(numViews * pixels), packed(numViews * pixels);
+        std::vector<int> packedFixed(numViews * pixels), batchedFixed(numViews * pixels);
+        std::vector<RenderRequest> requests(numViews);
+        for (int v = 0; v < numViews; v++) {
+            float t = numViews > 1 ? (float)v / (numViews - 1) : 1.f;
+            RenderRequest& request = requests[v];
+            request.x0 = -2.f + t * (x0 + 2.f);
+            request.x1 = 1.f + t * (x1 - 1.f);
+            request.y0 = -1.f + t * (y0 + 1.f);
+            request.y1 = 1.f + t * (y1 - 1.f);
+            request.width = size;
+            request.height = size;
+            request.maxIterations = maxIterations;
+            request.kernel = kernel;
+        }
+
+        double minTimes[4] = { 1e30, 1e30, 1e30, 1e30 };
+        for (int i = 0; i < 3; ++i) {
+            mandelbrotRendererSetExact(renderer, true);
+            double startTime = CycleTimer::currentSeconds();
+            for (int v = 0; v < numViews; v++) {
+                requests[v].output = &single[v * pixels];
+                mandelbrotRender(renderer, &requests[v]);
+            }
+            double singleTime = CycleTimer::currentSeconds();
+            for (int v = 0; v < numViews; v++)
+                requests[v].output = &batched[v * pixels];
+            mandelbrotRenderBatch(renderer, &requests[0], numViews);
+            double batchTime = CycleTimer::currentSeconds();
+            for (int v = 0; v < numViews; v++)
+                requests[v].output = &packed[v * pixels];
+            mandelbrotRenderPacked(renderer, &requests[0], numViews);
+            double packedTime = CycleTimer::currentSeconds();
+            if (i == 0 && (!verifyResult(&single[0], &batched[0], size, size * numViews) ||
+                           !verifyResult(&single[0], &packed[0], size, size * numViews))) {
+                printf("Error : Output from packed render does not match per-view output\n");
+                ok = false;
+                break;
+            }
+            mandelbrotRendererSetExact(renderer, false);
+            for (int v = 0; v < numViews; v++)
+                requests[v].output = &packedFixed[v * pixels];
+            mandelbrotRenderPacked(renderer, &requests[0], numViews);
+            double endTime = CycleTimer::currentSeconds();
+
+            // packing must not change the counts of the fixed-point kernel either
+            if (i == 0) {
+                for (int v = 0; v < numViews; v++)
+                    requests[v].output = &batchedFixed[v * pixels];
+                mandelbrotRenderBatch(renderer, &requests[0], numViews);
+                if (!verifyResult(&batchedFixed[0], &packedFixed[0], size, size * numViews)) {
+                    printf("Error : Output from packed fixed-point render does not match batch output\n");
+                    ok = false;
+                    break;
+                }
+            }
+
+            minTimes[0] = std::min(minTimes[0], singleTime - startTime);
+            minTimes[1] = std::min(minTimes[1], batchTime - singleTime);
+            minTimes[2] = std::min(minTimes[2], packedTime - batchTime);
+            minTimes[3] = std::min(minTimes[3], endTime - packedTime);
+        }
+        if (!ok)
+            break;
+
+        double megapixels = (double)numViews * pixels / 1e6;
+        printf("%d thumbnails of %dx%d, %d threads\n", numViews, size, size, numThreads);
+        printf("[mandelbrot per thumbnail]:\t[%.3f] ms\t%.1f Mpixels/s\n",
+               minTimes[0] * 1000, megapixels / minTimes[0]);
+        printf("[mandelbrot batch]:\t\t[%.3f] ms\t%.1f Mpixels/s\n",
+               minTimes[1] * 1000, megapixels / minTimes[1]);
+        printf("[mandelbrot packed]:\t\t[%.3f] ms\t%.1f Mpixels/s\n",
+               minTimes[2] * 1000, megapixels / minTimes[2]);
+        printf("\t\t\t\t(%.2fx speedup over per-thumbnail calls)\n", minTimes[0] / minTimes[2]);
+        printf("[mandelbrot packed auto]:\t[%.3f] ms\t%.1f Mpixels/s\n",
+               minTimes[3] * 1000, megapixels / minTimes[3]);
+    }
+
+    mandelbrotRendererDestroy(renderer);
+    return ok;
+}
+
+//
+// Tile server --
+//
+// Long-running render daemon answering "GET /z/x/y[.ppm][?iters=N]"
+// on a localhost HTTP port.  At zoom level z the square [-2,2]x[-2,2]
+// is cut into 2^z by 2^z tiles of SERVER_TILE_SIZE pixels; tile (x, y)
+// covers columns x and rows y counted from the (-2, -2) corner.
+//
+// Rendered tiles are kept as encoded PPM images in an LRU of at most
+// cacheTiles entries.  A request for a tile that another connection is
+// already rendering waits for that render instead of starting its own.
+// "GET /stats" reports request, hit and dedup counters and the p50/p99
+// request latency over the last SERVER_LATENCY_SAMPLES requests.
+
+const static int SERVER_TILE_SIZE = 256;
+const static int SERVER_TILE_BAND_ROWS = 16;
+const static int SERVER_CONNECTION_THREADS = 16;
+const static int SERVER_LATENCY_SAMPLES = 4096;
+const static int SERVER_MAX_REQUEST = 8192;
+
+typedef std::shared_ptr<const std::vector<unsigned char> > TileData;
+
+typedef struct {
+    pthread_cond_t ready;
+    bool done;
+    int waiters;
+    TileData data;
+} InFlightTile;
+
+typedef struct {
+    ThreadPool pool;
+    int listenFd;
+    size_t cacheTiles;
+
+    pthread_mutex_t lock;
+    // most recently used at the front
+    std::list<std::pair<std::string, TileData> > lru;
+    std::map<std::string, std::list<std::pair<std::string, TileData> >::iterator> cache;
+    std::map<std::string, InFlightTile*> inFlight;
+
+    unsigned long long requests;
+    unsigned long long hits;
+    unsigned long long joins;
+    unsigned long long renders;
+    unsigned long long errors;
+    std::vector<double> latencies;  // ring buffer, seconds
+    size_t nextLatency;
+} TileServer;
+
+typedef struct {
+    float x0, y0, x1, y1;
+    int maxIterations;
+    int* output;
+} TileRenderArgs;
+
+static void serverRenderBand(void* arg, int band) {
+    TileRenderArgs* args = static_cast<TileRenderArgs*>(arg);
+    mandelbrotSerial(args->x0, args->y0, args->x1, args->y1,
+                     SERVER_TILE_SIZE, SERVER_TILE_SIZE,
+                     band * SERVER_TILE_BAND_ROWS, SERVER_TILE_BAND_ROWS,
+                     args->maxIterations, args->output);
+}
+
+static TileData serverRenderTile(TileServer* server, int z, int x, int y, int maxIterations) {
+    float span = 4.f / (1 << z);
+    TileRenderArgs args;
+    args.x0 = -2.f + x * span;
+    args.x1 = args.x0 + span;
+    args.y0 = -2.f + y * span;
+    args.y1 = args.y0 + span;
+    args.maxIterations = maxIterations;
+    args.output = new int[SERVER_TILE_SIZE * SERVER_TILE_SIZE];
+
+    threadPoolRun(&server->pool, serverRenderBand, &args,
+                  SERVER_TILE_SIZE / SERVER_TILE_BAND_ROWS);
+
+    std::vector<unsigned char>* ppm = new std::vector<unsigned char>();
+    encodePPMImage(args.output, SERVER_TILE_SIZE, SERVER_TILE_SIZE, maxIterations, *ppm);
+    delete[] args.output;
+    return TileData(ppm);
+}
+
+//
+// serverGetTile --
+//
+// Return the tile from the cache, from a render already in flight, or
+// by rendering it on the pool.
+static TileData serverGetTile(TileServer* server, int z, int x, int y, int maxIterations) {
+    char keyBuf[64];
+    snprintf(keyBuf, sizeof(keyBuf), "%d/%d/%d/%d", z, x, y, maxIterations);
+    std::string key(keyBuf);
+
+    pthread_mutex_lock(&server->lock);
+
+    if (server->cache.count(key)) {
+        server->hits++;
+        server->lru.splice(server->lru.begin(), server->lru, server->cache[key]);
+        TileData data = server->lru.front().second;
+        pthread_mutex_unlock(&server->lock);
+        return data;
+    }
+
+    if (server->inFlight.count(key)) {
+        server->joins++;
+        InFlightTile* tile = server->inFlight[key];
+        tile->waiters++;
+        while (!tile->done)
+            pthread_cond_wait(&tile->ready, &server->lock);
+        TileData data = tile->data;
+        if (--tile->waiters == 0)
+            pthread_cond_broadcast(&tile->ready);
+        pthread_mutex_unlock(&server->lock);
+        return data;
+    }
+
+    InFlightTile tile;
+    pthread_cond_init(&tile.ready, NULL);
+    tile.done = false;
+    tile.waiters = 0;
+    server->inFlight[key] = &tile;
+    server->renders++;
+    pthread_mutex_unlock(&server->lock);
+
+    TileData data = serverRenderTile(server, z, x, y, maxIterations);
+
+    pthread_mutex_lock(&server->lock);
+    server->lru.push_front(std::make_pair(key, data));
+    server->cache[key] = server->lru.begin();
+    while (server->lru.size() > server->cacheTiles) {
+        server->cache.erase(server->lru.back().first);
+        server->lru.pop_back();
+    }
+    server->inFlight.erase(key);
+    tile.data = data;
+    tile.done = true;
+    pthread_cond_broadcast(&tile.ready);
+    // tile lives on this stack frame, so wait for the joiners to pick up
+    // their copy of the data
+    while (tile.waiters > 0)
+        pthread_cond_wait(&tile.ready, &server->lock);
+    pthread_mutex_unlock(&server->lock);
+    pthread_cond_destroy(&tile.ready);
+    return data;
+}
+
+static double serverPercentile(std::vector<double> samples, double p) {
+    if (samples.empty())
+        return 0.;
+    size_t k = std::min(samples.size() - 1, static_cast<size_t>(p * samples.size()));
+    std::nth_element(samples.begin(), samples.begin() + k, samples.end());
+    return samples[k];
+}
+
+static void serverFormatStats(TileServer* server, std::string& body) {
+    pthread_mutex_lock(&server->lock);
+    std::vector<double> latencies = server->latencies;
+    unsigned long long requests = server->requests, hits = server->hits;
+    unsigned long long joins = server->joins, renders = server->renders;
+    unsigned long long errors = server->errors;
+    size_t cached = server->lru.size();
+    pthread_mutex_unlock(&server->lock);
+
+    unsigned long long tileRequests = hits + joins + renders;
+    char buf[512];
+    snprintf(buf, sizeof(buf),
+             "{\"requests\": %llu, \"errors\": %llu, \"hits\": %llu, \"joins\": %llu, "
+             "\"renders\": %llu, \"hit_rate\": %.4f, \"cached_tiles\": %zu, "
+             "\"p50_ms\": %.3f, \"p99_ms\": %.3f}\n",
+             requests, errors, hits, joins, renders,
+             tileRequests ? static_cast<double>(hits + joins) / tileRequests : 0.,
+             cached,
+             serverPercentile(latencies, .50) * 1000,
+             serverPercentile(latencies, .99) * 1000);
+    body = buf;
+}
+
+static void serverRespond(int fd, int status, const char* reason, const char* contentType,
+                          const void* body, size_t length) {
+    char header[256];
+    int headerLength = snprintf(header, sizeof(header),
+                                "HTTP/1.1 %d %s\r\n"
+                                "Content-Type: %s\r\n"
+                                "Content-Length: %zu\r\n"
+                                "Connection: close\r\n\r\n",
+                                status, reason, contentType, length);
+    if (farmWriteFully(fd, header, headerLength) && length > 0)
+        farmWriteFully(fd, body, length);
+}
+
+static void serverHandleConnection(TileServer* server, int fd) {
+    char request[SERVER_MAX_REQUEST + 1];
+    size_t length = 0;
+    while (length < SERVER_MAX_REQUEST) {
+        ssize_t n = recv(fd, request + length, SERVER_MAX_REQUEST - length, 0);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return;
+        length += n;
+        request[length] = '\0';
+        if (strstr(request, "\r\n\r\n") || strstr(request, "\n\n"))
+            break;
+    }
+    request[length] = '\0';
+
+    double startTime = CycleTimer::currentSeconds();
+    int z, x, y, maxIterations = 256;
+    char path[512];
+    bool ok = false;
+
+    if (sscanf(request, "GET %511s", path) == 1) {
+        char* query = strchr(path, '?');
+        if (query) {
+            *query++ = '\0';
+            const char* iters = strstr(query, "iters=");
+            if (iters)
+                maxIterations = atoi(iters + 6);
+        }
+
+        if (strcmp(path, "/stats") == 0) {
+            std::string body;
+            serverFormatStats(server, body);
+            serverRespond(fd, 200, "OK", "application/json", body.data(), body.size());
+            return;
+        }
+
+        int consumed = 0;
+        if (sscanf(path, "/%d/%d/%d%n", &z, &x, &y, &consumed) == 3 &&
+            (path[consumed] == '\0' || strcmp(path + consumed, ".ppm") == 0) &&
+            z >= 0 && z < 24 && x >= 0 && x < (1 << z) && y >= 0 && y < (1 << z) &&
+            maxIterations > 0) {
+            TileData data = serverGetTile(server, z, x, y, maxIterations);
+            serverRespond(fd, 200, "OK", "image/x-portable-pixmap", data->data(), data->size());
+            ok = true;
+        }
+    }
+
+    if (!ok) {
+        const char* body = "usage: GET /z/x/y[?iters=N] or GET /stats\n";
+        serverRespond(fd, 404, "Not Found", "text/plain", body, strlen(body));
+    }
+
+    double latency = CycleTimer::currentSeconds() - startTime;
+    pthread_mutex_lock(&server->lock);
+    server->requests++;
+    if (!ok)
+        server->errors++;
+    if (server->latencies.size() < SERVER_LATENCY_SAMPLES) {
+        server->latencies.push_back(latency);
+    } else {
+        server->latencies[server->nextLatency] = latency;
+        server->nextLatency = (server->nextLatency + 1) % SERVER_LATENCY_SAMPLES;
+    }
+    pthread_mutex_unlock(&server->lock);
+}
+
+static void* serverConnectionThreadStart(void* serverArg) {
+    TileServer* server = static_cast<TileServer*>(serverArg);
+    while (true) {
+        int fd = accept(server->listenFd, NULL, NULL);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            break;
+        }
+        serverHandleConnection(server, fd);
+        close(fd);
+    }
+    return NULL;
+}
+
+//
+// serveTiles --
+//
+// Run the tile server on 127.0.0.1:port with numThreads render threads
+// until the process is killed.
+int serveTiles(int port, int numThreads, int cacheTiles) {
+    signal(SIGPIPE, SIG_IGN);
+
+    char address[64];
+    snprintf(address, sizeof(address), "tcp:127.0.0.1:%d", port);
+
+    TileServer server;
+    server.listenFd = farmOpenSocket(address, true);
+    if (server.listenFd < 0) {
+        fprintf(stderr, "Error: could not listen on %s\n", address);
+        return 1;
+    }
+    server.cacheTiles = cacheTiles;
+    server.requests = server.hits = server.joins = server.renders = server.errors = 0;
+    server.nextLatency = 0;
+    pthread_mutex_init(&server.lock, NULL);
+
+    // pay for the /proc/cpuinfo scan once, up front
+    CycleTimer::secondsPerTick();
+    threadPoolStart(&server.pool, numThreads);
+
+    printf("Serving %dx%d tiles on http://127.0.0.1:%d/z/x/y with %d threads\n",
+           SERVER_TILE_SIZE, SERVER_TILE_SIZE, port, numThreads);
+    fflush(stdout);
+
+    pthread_t connectionThreads[SERVER_CONNECTION_THREADS];
+    for (int i = 0; i < SERVER_CONNECTION_THREADS; i++)
+        pthread_create(&connectionThreads[i], NULL, serverConnectionThreadStart, &server);
+    for (int i = 0; i < SERVER_CONNECTION_THREADS; i++)
+        pthread_join(connectionThreads[i], NULL);
+
+    threadPoolStop(&server.pool);
+    close(server.listenFd);
+    return 0;
+}
+
+//
+// Tile pyramid --
+//
+// Writes a Deep Zoom pyramid of a square region to a directory:
+// DIR/mandelbrot.dzi and DIR/mandelbrot_files/L/C_R.png, where level L
+// is 2^L pixels across and is cut into PYRAMID_TILE_SIZE square tiles
+// (one smaller tile at the levels below that size).  Tiles are plain
+// uncompressed PNGs, so any browser viewer can load them.
+//
+// Only the deepest level is rendered, one tile per pool task, in
+// Z-order so the four children of a tile tend to finish together.
+// Whichever thread finishes a tile writes it, averages it 2x2 into its
+// quarter of the parent with AVX2 and, if that was the parent's last
+// child, goes on to finish the parent.  Coarse tiles are therefore
+// written while deep tiles are still rendering, and the downsampling
+// is spread over the pool.  Pixels are 4-byte RGBX, 8 to a vector.
+
+const static int PYRAMID_TILE_SIZE = 256;
+const static int PYRAMID_DEPTH = 3;     // default: deepest level is 2^depth tiles across
+const static int PYRAMID_MAX_DEPTH = 5; // 8192x8192, 256 MB at the deepest level
+
+typedef struct {
+    int size;                           // pixels across
+    int tiles;                          // tiles across
+    std::vector<unsigned int> pixels;   // size * size RGBX
+    std::unique_ptr<std::atomic<int>[]> childrenLeft;   // per tile
+} PyramidLevel;
+
+typedef struct {
+    const Fractal* fractal;
+    float x0, y0, side;                 // the square region
+    int maxIterations;
+    const char* dir;                    // NULL to build without writing
+    int depth;                          // deepest level is 2^depth tiles across
+    std::vector<PyramidLevel> levels;   // levels[L] is 2^L pixels across
+    std::atomic<int> tilesWritten;
+    std::atomic<bool> failed;
+} Pyramid;
+
+//
+// encodePNGImage --
+//
+// Append an 8-bit RGB PNG of the width by height RGBX pixels at rgbx,
+// stride pixels apart, to out.  The image data is left uncompressed
+// (stored deflate blocks).
+static unsigned int crc32(const unsigned char* data, size_t length, unsigned int crc = 0)
+{
+    static struct Crc32Table {
+        unsigned int entries[256];
+        Crc32Table() {
+            for (unsigned int n = 0; n < 256; n++) {
+                unsigned int c = n;
+                for (int k = 0; k < 8; k++)
+                    c = c & 1 ? 0xedb88320u ^ (c >> 1) : c >> 1;
+                entries[n] = c;
+            }
+        }
+    } table;
+
+    crc = ~crc;
+    for (size_t i = 0; i < length; i++)
+        crc = table.entries[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+    return ~crc;
+}
+
+static void appendBigEndian(std::vector<unsigned char>& out, unsigned int value) {
+    for (int shift = 24; shift >= 0; shift -= 8)
+        out.push_back(static_cast<unsigned char>(value >> shift));
+}
+
+static void appendPNGChunk(std::vector<unsigned char>& out, const char* type,
+                           const unsigned char* data, size_t length)
+{
+    appendBigEndian(out, length);
+    size_t start = out.size();
+    out.insert(out.end(), type, type + 4);
+    out.insert(out.end(), data, data + length);
+    appendBigEndian(out, crc32(&out[start], out.size() - start));
+}
+
+void encodePNGImage(const unsigned int* rgbx, int stride, int width, int height,
+                    std::vector<unsigned char>& out)
+{
+    // each scanline is filter type 0 (none) and its RGB bytes
+    std::vector<unsigned char> raw;
+    raw.reserve(height * (1 + 3 * width));
+    for (int y = 0; y < height; y++) {
+        raw.push_back(0);
+        for (int x = 0; x < width; x++) {
+            unsigned int pixel = rgbx[y * stride + x];
+            raw.push_back(pixel & 0xff);
+            raw.push_back((pixel >> 8) & 0xff);
+            raw.push_back((pixel >> 16) & 0xff);
+        }
+    }
+
+    std::vector<unsigned char> zlib;
+    zlib.reserve(raw.size() + raw.size() / 65535 * 5 + 16);
+    zlib.push_back(0x78);
+    zlib.push_back(0x01);
+    size_t offset = 0;
+    do {
+        unsigned int length = std::min<size_t>(65535, raw.size() - offset);
+        zlib.push_back(offset + length == raw.size());
+        zlib.push_back(length & 0xff);
+        zlib.push_back(length >> 8);
+        zlib.push_back(~length & 0xff);
+        zlib.push_back((~length >> 8) & 0xff);
+        zlib.insert(zlib.end(), raw.begin() + offset, raw.begin() + offset + length);
+        offset += length;
+    } while (offset < raw.size());
+    unsigned int a = 1, b = 0;
+    for (size_t i = 0; i < raw.size(); i++) {
+        a = (a + raw[i]) % 65521;
+        b = (b + a) % 65521;
+    }
+    appendBigEndian(zlib, (b << 16) | a);
+
+    static const unsigned char signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n' };
+    out.insert(out.end(), signature, signature + 8);
+    std::vector<unsigned char> header;
+    appendBigEndian(header, width);
+    appendBigEndian(header, height);
+    const unsigned char format[5] = { 8, 2, 0, 0, 0 };  // 8-bit RGB, not interlaced
+    header.insert(header.end(), format, format + 5);
+    appendPNGChunk(out, "IHDR", header.data(), header.size());
+    appendPNGChunk(out, "IDAT", zlib.data(), zlib.size());
+    appendPNGChunk(out, "IEND", NULL, 0);
+}
+
+//
+// downsample2x2 --
+//
+// Average each 2x2 block of the width by height RGBX pixels at src
+// into one pixel at dst: each channel is the rounded-up mean of the
+// rounded-up means of the two pixels above each other.
+static inline unsigned int average2x2(unsigned int topLeft, unsigned int bottomLeft,
+                                      unsigned int topRight, unsigned int bottomRight)
+{
+    unsigned int result = 0;
+    for (int shift = 0; shift < 32; shift += 8) {
+        unsigned int left = (((topLeft >> shift) & 0xff) + ((bottomLeft >> shift) & 0xff) + 1) >> 1;
+        unsigned int right = (((topRight >> shift) & 0xff) + ((bottomRight >> shift) & 0xff) + 1) >> 1;
+        result |= ((left + right + 1) >> 1) << shift;
+    }
+    return result;
+}
+
+static void downsample2x2(const unsigned int* src, int srcStride, int width, int height,
+                          unsigned int* dst, int dstStride)
+{
+    // gather the even pixels of a vector in its low half, odd in its high half
+    const __m256i split = _mm256_setr_epi32(0, 2, 4, 6, 1, 3, 5, 7);
+    for (int y = 0; y < height / 2; y++) {
+        const unsigned int* top = src + 2 * y * srcStride;
+        const unsigned int* bottom = top + srcStride;
+        unsigned int* out = dst + y * dstStride;
+        int x = 0;
+        for (; 2 * x + 16 <= width; x += 8) {
+            __m256i lo = _mm256_avg_epu8(_mm256_loadu_si256((const __m256i*)(top + 2 * x)),
+                                         _mm256_loadu_si256((const __m256i*)(bottom + 2 * x)));
+            __m256i hi = _mm256_avg_epu8(_mm256_loadu_si256((const __m256i*)(top + 2 * x + 8)),
+                                         _mm256_loadu_si256((const __m256i*)(bottom + 2 * x + 8)));
+            lo = _mm256_permutevar8x32_epi32(lo, split);
+            hi = _mm256_permutevar8x32_epi32(hi, split);
+            __m256i even = _mm256_permute2x128_si256(lo, hi, 0x20);
+            __m256i odd = _mm256_permute2x128_si256(lo, hi, 0x31);
+            _mm256_storeu_si256((__m256i*)(out + x), _mm256_avg_epu8(even, odd));
+        }
+        for (; 2 * x + 1 < width; x++)
+            out[x] = average2x2(top[2 * x], bottom[2 * x], top[2 * x + 1], bottom[2 * x + 1]);
+    }
+}
+
+//
+// pyramidInit --
+//
+// Set up the levels of a pyramid over the square x0, y0, x0 + side,
+// y0 + side, whose deepest level is 2^depth tiles across, and, if dir
+// is not NULL, create its directories and .dzi descriptor.  Returns
+// false if those cannot be written.
+bool pyramidInit(Pyramid* pyramid, const Fractal* fractal, float x0, float y0, float side,
+                 int maxIterations, int depth, const char* dir)
+{
+    pyramid->fractal = fractal;
+    pyramid->x0 = x0;
+    pyramid->y0 = y0;
+    pyramid->side = side;
+    pyramid->maxIterations = maxIterations;
+    pyramid->dir = dir;
+    pyramid->depth = depth;
+
+    int deepest = PYRAMID_TILE_SIZE << depth;
+    int numLevels = 1;
+    while ((1 << (numLevels - 1)) < deepest)
+        numLevels++;
+    pyramid->levels.resize(numLevels);
+    for (int level = 0; level < numLevels; level++) {
+        PyramidLevel& l = pyramid->levels[level];
+        l.size = 1 << level;
+        l.tiles = std::max(1, l.size / PYRAMID_TILE_SIZE);
+        l.pixels.resize((size_t)l.size * l.size);
+        l.childrenLeft.reset(new std::atomic<int>[l.tiles * l.tiles]);
+    }
+
+    if (!dir)
+        return true;
+
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/mandelbrot_files", dir);
+    if ((mkdir(dir, 0777) < 0 && errno != EEXIST) || (mkdir(path, 0777) < 0 && errno != EEXIST)) {
+        fprintf(stderr, "Error: cannot create %s: %s\n", path, strerror(errno));
+        return false;
+    }
+    for (int level = 0; level < numLevels; level++) {
+        snprintf(path, sizeof(path), "%s/mandelbrot_files/%d", dir, level);
+        if (mkdir(path, 0777) < 0 && errno != EEXIST) {
+            fprintf(stderr, "Error: cannot create %s: %s\n", path, strerror(errno));
+            return false;
+        }
+    }
+
+    snprintf(path, sizeof(path), "%s/mandelbrot.dzi", dir);
+    FILE* fp = fopen(path, "w");
+    if (!fp) {
+        fprintf(stderr, "Error: cannot write %s: %s\n", path, strerror(errno));
+        return false;
+    }
+    fprintf(fp, "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+                "<Image xmlns=\"http://schemas.microsoft.com/deepzoom/2008\"\n"
+                "       Format=\"png\" Overlap=\"0\" TileSize=\"%d\">\n"
+                "  <Size Width=\"%d\" Height=\"%d\"/>\n"
+                "</Image>\n", PYRAMID_TILE_SIZE, deepest, deepest);
+    fclose(fp);
+    return true;
+}
+
+static void pyramidWriteTile(Pyramid* pyramid, int level, int tx, int ty,
+                             const unsigned int* tile, int stride, int tileSize)
+{
+    std::vector<unsigned char> png;
+    encodePNGImage(tile, stride, tileSize, tileSize, png);
+
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/mandelbrot_files/%d/%d_%d.png", pyramid->dir, level, tx, ty);
+    FILE* fp = fopen(path, "wb");
+    if (!fp || fwrite(png.data(), 1, png.size(), fp) != png.size()) {
+        if (!pyramid->failed.exchange(true))
+            fprintf(stderr, "Error: cannot write %s: %s\n", path, strerror(errno));
+    }
+    if (fp)
+        fclose(fp);
+    pyramid->tilesWritten++;
+}
+
+//
+// pyramidRenderTile --
+//
+// Render tile tx, ty of the given level straight from the fractal, in
+// the gray levels of writePPMImage.
+static void pyramidRenderTile(Pyramid* pyramid, int level, int tx, int ty)
+{
+    PyramidLevel& l = pyramid->levels[level];
+    int tileSize = std::min(PYRAMID_TILE_SIZE, l.size);
+    float dx = pyramid->side / l.size;
+    float tileX0 = pyramid->x0 + tx * tileSize * dx;
+    float tileY0 = pyramid->y0 + ty * tileSize * dx;
+
+    std::vector<int> counts(tileSize * tileSize);
+    fractalSerial(*pyramid->fractal, tileX0, tileY0, tileX0 + tileSize * dx, tileY0 + tileSize * dx,
+                  tileSize, tileSize, 0, tileSize, pyramid->maxIterations, counts.data());
+
+    for (int j = 0; j < tileSize; j++) {
+        unsigned int* row = &l.pixels[(size_t)(ty * tileSize + j) * l.size + tx * tileSize];
+        for (int i = 0; i < tileSize; i++)
+            row[i] = iterationsToGray(counts[j * tileSize + i], pyramid->maxIterations) * 0x010101u;
+    }
+}
+
+//
+// pyramidFinishTile --
+//
+// Write a finished tile, fold it into its parent and, if that was the
+// parent's last child, finish the parent as well.
+static void pyramidFinishTile(Pyramid* pyramid, int level, int tx, int ty)
+{
+    while (true) {
+        PyramidLevel& l = pyramid->levels[level];
+        int tileSize = std::min(PYRAMID_TILE_SIZE, l.size);
+        const unsigned int* tile = &l.pixels[(size_t)ty * tileSize * l.size + tx * tileSize];
+        if (pyramid->dir)
+            pyramidWriteTile(pyramid, level, tx, ty, tile, l.size, tileSize);
+        if (level == 0)
+            return;
+
+        PyramidLevel& parent = pyramid->levels[level - 1];
+        int half = tileSize / 2;
+        downsample2x2(tile, l.size, tileSize, tileSize,
+                      &parent.pixels[(size_t)ty * half * parent.size + tx * half], parent.size);
+
+        tx = tx * parent.tiles / l.tiles;
+        ty = ty * parent.tiles / l.tiles;
+        level--;
+        if (--parent.childrenLeft[ty * parent.tiles + tx] > 0)
+            return;
+    }
+}
+
+static void pyramidDeepTileTask(void* arg, int task)
+{
+    Pyramid* pyramid = static_cast<Pyramid*>(arg);
+    int level = pyramid->levels.size() - 1;
+
+    // task is the Z-order index of the tile
+    int tx = 0, ty = 0;
+    for (int bit = 0; bit < pyramid->depth; bit++) {
+        tx |= ((task >> (2 * bit)) & 1) << bit;
+        ty |= ((task >> (2 * bit + 1)) & 1) << bit;
+    }
+    pyramidRenderTile(pyramid, level, tx, ty);
+    pyramidFinishTile(pyramid, level, tx, ty);
+}
+
+//
+// pyramidBuild --
+//
+// Render the deepest level on the pool and build (and write) every
+// level above it.  Returns false if a tile could not be written.
+bool pyramidBuild(Pyramid* pyramid, ThreadPool* pool)
+{
+    int numLevels = pyramid->levels.size();
+    for (int level = 0; level + 1 < numLevels; level++) {
+        PyramidLevel& l = pyramid->levels[level];
+        int ratio = pyramid->levels[level + 1].tiles / l.tiles;
+        for (int t = 0; t < l.tiles * l.tiles; t++)
+            l.childrenLeft[t] = ratio * ratio;
+    }
+    pyramid->tilesWritten = 0;
+    pyramid->failed = false;
+
+    int deepTiles = pyramid->levels.back().tiles;
+    threadPoolRun(pool, pyramidDeepTileTask, pyramid, deepTiles * deepTiles);
+    return !pyramid->failed;
+}
+
+typedef struct {
+    Pyramid* pyramid;
+    int level;
+} PyramidLevelArgs;
+
+static void pyramidLevelTileTask(void* arg, int task)
+{
+    PyramidLevelArgs* args = static_cast<PyramidLevelArgs*>(arg);
+    int tiles = args->pyramid->levels[args->level].tiles;
+    pyramidRenderTile(args->pyramid, args->level, task % tiles, task / tiles);
+}
+
+//
+// benchmarkPyramid --
+//
+// Build the pyramid of the square around the view, without writing it,
+// and compare against rendering every level from scratch.  Checks each
+// level against a scalar 2x2 average of the level below, then builds
+// the pyramid once more, writing it to dir.
+bool benchmarkPyramid(int numThreads, const Fractal& fractal,
+                      float x0, float y0, float x1, float y1,
+                      int maxIterations, int depth, const char* dir)
+{
+    float side = std::max(x1 - x0, y1 - y0);
+    float squareX0 = (x0 + x1 - side) / 2, squareY0 = (y0 + y1 - side) / 2;
+
+    ThreadPool pool;
+    threadPoolStart(&pool, numThreads);
+    Pyramid pyramid;
+    pyramidInit(&pyramid, &fractal, squareX0, squareY0, side, maxIterations, depth, NULL);
+    int numLevels = pyramid.levels.size();
+
+    double minPyramid = 1e30;
+    for (int i = 0; i < 3; ++i) {
+        double startTime = CycleTimer::currentSeconds();
+        pyramidBuild(&pyramid, &pool);
+        double endTime = CycleTimer::currentSeconds();
+        minPyramid = std::min(minPyramid, endTime - startTime);
+    }
+
+    long long mismatches = 0;
+    for (int level = 0; level + 1 < numLevels; level++) {
+        const PyramidLevel& below = pyramid.levels[level + 1];
+        const PyramidLevel& l = pyramid.levels[level];
+        for (int y = 0; y < l.size; y++)
+            for (int x = 0; x < l.size; x++) {
+                const unsigned int* top = &below.pixels[(size_t)2 * y * below.size + 2 * x];
+                const unsigned int* bottom = top + below.size;
+                if (l.pixels[(size_t)y * l.size + x] != average2x2(top[0], bottom[0], top[1], bottom[1]))
+                    mismatches++;
+            }
+    }
+
+    Pyramid scratch;
+    pyramidInit(&scratch, &fractal, squareX0, squareY0, side, maxIterations, depth, NULL);
+    double minLevels = 1e30;
+    for (int i = 0; i < 3; ++i) {
+        double startTime = CycleTimer::currentSeconds();
+        for (int level = 0; level < numLevels; level++) {
+            PyramidLevelArgs args = { &scratch, level };
+            int tiles = scratch.levels[level].tiles;
+            threadPoolRun(&pool, pyramidLevelTileTask, &args, tiles * tiles);
+        }
+        double endTime = CycleTimer::currentSeconds();
+        minLevels = std::min(minLevels, endTime - startTime);
+    }
+    bool deepestMatches = scratch.levels.back().pixels == pyramid.levels.back().pixels;
+
+    Pyramid written;
+    bool ok = pyramidInit(&written, &fractal, squareX0, squareY0, side, maxIterations, depth, dir);
+    double writeTime = 0;
+    if (ok) {
+        double startTime = CycleTimer::currentSeconds();
+        ok = pyramidBuild(&written, &pool);
+        writeTime = CycleTimer::currentSeconds() - startTime;
+    }
+    threadPoolStop(&pool);
+
+    if (mismatches || !deepestMatches) {
+        printf("Error : %lld downsampled pixels differ from the scalar average%s\n", mismatches,
+               deepestMatches ? "" : ", deepest level differs from a per-level render");
+        return false;
+    }
+    if (!ok)
+        return false;
+
+    printf("%d levels, %dx%d pixels at the deepest, %d threads\n",
+           numLevels, pyramid.levels.back().size, pyramid.levels.back().size, numThreads);
+    printf("[mandelbrot every level]:\t[%.3f] ms\n", minLevels * 1000);
+    printf("[mandelbrot pyramid]:\t\t[%.3f] ms\n", minPyramid * 1000);
+    printf("\t\t\t\t(%.2fx speedup from downsampling)\n", minLevels / minPyramid);
+    printf("[mandelbrot pyramid files]:\t[%.3f] ms\n", writeTime * 1000);
+    printf("Wrote %d tiles under %s/mandelbrot_files\n", written.tilesWritten.load(), dir);
+    return true;
+}
+
+//
+// Progressive rendering --
+//
+// Renders the image in passes of decreasing pixel step (8, 4, 2, 1).
+// Pass s computes the pixels whose coordinates are both multiples of s
+// and not already computed by the pass before, then fills the s by s
+// block to the lower right of each one with its value, so every pass
+// leaves a complete, progressively sharper image.  The last pass leaves
+// exactly what mandelbrotSerial would have computed.
+//
+// Within a pass, PROGRESSIVE_TILE_SIZE square tiles are handed to the
+// pool in order of distance from the focus pixel (usually the viewport
+// center or the cursor), so the area the user is looking at sharpens
+// first.  The callback runs on the calling thread after each pass.
+
+const static int PROGRESSIVE_TILE_SIZE = 64;
+const static int PROGRESSIVE_FIRST_STEP = 8;
+
+typedef void (*ProgressCallback)(void* user, int step, const int* output);
+
+typedef struct {
+    float x0, y0;
+    float dx, dy;
+    int width, height;
+    int maxIterations;
+    int step;
+    int tilesX;
+    const int* tileOrder;
+    int* output;
+    const Fractal* fractal;
+} ProgressiveArgs;
+
+static void progressiveFlush(ProgressiveArgs* args, float* xs, float* ys,
+                             int* pixelI, int* pixelJ, int count) {
+    // pad the vector by repeating the last pixel
+    for (int k = count; k < 8; ++k) {
+        xs[k] = xs[count - 1];
+        ys[k] = ys[count - 1];
+    }
+    int rst[8];
+    __m256i counts = fractalKernels[args->fractal->kind].mandel8(
+        *args->fractal, _mm256_loadu_ps(xs), _mm256_loadu_ps(ys), args->maxIterations);
+    _mm256_storeu_si256((__m256i*)rst, counts);
+
+    int step = args->step;
+    for (int k = 0; k < count; ++k) {
+        int iEnd = std::min(pixelI[k] + step, args->width);
+        int jEnd = std::min(pixelJ[k] + step, args->height);
+        for (int j = pixelJ[k]; j < jEnd; ++j)
+            for (int i = pixelI[k]; i < iEnd; ++i)
+                args->output[j * args->width + i] = rst[k];
+    }
+}
+
+static void progressiveRenderTile(void* arg, int task) {
+    ProgressiveArgs* args = static_cast<ProgressiveArgs*>(arg);
+    int tile = args->tileOrder[task];
+    int tileI = (tile % args->tilesX) * PROGRESSIVE_TILE_SIZE;
+    int tileJ = (tile / args->tilesX) * PROGRESSIVE_TILE_SIZE;
+    int iEnd = std::min(tileI + PROGRESSIVE_TILE_SIZE, args->width);
+    int jEnd = std::min(tileJ + PROGRESSIVE_TILE_SIZE, args->height);
+    int step = args->step;
+    int coarse = 2 * step;
+
+    float xs[8], ys[8];
+    int pixelI[8], pixelJ[8];
+    int count = 0;
+
+    for (int j = tileJ; j < jEnd; j += step) {
+        // on rows the previous pass covered, only every other column is new
+        bool coarseRow = step < PROGRESSIVE_FIRST_STEP && j % coarse == 0;
+        for (int i = tileI; i < iEnd; i += step) {
+            if (coarseRow && i % coarse == 0)
+                continue;
+            xs[count] = args->x0 + i * args->dx;
+            ys[count] = args->y0 + j * args->dy;
+            pixelI[count] = i;
+            pixelJ[count] = j;
+            if (++count == 8) {
+                progressiveFlush(args, xs, ys, pixelI, pixelJ, count);
+                count = 0;
+            }
+        }
+    }
+    if (count > 0)
+        progressiveFlush(args, xs, ys, pixelI, pixelJ, count);
+}
+
+void mandelbrotProgressive(
+    ThreadPool* pool,
+    float x0, float y0, float x1, float y1,
+    int width, int height,
+    int maxIterations,
+    int focusX, int focusY,
+    int output[],
+    ProgressCallback callback, void* user,
+    const Fractal* fractal = NULL)
+{
+    ProgressiveArgs args;
+    args.fractal = fractal ? fractal : &mandelbrotFractal;
+    args.x0 = x0;
+    args.y0 = y0;
+    args.dx = (x1 - x0) / width;
+    args.dy = (y1 - y0) / height;
+    args.width = width;
+    args.height = height;
+    args.maxIterations = maxIterations;
+    args.output = output;
+    args.tilesX = (width + PROGRESSIVE_TILE_SIZE - 1) / PROGRESSIVE_TILE_SIZE;
+    int tilesY = (height + PROGRESSIVE_TILE_SIZE - 1) / PROGRESSIVE_TILE_SIZE;
+
+    // order tiles by the squared distance of their center to the focus
+    std::vector<std::pair<long long, int> > byDistance;
+    for (int t = 0; t < args.tilesX * tilesY; t++) {
+        long long cx = (t % args.tilesX) * PROGRESSIVE_TILE_SIZE + PROGRESSIVE_TILE_SIZE / 2 - focusX;
+        long long cy = (t / args.tilesX) * PROGRESSIVE_TILE_SIZE + PROGRESSIVE_TILE_SIZE / 2 - focusY;
+        byDistance.push_back(std::make_pair(cx * cx + cy * cy, t));
+    }
+    std::sort(byDistance.begin(), byDistance.end());
+    std::vector<int> tileOrder(byDistance.size());
+    for (size_t t = 0; t < byDistance.size(); t++)
+        tileOrder[t] = byDistance[t].second;
+    args.tileOrder = tileOrder.data();
+
+    for (int step = PROGRESSIVE_FIRST_STEP; step >= 1; step /= 2) {
+        args.step = step;
+        threadPoolRun(pool, progressiveRenderTile, &args, tileOrder.size());
+        if (callback)
+            callback(user, step, output);
+    }
+}
+
+typedef struct {
+    double startTime;
+    int width, height;
+    int maxIterations;
+} ProgressReport;
+
+void reportProgress(void* user, int step, const int* output) {
+    ProgressReport* report = static_cast<ProgressReport*>(user);
+    double writeStart = CycleTimer::currentSeconds();
+    printf("[mandelbrot progressive]:\t[%.3f] ms to step %d\n",
+           (writeStart - report->startTime) * 1000, step);
+    char filename[64];
+    snprintf(filename, sizeof(filename), "mandelbrot-progressive-%d.ppm", step);
+    writePPMImage(const_cast<int*>(output), report->width, report->height, filename, report->maxIterations);
+    // don't count the image writes against the next pass
+    report->startTime += CycleTimer::currentSeconds() - writeStart;
+}
+
+//
+// Cancellable rendering --
+//
+// A CancelToken is shared between a render and whoever may want to stop
+// it: the render checks it before starting each CANCEL_TILE_ROWS band of
+// rows, and gives up on the remaining bands once the token is cancelled
+// or its deadline (in CycleTimer::currentSeconds() time, 0 for none)
+// has passed.  Bands already in progress finish, so the coverage mask
+// marks whole rows.
+//
+// A RenderSession holds the token of the render currently in progress,
+// so that a newer request (say, the user zooming again) supersedes it.
+
+const static int CANCEL_TILE_ROWS = 8;
+
+typedef struct {
+    std::atomic<bool> cancelled;
+    double deadline;
+} CancelToken;
+
+void cancelTokenInit(CancelToken* token, double deadline) {
+    token->cancelled = false;
+    token->deadline = deadline;
+}
+
+static inline bool cancelTokenExpired(CancelToken* token) {
+    if (token->cancelled.load(std::memory_order_relaxed))
+        return true;
+    if (token->deadline > 0 && CycleTimer::currentSeconds() > token->deadline) {
+        token->cancelled = true;
+        return true;
+    }
+    return false;
+}
+
+typedef struct {
+    pthread_mutex_t lock;
+    CancelToken* current;
+} RenderSession;
+
+void renderSessionInit(RenderSession* session) {
+    pthread_mutex_init(&session->lock, NULL);
+    session->current = NULL;
+}
+
+//
+// renderSessionBegin --
+//
+// Cancel the render in progress, if any, and make token the current
+// one.  Call renderSessionEnd with the same token when the render
+// returns.
+void renderSessionBegin(RenderSession* session, CancelToken* token) {
+    pthread_mutex_lock(&session->lock);
+    if (session->current)
+        session->current->cancelled = true;
+    session->current = token;
+    pthread_mutex_unlock(&session->lock);
+}
+
+void renderSessionEnd(RenderSession* session, CancelToken* token) {
+    pthread_mutex_lock(&session->lock);
+    if (session->current == token)
+        session->current = NULL;
+    pthread_mutex_unlock(&session->lock);
+}
+
+typedef struct {
+    CancelToken* token;
+    float x0, y0, x1, y1;
+    int width, height;
+    int maxIterations;
+    int* output;
+    unsigned char* coverage;
+    const Fractal* fractal;
+    std::atomic<int> tilesDone;
+} CancellableArgs;
+
+static void cancellableRenderTile(void* arg, int tile) {
+    CancellableArgs* args = static_cast<CancellableArgs*>(arg);
+    if (cancelTokenExpired(args->token))
+        return;
+
+    int startRow = tile * CANCEL_TILE_ROWS;
+    int totalRows = std::min(CANCEL_TILE_ROWS, args->height - startRow);
+    fractalSerial(*args->fractal, args->x0, args->y0, args->x1, args->y1,
+                  args->width, args->height, startRow, totalRows,
+                  args->maxIterations, args->output);
+    if (args->coverage)
+        memset(args->coverage + startRow * args->width, 1, totalRows * args->width);
+    args->tilesDone++;
+}
+
+//
+// mandelbrotCancellable --
+//
+// Render the image on the pool until done or until token expires.
+// Pixels that were computed get a 1 in coverage (if not NULL), the rest
+// a 0.  Returns true if the whole image was rendered.
+bool mandelbrotCancellable(
+    ThreadPool* pool, CancelToken* token,
+    float x0, float y0, float x1, float y1,
+    int width, int height,
+    int maxIterations,
+    int output[], unsigned char coverage[],
+    const Fractal* fractal = NULL)
+{
+    CancellableArgs args;
+    args.fractal = fractal ? fractal : &mandelbrotFractal;
+    args.token = token;
+    args.x0 = x0;
+    args.y0 = y0;
+    args.x1 = x1;
+    args.y1 = y1;
+    args.width = width;
+    args.height = height;
+    args.maxIterations = maxIterations;
+    args.output = output;
+    args.coverage = coverage;
+    args.tilesDone = 0;
+
+    if (coverage)
+        memset(coverage, 0, width * height);
+
+    int numTiles = (height + CANCEL_TILE_ROWS - 1) / CANCEL_TILE_ROWS;
+    threadPoolRun(pool, cancellableRenderTile, &args, numTiles);
+    return args.tilesDone == numTiles;
+}
+
+//
+// SessionRender --
+//
+// A mandelbrotCancellable call made from its own thread, as one of
+// several requests in a RenderSession.  Call renderSessionBegin with
+// its token before starting the thread.
+typedef struct {
+    ThreadPool* pool;
+    RenderSession* session;
+    CancelToken token;
+    float x0, y0, x1, y1;
+    int width, height;
+    int maxIterations;
+    int* output;
+    unsigned char* coverage;
+    const Fractal* fractal;
+    bool complete;
+} SessionRender;
+
+void* sessionRenderStart(void* arg) {
+    SessionRender* render = static_cast<SessionRender*>(arg);
+    render->complete = mandelbrotCancellable(render->pool, &render->token,
+                                             render->x0, render->y0, render->x1, render->y1,
+                                             render->width, render->height, render->maxIterations,
+                                             render->output, render->coverage, render->fractal);
+    renderSessionEnd(render->session, &render->token);
+    return NULL;
+}
+
+//
+// Checkpointed rendering --
+//
+// For renders that take long enough for the process to be killed part
+// way through.  The image is rendered on the pool in bands of
+// CHECKPOINT_TILE_ROWS rows, and a writer thread saves the bands
+// finished so far to a checkpoint file every CHECKPOINT_INTERVAL
+// seconds:
+//
+//     CheckpointHeader, then tilesDone times { int tile; int pixels[] }
+//
+// Each checkpoint goes to a temporary file that is synced and renamed
+// over the last one, so the file always holds a whole checkpoint.  A
+// worker only sets the done flag of its band; the writer copies bands
+// whose flag is set, which nothing writes to any more, so the workers
+// never wait on the disk.
+//
+// Run again on the same job (the same goldKey), a render loads the
+// checkpoint and renders only the bands it is missing.  SIGTERM and
+// SIGINT cancel the render like a CancelToken: bands in progress finish
+// and a last checkpoint is written before returning.  Once every band
+// is done the checkpoint is removed, so the next run starts afresh.
+
+const static int CHECKPOINT_TILE_ROWS = 16;
+const static int CHECKPOINT_INTERVAL = 5;      // seconds
+const static char CHECKPOINT_MAGIC[8] = { 'M', 'B', 'C', 'K', 'P', 'T', '1', 0 };
+
+typedef struct {
+    char magic[8];
+    unsigned long long key;
+    int width, height;
+    int maxIterations;
+    int tileRows;
+    int tilesDone;
+    unsigned long long checksum;    // fnv1a of the records
+} CheckpointHeader;
+
+typedef struct {
+    const char* path;
+    unsigned long long key;
+    const Fractal* fractal;
+    float x0, y0, x1, y1;
+    int width, height;
+    int maxIterations;
+    int* output;
+    int numTiles;
+    std::atomic<bool>* done;
+    std::vector<int> pending;       // tiles left to render, by task
+    CancelToken token;
+
+    pthread_mutex_t lock;
+    pthread_cond_t wake;            // signalled when the render ends
+    bool finished;
+    int tilesWritten;               // tiles in the last checkpoint
+    int checkpoints;
+    double writeTime;
+} CheckpointJob;
+
+static CancelToken* checkpointSignalToken;
+
+static void checkpointSignalHandler(int) {
+    checkpointSignalToken->cancelled.store(true);
+}
+
+static int checkpointTileRows(const CheckpointJob* job, int tile) {
+    return std::min(CHECKPOINT_TILE_ROWS, job->height - tile * CHECKPOINT_TILE_ROWS);
+}
+
+//
+// loadCheckpoint --
+//
+// Fill in the tiles saved in job->path, if it holds a checkpoint of
+// this job.  Returns the number of tiles loaded.
+static int loadCheckpoint(CheckpointJob* job) {
+    FILE* fp = fopen(job->path, "rb");
+    if (!fp) {
+        printf("[checkpoint]:\t\t\tno checkpoint in %s, starting\n", job->path);
+        return 0;
+    }
+
+    CheckpointHeader header;
+    bool ok = fread(&header, sizeof(header), 1, fp) == 1 &&
+              memcmp(header.magic, CHECKPOINT_MAGIC, sizeof(CHECKPOINT_MAGIC)) == 0;
+    if (ok && (header.key != job->key || header.width != job->width || header.height != job->height ||
+               header.maxIterations != job->maxIterations || header.tileRows != CHECKPOINT_TILE_ROWS ||
+               header.tilesDone < 0 || header.tilesDone > job->numTiles)) {
+        fclose(fp);
+        printf("[checkpoint]:\t\t\t%s is for another job, starting over\n", job->path);
+        return 0;
+    }
+
+    // read into a copy, so a damaged file leaves nothing behind
+    std::vector<int> pixels((size_t)job->width * job->height);
+    std::vector<int> tiles;
+    unsigned long long checksum = fnv1a(NULL, 0);
+    for (int i = 0; ok && i < header.tilesDone; i++) {
+        int tile;
+        ok = fread(&tile, sizeof(tile), 1, fp) == 1 && tile >= 0 && tile < job->numTiles;
+        if (!ok)
+            break;
+        size_t count = (size_t)checkpointTileRows(job, tile) * job->width;
+        int* start = &pixels[(size_t)tile * CHECKPOINT_TILE_ROWS * job->width];
+        ok = fread(start, sizeof(int), count, fp) == count;
+        checksum = fnv1a(&tile, sizeof(tile), checksum);
+        checksum = fnv1a(start, count * sizeof(int), checksum);
+        tiles.push_back(tile);
+    }
+    fclose(fp);
+    if (!ok || checksum != header.checksum) {
+        printf("[checkpoint]:\t\t\t%s is damaged, starting over\n", job->path);
+        return 0;
+    }
+
+    for (size_t i = 0; i < tiles.size(); i++) {
+        size_t start = (size_t)tiles[i] * CHECKPOINT_TILE_ROWS * job->width;
+        memcpy(job->output + start, &pixels[start],
+               (size_t)checkpointTileRows(job, tiles[i]) * job->width * sizeof(int));
+        job->done[tiles[i]] = true;
+    }
+    job->tilesWritten = header.tilesDone;
+    printf("[checkpoint]:\t\t\tresuming with %d of %d tiles from %s\n",
+           header.tilesDone, job->numTiles, job->path);
+    return header.tilesDone;
+}
+
+//
+// writeCheckpoint --
+//
+// Save the tiles done so far, unless they are the ones saved last time.
+// Called by one thread at a time.
+static bool writeCheckpoint(CheckpointJob* job) {
+    std::vector<int> tiles;
+    for (int tile = 0; tile < job->numTiles; tile++)
+        if (job->done[tile].load(std::memory_order_acquire))
+            tiles.push_back(tile);
+    if ((int)tiles.size() == job->tilesWritten)
+        return true;
+
+    double startTime = CycleTimer::currentSeconds();
+    char tmpPath[1100];
+    snprintf(tmpPath, sizeof(tmpPath), "%s.%d.tmp", job->path, (int)getpid());
+    FILE* fp = fopen(tmpPath, "wb");
+    if (!fp) {
+        fprintf(stderr, "Cannot write %s: %s\n", tmpPath, strerror(errno));
+        return false;
+    }
+
+    CheckpointHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, CHECKPOINT_MAGIC, sizeof(CHECKPOINT_MAGIC));
+    header.key = job->key;
+    header.width = job->width;
+    header.height = job->height;
+    header.maxIterations = job->maxIterations;
+    header.tileRows = CHECKPOINT_TILE_ROWS;
+    header.tilesDone = tiles.size();
+    header.checksum = fnv1a(NULL, 0);
+
+    // the header goes in last, once the checksum is known
+    bool ok = fseek(fp, sizeof(header), SEEK_SET) == 0;
+    for (size_t i = 0; ok && i < tiles.size(); i++) {
+        size_t count = (size_t)checkpointTileRows(job, tiles[i]) * job->width;
+        const int* start = job->output + (size_t)tiles[i] * CHECKPOINT_TILE_ROWS * job->width;
+        ok = fwrite(&tiles[i], sizeof(int), 1, fp) == 1 &&
+             fwrite(start, sizeof(int), count, fp) == count;
+        header.checksum = fnv1a(&tiles[i], sizeof(int), header.checksum);
+        header.checksum = fnv1a(start, count * sizeof(int), header.checksum);
+    }
+    ok = ok && fseek(fp, 0, SEEK_SET) == 0 && fwrite(&header, sizeof(header), 1, fp) == 1 &&
+         fflush(fp) == 0 && fsync(fileno(fp)) == 0;
+    ok = fclose(fp) == 0 && ok;
+    if (!ok || rename(tmpPath, job->path) != 0) {
+        fprintf(stderr, "Cannot write %s: %s\n", job->path, strerror(errno));
+        unlink(tmpPath);
+        return false;
+    }
+    job->tilesWritten = tiles.size();
+    job->checkpoints++;
+    job->writeTime += CycleTimer::currentSeconds() - startTime;
+    return true;
+}
+
+static void* checkpointWriterStart(void* arg) {
+    CheckpointJob* job = static_cast<CheckpointJob*>(arg);
+
+    pthread_mutex_lock(&job->lock);
+    while (!job->finished) {
+        struct timespec wakeAt;
+        clock_gettime(CLOCK_REALTIME, &wakeAt);
+        wakeAt.tv_sec += CHECKPOINT_INTERVAL;
+        while (!job->finished && pthread_cond_timedwait(&job->wake, &job->lock, &wakeAt) != ETIMEDOUT)
+            ;
+        if (job->finished)
+            break;
+        pthread_mutex_unlock(&job->lock);
+        writeCheckpoint(job);
+        pthread_mutex_lock(&job->lock);
+    }
+    pthread_mutex_unlock(&job->lock);
+    return NULL;
+}
+
+static void checkpointRenderTile(void* arg, int task) {
+    CheckpointJob* job = static_cast<CheckpointJob*>(arg);
+    if (cancelTokenExpired(&job->token))
+        return;
+
+    int tile = job->pending[task];
+    fractalSerial(*job->fractal, job->x0, job->y0, job->x1, job->y1,
+                  job->width, job->height, tile * CHECKPOINT_TILE_ROWS, checkpointTileRows(job, tile),
+                  job->maxIterations, job->output);
+    job->done[tile].store(true, std::memory_order_release);
+}
+
+//
+// renderCheckpointed --
+//
+// Render the view on numThreads threads, checkpointing to path and
+// resuming from it, then write the image and remove the checkpoint.
+// If verify is set, the image is first checked against fractalSerial,
+// which renders the whole view again on one thread.  Returns false if
+// the render was interrupted, the checkpoint could not be written or
+// removed, or the image differs.
+bool renderCheckpointed(int numThreads, const Fractal& fractal,
+                        float x0, float y0, float x1, float y1,
+                        int width, int height, int maxIterations, const char* path,
+                        bool verify)
+{
+    CheckpointJob job;
+    job.path = path;
+    job.key = goldKey(fractal, x0, y0, x1, y1, width, height, maxIterations);
+    job.fractal = &fractal;
+    job.x0 = x0;
+    job.y0 = y0;
+    job.x1 = x1;
+    job.y1 = y1;
+    job.width = width;
+    job.height = height;
+    job.maxIterations = maxIterations;
+    job.output = new int[width * height];
+    job.numTiles = (height + CHECKPOINT_TILE_ROWS - 1) / CHECKPOINT_TILE_ROWS;
+    job.done = new std::atomic<bool>[job.numTiles];
+    for (int tile = 0; tile < job.numTiles; tile++)
+        job.done[tile] = false;
+    cancelTokenInit(&job.token, 0);
+    pthread_mutex_init(&job.lock, NULL);
+    pthread_cond_init(&job.wake, NULL);
+    job.finished = false;
+    job.tilesWritten = 0;
+    job.checkpoints = 0;
+    job.writeTime = 0;
+
+    int loaded = loadCheckpoint(&job);
+    for (int tile = 0; tile < job.numTiles; tile++)
+        if (!job.done[tile])
+            job.pending.push_back(tile);
+
+    checkpointSignalToken = &job.token;
+    struct sigaction action, oldTerm, oldInt;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = checkpointSignalHandler;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGTERM, &action, &oldTerm);
+    sigaction(SIGINT, &action, &oldInt);
+
+    ThreadPool pool;
+    threadPoolStart(&pool, numThreads);
+    pthread_t writer;
+    pthread_create(&writer, NULL, checkpointWriterStart, &job);
+
+    double startTime = CycleTimer::currentSeconds();
+    threadPoolRun(&pool, checkpointRenderTile, &job, job.pending.size());
+    double renderTime = CycleTimer::currentSeconds() - startTime;
+
+    pthread_mutex_lock(&job.lock);
+    job.finished = true;
+    pthread_cond_signal(&job.wake);
+    pthread_mutex_unlock(&job.lock);
+    pthread_join(writer, NULL);
+    threadPoolStop(&pool);
+
+    sigaction(SIGTERM, &oldTerm, NULL);
+    sigaction(SIGINT, &oldInt, NULL);
+    checkpointSignalToken = NULL;
+
+    int tilesDone = 0;
+    for (int tile = 0; tile < job.numTiles; tile++)
+        tilesDone += job.done[tile];
+    // a finished render needs no last checkpoint, it removes the file
+    bool ok = tilesDone == job.numTiles || writeCheckpoint(&job);
+    printf("[mandelbrot checkpointed]:\t[%.3f] ms for %d tiles, %d threads\n",
+           renderTime * 1000, tilesDone - loaded, numThreads);
+    printf("\t\t\t\t(%d checkpoints written in [%.3f] ms, off the workers)\n",
+           job.checkpoints, job.writeTime * 1000);
+
+    if (ok && tilesDone < job.numTiles) {
+        printf("Interrupted with %d of %d tiles done; run again to resume from %s\n",
+               tilesDone, job.numTiles, path);
+        ok = false;
+    } else if (ok) {
+        if (verify) {
+            int* gold = new int[width * height];
+            fractalSerial(fractal, x0, y0, x1, y1, width, height, 0, height, maxIterations, gold);
+            ok = verifyResult(gold, job.output, width, height);
+            delete[] gold;
+            if (!ok)
+                printf("Error : Output from checkpointed render does not match serial output\n");
+        }
+        if (ok)
+            writePPMImage(job.output, width, height, "mandelbrot-checkpoint.ppm", maxIterations);
+        if (ok && unlink(path) < 0 && errno != ENOENT) {
+            fprintf(stderr, "Error: cannot remove %s: %s\n", path, strerror(errno));
+            ok = false;
+        }
+    }
+
+    pthread_mutex_destroy(&job.lock);
+    pthread_cond_destroy(&job.wake);
+    delete[] job.done;
+    delete[] job.output;
+    return ok;
+}
+
+//
+// Adaptive iteration limits --
+//
+// One maxIterations for the whole image is too low for the boundary of
+// a deep view and wasted on the rest of it.  mandelbrotAdaptive renders
+// every pixel with a low limit, then raises the limit ADAPTIVE_GROWTH
+// times per pass, up to a maximum, for the pixels that reached it in
+// the tiles that need it.  Each pass continues those pixels from their
+// saved z with mandelbrotSerialResume, so no step is taken twice.
+//
+// A tile of ADAPTIVE_TILE_SIZE square is run again when at least
+// 1/ADAPTIVE_MIN_BOUNDARY of its pixels reached the limit next to a
+// pixel that escaped: the boundary, where a higher limit changes the
+// image.  Tiles deep inside the set reach every limit and are left
+// alone.  A pass may take at most (limit raise) * (pixels run) steps,
+// and tiles are taken, most boundary first, only while that bound keeps
+// the total within the budget.  Pixels that never escaped are taken to
+// be in the set and get the maximum count, like in a render with the
+// maximum limit.
+
+const static int ADAPTIVE_TILE_SIZE = 16;
+const static int ADAPTIVE_GROWTH = 4;
+const static int ADAPTIVE_MIN_BOUNDARY = 32;
+
+typedef struct {
+    int passes;
+    int lastLimit;
+    int tilesRerun;             // tile passes after the first
+    long long bound;            // steps the passes may take
+} AdaptiveStats;
+
+typedef struct {
+    const Fractal* fractal;
+    float x0, y0, x1, y1;
+    int width, height;
+    int limit;
+    bool first;                 // tasks are bands of rows, else tilePixels
+    int* output;
+    float* savedRe;
+    float* savedIm;
+    std::vector<std::vector<int> > tilePixels;  // pixels to run, by task
+} AdaptivePass;
+
+template <typename Iteration>
+static void adaptiveRun(const Iteration& iteration, AdaptivePass* pass, int task)
+{
+    if (pass->first) {
+        int startRow = task * ADAPTIVE_TILE_SIZE;
+        mandelbrotSerialSave(iteration, pass->x0, pass->y0, pass->x1, pass->y1,
+                             pass->width, pass->height,
+                             startRow, std::min(ADAPTIVE_TILE_SIZE, pass->height - startRow),
+                             pass->limit, pass->output, pass->savedRe, pass->savedIm);
+    } else {
+        const std::vector<int>& pixels = pass->tilePixels[task];
+        mandelbrotSerialResume(iteration, pass->x0, pass->y0, pass->x1, pass->y1,
+                               pass->width, pass->height, &pixels[0], pixels.size(),
+                               pass->limit, pass->output, pass->savedRe, pass->savedIm);
+    }
+}
+
+static void adaptivePassTask(void* arg, int task) {
+    AdaptivePass* pass = static_cast<AdaptivePass*>(arg);
+    const Fractal& fractal = *pass->fractal;
+    switch (fractal.kind) {
+    case FRACTAL_JULIA:
+        adaptiveRun(JuliaIteration(fractal), pass, task);
+        break;
+    case FRACTAL_BURNING_SHIP:
+        adaptiveRun(BurningShipIteration(), pass, task);
+        break;
+    case FRACTAL_MULTIBROT3:
+        adaptiveRun(MultibrotIteration<3>(), pass, task);
+        break;
+    case FRACTAL_MULTIBROT4:
+        adaptiveRun(MultibrotIteration<4>(), pass, task);
+        break;
+    case FRACTAL_MULTIBROT5:
+        adaptiveRun(MultibrotIteration<5>(), pass, task);
+        break;
+    default:
+        adaptiveRun(MandelbrotIteration(), pass, task);
+        break;
+    }
+}
+
+static inline bool adaptiveEscaped(const AdaptivePass& pass, int pixel) {
+    float z_re = pass.savedRe[pixel], z_im = pass.savedIm[pixel];
+    return z_re * z_re + z_im * z_im > 4.f;
+}
+
+//
+// mandelbrotAdaptive --
+//
+// Render the image on the pool with limits from startIterations up to
+// maxIterations, taking at most budget steps in all.  Returns false,
+// leaving output undefined, if the first pass alone is over budget.
+bool mandelbrotAdaptive(
+    ThreadPool* pool, const Fractal& fractal,
+    float x0, float y0, float x1, float y1,
+    int width, int height,
+    int startIterations, int maxIterations, long long budget,
+    int output[], AdaptiveStats* stats)
+{
+    int tilesX = (width + ADAPTIVE_TILE_SIZE - 1) / ADAPTIVE_TILE_SIZE;
+    int tilesY = (height + ADAPTIVE_TILE_SIZE - 1) / ADAPTIVE_TILE_SIZE;
+    std::vector<float> savedRe((size_t)width * height), savedIm((size_t)width * height);
+
+    AdaptivePass pass;
+    pass.fractal = &fractal;
+    pass.x0 = x0;
+    pass.y0 = y0;
+    pass.x1 = x1;
+    pass.y1 = y1;
+    pass.width = width;
+    pass.height = height;
+    pass.limit = std::min(startIterations, maxIterations);
+    pass.first = true;
+    pass.output = output;
+    pass.savedRe = &savedRe[0];
+    pass.savedIm = &savedIm[0];
+
+    stats->passes = 0;
+    stats->tilesRerun = 0;
+    stats->bound = (long long)width * height * pass.limit;
+    if (stats->bound > budget)
+        return false;
+
+    // tiles whose pixels that did not escape were all run in the last pass
+    std::vector<int> tiles;
+    for (int tile = 0; tile < tilesX * tilesY; tile++)
+        tiles.push_back(tile);
+
+    while (true) {
+        threadPoolRun(pool, adaptivePassTask, &pass, pass.first ? tilesY : (int)pass.tilePixels.size());
+        stats->passes++;
+        stats->lastLimit = pass.limit;
+        if (pass.limit >= maxIterations)
+            break;
+        int nextLimit = (int)std::min((long long)pass.limit * ADAPTIVE_GROWTH, (long long)maxIterations);
+
+        // rank the tiles by their pixels that reached the limit next to
+        // one that escaped
+        std::vector<std::pair<int, int> > ranked;   // (-boundary pixels, tile)
+        std::vector<std::vector<int> > capped(tiles.size());
+        for (size_t t = 0; t < tiles.size(); t++) {
+            int tx = tiles[t] % tilesX * ADAPTIVE_TILE_SIZE, ty = tiles[t] / tilesX * ADAPTIVE_TILE_SIZE;
+            int tileWidth = std::min(ADAPTIVE_TILE_SIZE, width - tx);
+            int tileHeight = std::min(ADAPTIVE_TILE_SIZE, height - ty);
+            int boundary = 0;
+            for (int j = ty; j < ty + tileHeight; j++)
+                for (int i = tx; i < tx + tileWidth; i++) {
+                    int p = j * width + i;
+                    if (adaptiveEscaped(pass, p))
+                        continue;
+                    capped[t].push_back(p);
+                    if ((i > 0 && adaptiveEscaped(pass, p - 1)) ||
+                        (i + 1 < width && adaptiveEscaped(pass, p + 1)) ||
+                        (j > 0 && adaptiveEscaped(pass, p - width)) ||
+                        (j + 1 < height && adaptiveEscaped(pass, p + width)))
+                        boundary++;
+                }
+            if (boundary > 0 && boundary * ADAPTIVE_MIN_BOUNDARY >= tileWidth * tileHeight)
+                ranked.push_back(std::make_pair(-boundary, (int)t));
+        }
+        std::sort(ranked.begin(), ranked.end());
+
+        std::vector<std::vector<int> > nextPixels;
+        std::vector<int> nextTiles;
+        for (size_t r = 0; r < ranked.size(); r++) {
+            std::vector<int>& pixels = capped[ranked[r].second];
+            long long cost = (long long)pixels.size() * (nextLimit - pass.limit);
+            if (stats->bound + cost > budget)
+                continue;
+            stats->bound += cost;
+            nextPixels.push_back(std::vector<int>());
+            nextPixels.back().swap(pixels);
+            nextTiles.push_back(tiles[ranked[r].second]);
+        }
+        if (nextTiles.empty())
+            break;
 
-    while ((opt = getopt_long(argc, argv, "t:v:?", long_options, NULL)) != EOF) {
+        stats->tilesRerun += nextTiles.size();
+        pass.tilePixels.swap(nextPixels);
+        tiles.swap(nextTiles);
+        pass.limit = nextLimit;
+        pass.first = false;
+    }
+
+    for (int p = 0; p < width * height; p++)
+        if (!adaptiveEscaped(pass, p))
+            output[p] = maxIterations;
+    return true;
+}
+
+//
+// benchmarkAdaptive --
+//
+// Time mandelbrotAdaptive against mandelbrotThread with a uniform limit
+// of maxIterations.  Every pixel must match, except pixels that
+// mandelbrotAdaptive took to be in the set but that escape before
+// maxIterations.
+bool benchmarkAdaptive(int numThreads, const Fractal& fractal,
+                       float x0, float y0, float x1, float y1,
+                       int width, int height,
+                       int startIterations, int maxIterations, double budgetPerPixel)
+{
+    int* uniform = new int[width * height];
+    int* output = new int[width * height];
+    long long budget = (long long)(budgetPerPixel * width * height);
+
+    double minUniform = 1e30;
+    for (int i = 0; i < 3; ++i) {
+        double startTime = CycleTimer::currentSeconds();
+        mandelbrotThread(numThreads, x0, y0, x1, y1, width, height, maxIterations, uniform, &fractal);
+        minUniform = std::min(minUniform, CycleTimer::currentSeconds() - startTime);
+    }
+
+    ThreadPool pool;
+    threadPoolStart(&pool, numThreads);
+    AdaptiveStats stats;
+    bool ok = true;
+    double minAdaptive = 1e30;
+    for (int i = 0; ok && i < 3; ++i) {
+        double startTime = CycleTimer::currentSeconds();
+        ok = mandelbrotAdaptive(&pool, fractal, x0, y0, x1, y1, width, height,
+                                startIterations, maxIterations, budget, output, &stats);
+        minAdaptive = std::min(minAdaptive, CycleTimer::currentSeconds() - startTime);
+    }
+    threadPoolStop(&pool);
+    if (!ok) {
+        printf("Error : a budget of %.0f iterations per pixel is below the starting limit of %d\n",
+               budgetPerPixel, startIterations);
+        delete[] uniform;
+        delete[] output;
+        return false;
+    }
+
+    long long presumed = 0, wrong = 0;
+    for (int p = 0; p < width * height; p++) {
+        if (output[p] == uniform[p])
+            continue;
+        if (output[p] == maxIterations)
+            presumed++;
+        else if (wrong++ == 0)
+            printf("Mismatch : [%d][%d], Expected : %d, Actual : %d\n",
+                   p / width, p % width, uniform[p], output[p]);
+    }
+
+    printf("[mandelbrot uniform]:\t\t[%.3f] ms at %d iterations\n", minUniform * 1000, maxIterations);
+    printf("[mandelbrot adaptive]:\t\t[%.3f] ms, %d passes from %d to %d iterations\n",
+           minAdaptive * 1000, stats.passes, std::min(startIterations, maxIterations), stats.lastLimit);
+    printf("\t\t\t\t(%.2fx speedup, %d tiles run again, at most %.0f iterations per pixel)\n",
+           minUniform / minAdaptive, stats.tilesRerun, (double)stats.bound / (width * height));
+    printf("\t\t\t\t(%lld pixels (%.2f%%) taken to be in the set escape by %d iterations)\n",
+           presumed, 100. * presumed / (width * height), maxIterations);
+
+    if (wrong)
+        printf("Error : %lld pixels differ from the uniform render\n", wrong);
+    else
+        writePPMImage(output, width, height, "mandelbrot-adaptive.ppm", maxIterations);
+    delete[] uniform;
+    delete[] output;
+    return wrong == 0;
+}
+
+
+#ifndef MANDELBROT_LIBRARY
+int main(int argc, char** argv) {
+
+    const unsigned int width = 1200;
+    const unsigned int height = 800;
+    int maxIterations = 256;
+    int numThreads = 2;
+    int numFarmWorkers = 0;
+    int servePort = 0;
+    int cacheTiles = 512;
+    bool progressive = false;
+    int focusX = width / 2, focusY = height / 2;
+    double deadlineMs = 0;
+    Fractal fractal = mandelbrotFractal;
+    bool bailoutBenchmark = false;
+    bool interleaveBenchmark = false;
+    bool refillBenchmark = false;
+    bool equalize = false;
+    int batchViews = 0;
+    double buddhabrotSamples = 0;
+    bool distanceBenchmark = false;
+    std::vector<const ParallelBackend*> backends;
+    bool symmetry = false;
+    bool incremental = false;
+    int benchmarkFrameCount = 0;
+    const char* goldCacheDir = NULL;
+    bool diagnose = false;
+    const char* pyramidDir = NULL;
+    int pyramidDepth = PYRAMID_DEPTH;
+    bool fixedPointBenchmark = false;
+    const char* tuneProfile = NULL;
+    const char* checkpointPath = NULL;
+    bool checkpointVerify = false;
+    int adaptiveIterations = 0;
+    double adaptiveBudget = 0;
+    char farmAddress[256];
+    snprintf(farmAddress, sizeof(farmAddress), "unix:/tmp/mandelbrot-farm.%d.sock", (int)getpid());
+
+    float x0 = -2;
+    float x1 = 1;
+    float y0 = -1;
+    float y1 = 1;
+
+    // parse commandline options ////////////////////////////////////////////
+    int opt;
+    static struct option long_options[] = {
+        {"threads", 1, 0, 't'},
+        {"view", 1, 0, 'v'},
+        {"iterations", 1, 0, 'm'},
+        {"farm", 1, 0, 'f'},
+        {"listen", 1, 0, 'l'},
+        {"worker", 1, 0, 'w'},
+        {"serve", 1, 0, 's'},
+        {"cache", 1, 0, 'c'},
+        {"progressive", 2, 0, 'p'},
+        {"deadline", 1, 0, 'd'},
+        {"kernel", 1, 0, 'k'},
+        {"bailout", 0, 0, 'b'},
+        {"interleave", 0, 0, 'i'},
+        {"refill", 0, 0, 'r'},
+        {"equalize", 0, 0, 'e'},
+        {"batch", 1, 0, 'n'},
+        {"buddhabrot", 1, 0, 'o'},
+        {"distance", 0, 0, 'x'},
+        {"backend", 1, 0, 'a'},
+        {"symmetry", 0, 0, 'y'},
+        {"incremental", 0, 0, 'z'},
+        {"frames", 1, 0, 'u'},
+        {"gold-cache", 1, 0, 'g'},
+        {"diagnostics", 0, 0, 'j'},
+        {"pyramid", 1, 0, 'q'},
+        {"fixed", 0, 0, 'h'},
+        {"tune", 1, 0, 'T'},
+        {"checkpoint", 1, 0, 'C'},
+        {"verify-checkpoint", 0, 0, 'V'},
+        {"adaptive", 1, 0, 'A'},
+        {"help", 0, 0, '?'},
+        {0 ,0, 0, 0}
+    };
+
+    while ((opt = getopt_long(argc, argv, "t:v:m:f:l:w:s:c:p::d:k:biren:o:xa:yzu:g:jq:hT:C:VA:?", long_options, NULL)) != EOF) {
 
         switch (opt) {
         case 't':
@@ -499,6 +6796,198 @@ int main(int argc, char** argv) {
             }
             break;
         }
+        case 'm':
+        {
+            maxIterations = atoi(optarg);
+            if (maxIterations <= 0) {
+                fprintf(stderr, "Invalid iteration count\n");
+                return 1;
+            }
+            break;
+        }
+        case 'f':
+        {
+            numFarmWorkers = atoi(optarg);
+            if (numFarmWorkers < 0 || numFarmWorkers > FARM_MAX_WORKERS) {
+                fprintf(stderr, "Error: farm size must be between 0 and %d\n", FARM_MAX_WORKERS);
+                return 1;
+            }
+            break;
+        }
+        case 'l':
+        {
+            strncpy(farmAddress, optarg, sizeof(farmAddress) - 1);
+            farmAddress[sizeof(farmAddress) - 1] = '\0';
+            break;
+        }
+        case 'w':
+        {
+            return farmWorker(optarg);
+        }
+        case 's':
+        {
+            servePort = atoi(optarg);
+            break;
+        }
+        case 'c':
+        {
+            cacheTiles = std::max(1, atoi(optarg));
+            break;
+        }
+        case 'k':
+        {
+            if (!parseFractal(optarg, &fractal)) {
+                fprintf(stderr, "Invalid kernel %s\n", optarg);
+                return 1;
+            }
+            break;
+        }
+        case 'b':
+        {
+            bailoutBenchmark = true;
+            break;
+        }
+        case 'i':
+        {
+            interleaveBenchmark = true;
+            break;
+        }
+        case 'n':
+        {
+            batchViews = atoi(optarg);
+            if (batchViews <= 0) {
+                fprintf(stderr, "Invalid batch size %s\n", optarg);
+                return 1;
+            }
+            break;
+        }
+        case 'o':
+        {
+            buddhabrotSamples = atof(optarg) * 1e6;
+            if (buddhabrotSamples < 1) {
+                fprintf(stderr, "Invalid sample count %s\n", optarg);
+                return 1;
+            }
+            break;
+        }
+        case 'a':
+        {
+            if (strcmp(optarg, "all") == 0) {
+                for (int i = 0; i < NUM_PARALLEL_BACKENDS; i++)
+                    if (parallelBackends[i].render)
+                        backends.push_back(&parallelBackends[i]);
+            } else {
+                const ParallelBackend* backend = findParallelBackend(optarg);
+                if (!backend)
+                    return 1;
+                backends.push_back(backend);
+            }
+            break;
+        }
+        case 'g':
+        {
+            goldCacheDir = optarg;
+            break;
+        }
+        case 'u':
+        {
+            benchmarkFrameCount = atoi(optarg);
+            if (benchmarkFrameCount <= 0) {
+                fprintf(stderr, "Invalid frame count %s\n", optarg);
+                return 1;
+            }
+            break;
+        }
+        case 'h':
+        {
+            fixedPointBenchmark = true;
+            break;
+        }
+        case 'T':
+        {
+            tuneProfile = optarg;
+            break;
+        }
+        case 'C':
+        {
+            checkpointPath = optarg;
+            break;
+        }
+        case 'V':
+        {
+            checkpointVerify = true;
+            break;
+        }
+        case 'A':
+        {
+            int fields = sscanf(optarg, "%d,%lf", &adaptiveIterations, &adaptiveBudget);
+            if (fields < 1 || adaptiveIterations <= 0 || (fields == 2 && adaptiveBudget <= 0)) {
+                fprintf(stderr, "Invalid adaptive limit %s\n", optarg);
+                return 1;
+            }
+            break;
+        }
+        case 'q':
+        {
+            // DIR[,DEPTH]: a trailing number after the last comma is the depth
+            pyramidDir = optarg;
+            char* comma = strrchr(optarg, ',');
+            if (comma) {
+                char* end;
+                long depth = strtol(comma + 1, &end, 10);
+                if (end == comma + 1 || *end != '\0' || depth < 0 || depth > PYRAMID_MAX_DEPTH) {
+                    fprintf(stderr, "Invalid pyramid depth %s (0 to %d)\n", comma + 1, PYRAMID_MAX_DEPTH);
+                    return 1;
+                }
+                pyramidDepth = depth;
+                *comma = '\0';
+            }
+            break;
+        }
+        case 'j':
+        {
+            diagnose = true;
+            break;
+        }
+        case 'z':
+        {
+            incremental = true;
+            break;
+        }
+        case 'y':
+        {
+            symmetry = true;
+            break;
+        }
+        case 'x':
+        {
+            distanceBenchmark = true;
+            break;
+        }
+        case 'e':
+        {
+            equalize = true;
+            break;
+        }
+        case 'r':
+        {
+            refillBenchmark = true;
+            break;
+        }
+        case 'd':
+        {
+            deadlineMs = atof(optarg);
+            break;
+        }
+        case 'p':
+        {
+            progressive = true;
+            if (optarg && sscanf(optarg, "%d,%d", &focusX, &focusY) != 2) {
+                fprintf(stderr, "Invalid focus pixel\n");
+                return 1;
+            }
+            break;
+        }
         case '?':
         default:
             usage(argv[0]);
@@ -507,34 +6996,99 @@ int main(int argc, char** argv) {
     }
     // end parsing of commandline options
 
+    if (servePort > 0)
+        return serveTiles(servePort, numThreads, cacheTiles);
+    if (bailoutBenchmark)
+        return benchmarkBailout(fractal, x0, y0, x1, y1, width, height) ? 0 : 1;
+    if (interleaveBenchmark)
+        return benchmarkInterleave(fractal, x0, y0, x1, y1, width, height, maxIterations) ? 0 : 1;
+    if (refillBenchmark)
+        return benchmarkStreaming(fractal, x0, y0, x1, y1, width, height, maxIterations) ? 0 : 1;
+    if (distanceBenchmark && fractal.kind != FRACTAL_MANDELBROT) {
+        fprintf(stderr, "Distance estimation (-x) supports only the mandelbrot kernel\n");
+        return 1;
+    }
+    if (distanceBenchmark)
+        return benchmarkDistance(x0, y0, x1, y1, width, height, maxIterations) ? 0 : 1;
+    if (batchViews > 0)
+        return benchmarkBatch(numThreads, batchViews, fractal, x0, y0, x1, y1, maxIterations) &&
+               benchmarkGallery(numThreads, batchViews, fractal, x0, y0, x1, y1, maxIterations) ? 0 : 1;
+    if (buddhabrotSamples > 0)
+        return benchmarkBuddhabrot(numThreads, (long long)buddhabrotSamples,
+                                   x0, y0, x1, y1, width, height, maxIterations) ? 0 : 1;
+    if (benchmarkFrameCount > 0)
+        return benchmarkFrames(numThreads, benchmarkFrameCount, fractal,
+                               x0, y0, x1, y1, width, height, maxIterations) ? 0 : 1;
+    if (fixedPointBenchmark)
+        return benchmarkFixedPoint(fractal, x0, y0, x1, y1, width, height, maxIterations) ? 0 : 1;
+    if (pyramidDir)
+        return benchmarkPyramid(numThreads, fractal, x0, y0, x1, y1, maxIterations,
+                                pyramidDepth, pyramidDir) ? 0 : 1;
+    if (adaptiveIterations > 0)
+        return benchmarkAdaptive(numThreads, fractal, x0, y0, x1, y1, width, height, maxIterations,
+                                 adaptiveIterations, adaptiveBudget > 0 ? adaptiveBudget : adaptiveIterations / 4.)
+               ? 0 : 1;
+    if (checkpointPath)
+        return renderCheckpointed(numThreads, fractal, x0, y0, x1, y1,
+                                  width, height, maxIterations, checkpointPath,
+                                  checkpointVerify) ? 0 : 1;
+
+    // only the threaded run below uses the tuned configuration
+    RenderConfig renderConfig = { numThreads, 0, 1 };
+    if (tuneProfile) {
+        if (!autotuneRenderConfig(tuneProfile, numThreads, fractal, x0, y0, x1, y1,
+                                  width, height, maxIterations, &renderConfig))
+            return 1;
+        if (renderConfig.numThreads != numThreads)
+            printf("[autotune]:\t\t\tthreaded run uses %d threads instead of -t %d\n",
+                   renderConfig.numThreads, numThreads);
+    }
 
-    int* output_serial = new int[width*height];
-    int* output_thread = new int[width*height];
+    // every render below should overwrite all of its pixels, so the
+    // frames come from a pool; they are poisoned rather than cleared so
+    // verifyResult catches any pixel a render leaves unwritten
+    FramePool frames;
+    framePoolInit(&frames, width * height, numThreads, true);
+    long pageFaults = minorPageFaults();
+    int* output_serial = framePoolAcquire(&frames);
+    int* output_thread = framePoolAcquire(&frames);
+    printf("[frame pool]:\t\t\t%ld page faults for 2 frames%s\n",
+           minorPageFaults() - pageFaults, frames.hugePages ? " on huge pages" : "");
 
     //
     // Run the serial implementation.  Run the code three times and
-    // take the minimum to get a good estimate.
+    // take the minimum to get a good estimate.  With -g, reuse the
+    // result and time of an earlier run if it is in the cache.
     //
-    memset(output_serial, 0, width * height * sizeof(int));
     double minSerial = 1e30;
-    for (int i = 0; i < 5; ++i) {
-        double startTime = CycleTimer::currentSeconds();
-        mandelbrotSerial(x0, y0, x1, y1, width, height, 0, height, maxIterations, output_serial);
-        double endTime = CycleTimer::currentSeconds();
-        minSerial = std::min(minSerial, endTime - startTime);
+    unsigned long long goldCacheKey = 0;
+    bool goldCached = false;
+    if (goldCacheDir) {
+        goldCacheKey = goldKey(fractal, x0, y0, x1, y1, width, height, maxIterations);
+        goldCached = loadGoldResult(goldCacheDir, goldCacheKey, width, height, output_serial, &minSerial);
+    }
+    if (!goldCached) {
+        for (int i = 0; i < 5; ++i) {
+            double startTime = CycleTimer::currentSeconds();
+            fractalSerial(fractal, x0, y0, x1, y1, width, height, 0, height, maxIterations, output_serial);
+            double endTime = CycleTimer::currentSeconds();
+            minSerial = std::min(minSerial, endTime - startTime);
+        }
+        if (goldCacheDir)
+            saveGoldResult(goldCacheDir, goldCacheKey, width, height, output_serial, minSerial);
     }
 
-    printf("[mandelbrot serial]:\t\t[%.3f] ms\n", minSerial * 1000);
+    printf("[mandelbrot serial]:\t\t[%.3f] ms%s\n", minSerial * 1000, goldCached ? " (cached)" : "");
     writePPMImage(output_serial, width, height, "mandelbrot-serial.ppm", maxIterations);
 
     //
     // Run the threaded version
     //
-    memset(output_thread, 0, width * height * sizeof(int));
     double minThread = 1e30;
     for (int i = 0; i < 5; ++i) {
         double startTime = CycleTimer::currentSeconds();
-        mandelbrotThread(numThreads, x0, y0, x1, y1, width, height, maxIterations, output_thread);
+        mandelbrotThreadRows(numThreads, x0, y0, x1, y1, width, height, 0, height,
+                             maxIterations, output_thread, &fractal, NULL, NULL, &renderConfig);
         double endTime = CycleTimer::currentSeconds();
         minThread = std::min(minThread, endTime - startTime);
     }
@@ -545,17 +7099,381 @@ int main(int argc, char** argv) {
     if (! verifyResult (output_serial, output_thread, width, height)) {
         printf ("Error : Output from threads does not match serial output\n");
 
-        delete[] output_serial;
-        delete[] output_thread;
+        framePoolDestroy(&frames);
 
         return 1;
     }
 
     // compute speedup
-    printf("\t\t\t\t(%.2fx speedup from %d threads)\n", minSerial/minThread, numThreads);
+    printf("\t\t\t\t(%.2fx speedup from %d threads)\n", minSerial/minThread, renderConfig.numThreads);
+
+    //
+    // Run the threaded version again, copying mirrored rows
+    //
+    if (symmetry) {
+        int* output_symmetric = framePoolAcquire(&frames);
+        double minSymmetric = 1e30;
+        int mirrored = 0;
+        for (int i = 0; i < 5; ++i) {
+            double startTime = CycleTimer::currentSeconds();
+            mirrored = mandelbrotThreadSymmetric(numThreads, x0, y0, x1, y1, width, height,
+                                                 maxIterations, output_symmetric, &fractal);
+            double endTime = CycleTimer::currentSeconds();
+            minSymmetric = std::min(minSymmetric, endTime - startTime);
+        }
+
+        bool ok = verifyResult (output_serial, output_symmetric, width, height);
+        framePoolRelease(&frames, output_symmetric);
+        if (!ok) {
+            printf ("Error : Output from mirrored render does not match serial output\n");
+
+            framePoolDestroy(&frames);
+
+            return 1;
+        }
+
+        printf("[mandelbrot symmetric]:\t\t[%.3f] ms\n", minSymmetric * 1000);
+        printf("\t\t\t\t(%.2fx speedup over the threaded render, %d of %d rows mirrored)\n",
+               minThread/minSymmetric, mirrored, height);
+    }
+
+    //
+    // Pan by (16, 8) pixels, then zoom in 2x about the center, each time
+    // updating the previous frame in place
+    //
+    if (incremental) {
+        // start from the view moved onto an exact grid, then pan by
+        // (16, 8) pixels and zoom 2x about the center of the panned view
+        float px0 = x0, py0 = y0, px1 = x1, py1 = y1;
+        snapViewToGrid(px0, px1, py0, py1, width, height);
+        float dx = (px1 - px0) / width, dy = (py1 - py0) / height;
+        float views[2][4] = {
+            { px0, py0, px1, py1 },
+            { px0, py0, px1, py1 },
+        };
+        scaleAndShift(views[0][0], views[0][2], views[0][1], views[0][3], 1.f, 16 * dx, 8 * dy);
+        float centerX = views[0][0] + width / 2 * dx, centerY = views[0][1] + height / 2 * dy;
+        views[1][0] = views[0][0];
+        views[1][1] = views[0][1];
+        views[1][2] = views[0][2];
+        views[1][3] = views[0][3];
+        scaleAndShift(views[1][0], views[1][2], views[1][1], views[1][3], .5f, centerX / 2, centerY / 2);
+        const char* names[2] = { "pan", "zoom" };
+        int* frame = framePoolAcquire(&frames);
+        int* previous = framePoolAcquire(&frames);
+        int* output_full = framePoolAcquire(&frames);
+        mandelbrotThread(numThreads, px0, py0, px1, py1, width, height, maxIterations, previous, &fractal);
+        for (int v = 0; v < 2; v++) {
+            double minIncremental = 1e30, minFull = 1e30;
+            int reused = 0;
+            for (int i = 0; i < 5; ++i) {
+                memcpy(frame, previous, width * height * sizeof(int));
+                double startTime = CycleTimer::currentSeconds();
+                reused = mandelbrotIncremental(numThreads, px0, py0, px1, py1, frame,
+                                               views[v][0], views[v][1], views[v][2], views[v][3],
+                                               width, height, maxIterations, frame, &fractal);
+                double midTime = CycleTimer::currentSeconds();
+                mandelbrotThread(numThreads, views[v][0], views[v][1], views[v][2], views[v][3],
+                                 width, height, maxIterations, output_full, &fractal);
+                double endTime = CycleTimer::currentSeconds();
+                minIncremental = std::min(minIncremental, midTime - startTime);
+                minFull = std::min(minFull, endTime - midTime);
+            }
+
+            if (!verifyResult (output_full, frame, width, height)) {
+                printf ("Error : Output from incremental %s does not match full render\n", names[v]);
+
+                framePoolRelease(&frames, frame);
+                framePoolRelease(&frames, previous);
+                framePoolRelease(&frames, output_full);
+                framePoolDestroy(&frames);
+
+                return 1;
+            }
+
+            printf("[mandelbrot %s]:\t\t[%.3f] ms\n", names[v], minIncremental * 1000);
+            printf("\t\t\t\t(%.2fx speedup over a full render, %.1f%% of pixels reused)\n",
+                   minFull / minIncremental, 100. * reused / (width * height));
+
+            memcpy(previous, frame, width * height * sizeof(int));
+            px0 = views[v][0];
+            py0 = views[v][1];
+            px1 = views[v][2];
+            py1 = views[v][3];
+        }
+        framePoolRelease(&frames, frame);
+        framePoolRelease(&frames, previous);
+        framePoolRelease(&frames, output_full);
+    }
+
+    //
+    // Run the same kernel under each backend asked for with -a
+    //
+    for (size_t b = 0; b < backends.size(); b++) {
+        int* output_backend = framePoolAcquire(&frames);
+        double minBackend = timeBackend(backends[b], numThreads, fractal, x0, y0, x1, y1,
+                                        width, height, maxIterations, output_backend);
+        bool ok = verifyResult (output_serial, output_backend, width, height);
+        framePoolRelease(&frames, output_backend);
+        if (!ok) {
+            printf ("Error : Output from backend %s does not match serial output\n", backends[b]->name);
+
+            framePoolDestroy(&frames);
+
+            return 1;
+        }
+
+        printf("[mandelbrot %s]:\t\t[%.3f] ms\n", backends[b]->name, minBackend * 1000);
+        printf("\t\t\t\t(%.2fx speedup from %d threads)\n", minSerial/minBackend, numThreads);
+    }
+
+    //
+    // Run the threaded version again, building per-thread histograms
+    // on the way, and color the result by histogram equalization
+    //
+    if (equalize) {
+        int* output_equalized = framePoolAcquire(&frames);
+        size_t histogramBytes = (size_t)numThreads * histogramStride(maxIterations) * sizeof(int);
+        void* histogramMemory;
+        if (posix_memalign(&histogramMemory, HISTOGRAM_ALIGNMENT, histogramBytes) != 0) {
+            fprintf(stderr, "Cannot allocate %zu bytes of histograms\n", histogramBytes);
+            framePoolDestroy(&frames);
+            return 1;
+        }
+        int* histograms = static_cast<int*>(histogramMemory);
+        int* table = new int[maxIterations + 1];
+        unsigned char* rgb = new unsigned char[3 * width * height];
+        double minEqualized = 1e30;
+        for (int i = 0; i < 5; ++i) {
+            double startTime = CycleTimer::currentSeconds();
+            memset(histograms, 0, histogramBytes);
+            mandelbrotThreadRows(numThreads, x0, y0, x1, y1, width, height, 0, height,
+                                 maxIterations, output_equalized, &fractal, histograms);
+            equalizationTable(histograms, numThreads, maxIterations, table);
+            colorizeThread(numThreads, output_equalized, width, height, maxIterations, table, rgb);
+            double endTime = CycleTimer::currentSeconds();
+            minEqualized = std::min(minEqualized, endTime - startTime);
+        }
+
+        printf("[mandelbrot equalized]:\t\t[%.3f] ms\n", minEqualized * 1000);
+        writePPMImageRGB(rgb, width, height, "mandelbrot-equalized.ppm");
+        printf("\t\t\t\t(%+.1f%% over the threaded render)\n", 100. * (minEqualized / minThread - 1));
+
+        bool ok = verifyResult (output_serial, output_equalized, width, height);
+        framePoolRelease(&frames, output_equalized);
+        free(histograms);
+        delete[] table;
+        delete[] rgb;
+        if (!ok) {
+            printf ("Error : Output from equalized render does not match serial output\n");
+
+            framePoolDestroy(&frames);
+
+            return 1;
+        }
+    }
+
+    //
+    // Run the threaded version again, timing every band of rows, and
+    // write where the time went
+    //
+    if (diagnose) {
+        int* output_diagnosed = framePoolAcquire(&frames);
+        RenderDiagnostics diagnostics;
+        double minDiagnosed = 1e30;
+        for (int i = 0; i < 5; ++i) {
+            renderDiagnosticsInit(&diagnostics, height, numThreads);
+            double startTime = CycleTimer::currentSeconds();
+            mandelbrotThreadRows(numThreads, x0, y0, x1, y1, width, height, 0, height,
+                                 maxIterations, output_diagnosed, &fractal, NULL, &diagnostics);
+            double endTime = CycleTimer::currentSeconds();
+            minDiagnosed = std::min(minDiagnosed, endTime - startTime);
+        }
+
+        printf("[mandelbrot diagnosed]:\t\t[%.3f] ms\n", minDiagnosed * 1000);
+        writeRenderDiagnostics(&diagnostics, output_diagnosed, width, height, maxIterations, "mandelbrot");
+        printf("\t\t\t\t(%+.1f%% over the threaded render)\n", 100. * (minDiagnosed / minThread - 1));
+
+        bool ok = verifyResult (output_serial, output_diagnosed, width, height);
+        framePoolRelease(&frames, output_diagnosed);
+        if (!ok) {
+            printf ("Error : Output from diagnosed render does not match serial output\n");
+
+            framePoolDestroy(&frames);
+
+            return 1;
+        }
+    }
+
+    //
+    // Run the progressive version, reporting the time to each pass
+    //
+    if (progressive) {
+        ThreadPool pool;
+        threadPoolStart(&pool, numThreads);
+        int* output_progressive = framePoolAcquire(&frames);
+        ProgressReport report;
+        report.width = width;
+        report.height = height;
+        report.maxIterations = maxIterations;
+        report.startTime = CycleTimer::currentSeconds();
+        mandelbrotProgressive(&pool, x0, y0, x1, y1, width, height, maxIterations,
+                              focusX, focusY, output_progressive, reportProgress, &report, &fractal);
+        threadPoolStop(&pool);
+
+        bool ok = verifyResult (output_serial, output_progressive, width, height);
+        framePoolRelease(&frames, output_progressive);
+        if (!ok) {
+            printf ("Error : Output from progressive does not match serial output\n");
+
+            framePoolDestroy(&frames);
+
+            return 1;
+        }
+    }
+
+    //
+    // Run against a deadline and check the part that got rendered
+    //
+    if (deadlineMs > 0) {
+        ThreadPool pool;
+        threadPoolStart(&pool, numThreads);
+        int* output_deadline = framePoolAcquire(&frames);
+        unsigned char* coverage = new unsigned char[width*height];
+        CancelToken token;
+        double startTime = CycleTimer::currentSeconds();
+        cancelTokenInit(&token, startTime + deadlineMs / 1000);
+        bool complete = mandelbrotCancellable(&pool, &token, x0, y0, x1, y1, width, height,
+                                              maxIterations, output_deadline, coverage, &fractal);
+        double endTime = CycleTimer::currentSeconds();
+        threadPoolStop(&pool);
+
+        int covered = 0, mismatches = 0;
+        for (unsigned int i = 0; i < width * height; i++) {
+            if (coverage[i]) {
+                covered++;
+                if (output_deadline[i] != output_serial[i])
+                    mismatches++;
+            }
+        }
+        framePoolRelease(&frames, output_deadline);
+        delete[] coverage;
+
+        printf("[mandelbrot deadline]:\t\t[%.3f] ms, %s, %.1f%% of pixels rendered\n",
+               (endTime - startTime) * 1000, complete ? "complete" : "stopped early",
+               100. * covered / (width * height));
+        if (mismatches > 0) {
+            printf ("Error : Output from deadline render does not match serial output\n");
+
+            framePoolDestroy(&frames);
+
+            return 1;
+        }
+
+        //
+        // A second request in the same session supersedes the first a
+        // quarter of the way into its expected time: the first must
+        // stop early, the second must complete
+        //
+        threadPoolStart(&pool, numThreads);
+        RenderSession session;
+        renderSessionInit(&session);
+        SessionRender renders[2];
+        for (int r = 0; r < 2; r++) {
+            SessionRender& render = renders[r];
+            render.pool = &pool;
+            render.session = &session;
+            cancelTokenInit(&render.token, 0);
+            render.x0 = x0;
+            render.y0 = y0;
+            render.x1 = x1;
+            render.y1 = y1;
+            render.width = width;
+            render.height = height;
+            render.maxIterations = maxIterations;
+            render.output = framePoolAcquire(&frames);
+            render.coverage = new unsigned char[width*height];
+            render.fractal = &fractal;
+            render.complete = false;
+        }
+        pthread_t first;
+        startTime = CycleTimer::currentSeconds();
+        renderSessionBegin(&session, &renders[0].token);
+        pthread_create(&first, NULL, sessionRenderStart, &renders[0]);
+        usleep((useconds_t)(minThread / 4 * 1e6));
+        renderSessionBegin(&session, &renders[1].token);
+        sessionRenderStart(&renders[1]);
+        endTime = CycleTimer::currentSeconds();
+        pthread_join(first, NULL);
+        threadPoolStop(&pool);
+        pthread_mutex_destroy(&session.lock);
+
+        int coveredFirst = 0;
+        mismatches = 0;
+        for (unsigned int i = 0; i < width * height; i++) {
+            coveredFirst += renders[0].coverage[i];
+            if ((renders[0].coverage[i] && renders[0].output[i] != output_serial[i]) ||
+                !renders[1].coverage[i] || renders[1].output[i] != output_serial[i])
+                mismatches++;
+        }
+        bool superseded = !renders[0].complete && renders[1].complete;
+        for (int r = 0; r < 2; r++) {
+            framePoolRelease(&frames, renders[r].output);
+            delete[] renders[r].coverage;
+        }
+
+        printf("[mandelbrot superseded]:\t[%.3f] ms for both, first stopped at %.1f%% of pixels\n",
+               (endTime - startTime) * 1000, 100. * coveredFirst / (width * height));
+        if (!superseded || mismatches > 0) {
+            printf ("Error : %s\n", !superseded ? "First render was not superseded by the second"
+                                                : "Output from superseded renders does not match serial output");
+
+            framePoolDestroy(&frames);
+
+            return 1;
+        }
+    }
+
+    //
+    // Run the tile farm.  Scaling efficiency is the speedup over the
+    // single-process threaded version divided by the number of workers.
+    //
+    if (numFarmWorkers > 0) {
+        Farm farm;
+        if (!farmStart(&farm, farmAddress, numFarmWorkers)) {
+            framePoolDestroy(&frames);
+            return 1;
+        }
+        int* output_farm = framePoolAcquire(&frames);
+        double minFarm = 1e30;
+        bool farmOk = true;
+        for (int i = 0; i < 5 && farmOk; ++i) {
+            double startTime = CycleTimer::currentSeconds();
+            farmOk = farmRender(&farm, numThreads, x0, y0, x1, y1, width, height, maxIterations, output_farm, &fractal);
+            double endTime = CycleTimer::currentSeconds();
+            minFarm = std::min(minFarm, endTime - startTime);
+        }
+        int farmSize = farm.workersJoined;
+        int redispatched = farm.tilesRedispatched;
+        farmStop(&farm);
+
+        if (!farmOk || !verifyResult (output_serial, output_farm, width, height)) {
+            printf ("Error : Output from farm does not match serial output\n");
+
+            framePoolDestroy(&frames);
+
+            return 1;
+        }
+
+        printf("[mandelbrot farm]:\t\t[%.3f] ms\n", minFarm * 1000);
+        writePPMImage(output_farm, width, height, "mandelbrot-farm.ppm", maxIterations);
+        printf("\t\t\t\t(%.2fx speedup from %d workers, %.0f%% scaling efficiency, %d tiles re-dispatched)\n",
+               minThread/minFarm, farmSize, 100. * minThread / (minFarm * farmSize), redispatched);
+        framePoolRelease(&frames, output_farm);
+    }
 
-    delete[] output_serial;
-    delete[] output_thread;
+    framePoolDestroy(&frames);
 
     return 0;
 }
+#endif // MANDELBROT_LIBRARY